@@ -0,0 +1,42 @@
+#ifndef COMMANDREGISTRY_H
+#define COMMANDREGISTRY_H
+
+#include <string_view>
+#include "Metrics.h"
+#include "OutputQueue.h"
+
+class TCPConn;
+
+// One menu command. Adding an entry to menu_commands in CommandRegistry.cpp is all it takes to
+// add a command: it is found, replied to, timed and listed in the menu from there.
+struct MenuCommand {
+   const char *name;             // what the user types, in lowercase (matched in any case)
+   metric_hist latency;          // histogram its handling time is recorded in
+   const char *reply;            // text sent back first, NULL for none
+   void (TCPConn::*action)();    // what it does after the reply, NULL for nothing
+   const char *help;             // its line in the menu, NULL to leave it out
+};
+
+/****************************************************************************************
+ * CommandRegistry - Looks up menu commands in a perfect hash table built at compile time,
+ *                   so dispatch is one hash of the input and one comparison no matter how
+ *                   many commands there are. Every static reply, and the menu itself, is
+ *                   built once into a SharedReply that connections queue without copying.
+ *
+ ****************************************************************************************/
+
+class CommandRegistry {
+   public:
+      // The command cmd names (ignoring case), NULL if there isn't one
+      static const MenuCommand *find(std::string_view cmd);
+
+      // The command's reply, empty if it doesn't have one
+      static const SharedReply &getReply(const MenuCommand &command);
+
+      static const SharedReply &getMenu();
+
+   private:
+      CommandRegistry() { };
+};
+
+#endif
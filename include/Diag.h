@@ -0,0 +1,129 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include "MPSCRing.h"
+#include <stdint.h>
+
+// Diagnostic levels, most to least severe
+#define DIAG_LEVEL_ERROR 1
+#define DIAG_LEVEL_WARN  2
+#define DIAG_LEVEL_INFO  3
+#define DIAG_LEVEL_DEBUG 4
+#define DIAG_LEVEL_TRACE 5
+
+// The most verbose level compiled in, set with configure --with-diag-level
+#ifndef DIAG_LEVEL
+#define DIAG_LEVEL DIAG_LEVEL_INFO
+#endif
+
+// Each call site prints at most this many messages a second and counts the rest
+const unsigned int diag_per_sec = 20;
+
+// Console ring geometry. Messages longer than a slot's text are truncated.
+const unsigned int diag_slot_size = 256;
+const unsigned int diag_ring_slots = 1024;       // must be a power of two
+
+// How long the console writer sleeps when the ring is empty
+const unsigned int diag_flush_ms = 20;
+
+/****************************************************************************************
+ * DiagLimiter - Per call site rate limit. Packs the current second and the number of
+ *               messages seen in it into one atomic, so checking costs a coarse clock read
+ *               and one atomic add.
+ *
+ ****************************************************************************************/
+
+class DiagLimiter {
+   public:
+      // True if this message may be printed. suppressed is set to the number of messages
+      // dropped in the site's last busy second, reported with the first one after it.
+      bool allow(uint32_t &suppressed);
+
+   private:
+      std::atomic<uint64_t> _state{0};
+};
+
+/****************************************************************************************
+ * Diag - The console sink for diagnostics. Like the Logger, callers copy the message into
+ *        a lock-free MPSCRing and return; a background thread writes batches to stdout. A
+ *        slow terminal or journal therefore stalls only that thread, and when the ring is
+ *        full messages are dropped and counted rather than blocking a reactor.
+ *
+ ****************************************************************************************/
+
+class Diag {
+   public:
+      ~Diag();
+
+      static Diag &getDiag();
+
+      void write(const std::string &msg, uint32_t suppressed);
+
+   private:
+      struct DiagEntry {
+         uint32_t len;
+         char text[diag_slot_size - sizeof(uint64_t) - sizeof(uint32_t)];
+      };
+
+      Diag();
+
+      void runWriter();
+      bool drain(std::string &buf);
+
+      MPSCRing<DiagEntry> _ring;
+
+      std::atomic<uint64_t> _dropped{0};
+      uint64_t _dropped_reported = 0;
+
+      std::atomic<bool> _stop{false};
+      std::thread _writer;
+};
+
+// Formats msg (anything that can follow <<) and queues it for the console
+#define DIAG_EMIT(msg) \
+   do { \
+      static DiagLimiter diag_limiter; \
+      uint32_t diag_suppressed; \
+      if (diag_limiter.allow(diag_suppressed)) { \
+         std::ostringstream diag_out; \
+         diag_out << msg; \
+         Diag::getDiag().write(diag_out.str(), diag_suppressed); \
+      } \
+   } while (0)
+
+// Levels above DIAG_LEVEL expand to nothing, so their arguments are never evaluated
+#define DIAG_ERROR(msg) DIAG_EMIT(msg)
+
+#if DIAG_LEVEL >= DIAG_LEVEL_WARN
+#define DIAG_WARN(msg) DIAG_EMIT(msg)
+#else
+#define DIAG_WARN(msg) do { } while (0)
+#endif
+
+#if DIAG_LEVEL >= DIAG_LEVEL_INFO
+#define DIAG_INFO(msg) DIAG_EMIT(msg)
+#else
+#define DIAG_INFO(msg) do { } while (0)
+#endif
+
+#if DIAG_LEVEL >= DIAG_LEVEL_DEBUG
+#define DIAG_DEBUG(msg) DIAG_EMIT(msg)
+#else
+#define DIAG_DEBUG(msg) do { } while (0)
+#endif
+
+#if DIAG_LEVEL >= DIAG_LEVEL_TRACE
+#define DIAG_TRACE(msg) DIAG_EMIT(msg)
+#else
+#define DIAG_TRACE(msg) do { } while (0)
+#endif
+
+#endif
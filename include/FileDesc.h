@@ -4,7 +4,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/filter.h>
 #include <vector>
+#include <deque>
 #include <unistd.h>
 #include "exceptions.h"
 
@@ -15,6 +20,10 @@
 // SocketFD - Network socket FD with stored IP/port information in sockaddr_in
 // TermFD - Stdin terminal
 // FileFD - non-buffered file FD with ability to write/read binary data
+// EpollFD - epoll instance used to wait on readiness of a set of other FDs
+// UringFD - io_uring instance used to submit I/O on other FDs and reap the completions
+// EventFD - eventfd counter used by other threads to wake up an event loop
+// TimerFD - timerfd used to wake up an event loop at a precise time
 
 class FileDesc
 {
@@ -29,9 +38,12 @@ public:
    ssize_t writeFD(std::string &str);
    ssize_t writeFD(const char *data);
    ssize_t writeFD(const char *data, unsigned int len);
+   ssize_t writevFD(const struct iovec *iov, int iovcnt);
 
    // Basic read function to read all string data off the FD
    ssize_t readFD(std::string &buf);
+   ssize_t readFD(char *buf, size_t len);
+   ssize_t readvFD(const struct iovec *iov, int iovcnt);
 
    // Reads one character from the buffer at a time until it finds a newline
    ssize_t readStr(std::string &buf);
@@ -143,10 +155,14 @@ public:
    SocketFD();
    ~SocketFD();
 
+   void setReusePort();
+   bool attachFilter(const std::vector<struct sock_filter> &prog);
+   void detachFilter();
    void bindFD(const char *ip_addr, unsigned short int port);
-   bool connectTo(const char *ip_addr, unsigned short port);
+   bool connectTo(const char *ip_addr, unsigned short port, bool nonblocking = false);
    void listenFD(int backlog = 5);
    bool acceptFD(SocketFD &server);
+   void attachFD(int fd);
 
    unsigned long getIPAddr();
    void getIPAddrStr(std::string &buf);
@@ -193,5 +209,105 @@ private:
    std::string _filename; 
 };
 
+/********************************************************************************************
+ * EpollFD class - wraps an epoll instance so a single thread can wait for readiness on many
+ *                 FDs at once without polling each of them
+ *
+ ********************************************************************************************/
+
+class EpollFD : public FileDesc {
+public:
+   EpollFD(int max_events = 256);
+   ~EpollFD();
+
+   void addFD(int fd, uint32_t events);
+   void modFD(int fd, uint32_t events);
+   void delFD(int fd);
+
+   // Blocks until at least one registered FD is ready, returns the number of ready events
+   int waitFD(std::vector<epoll_event> &events, int ms_timeout = -1);
+
+private:
+   int _max_events;
+};
+
+/********************************************************************************************
+ * EventFD class - a nonblocking eventfd counter. Any thread can call notify, and the FD is
+ *                 readable (to epoll or io_uring) until the owner calls drain.
+ *
+ ********************************************************************************************/
+
+class EventFD : public FileDesc {
+public:
+   EventFD();
+   ~EventFD();
+
+   void notify();
+   uint64_t drain();
+};
+
+/********************************************************************************************
+ * TimerFD class - a nonblocking CLOCK_MONOTONIC timerfd. It becomes readable (to epoll) once
+ *                 the time it is armed for has passed, until the owner calls drain.
+ *
+ ********************************************************************************************/
+
+class TimerFD : public FileDesc {
+public:
+   TimerFD();
+   ~TimerFD();
+
+   void armAt(uint64_t when_ns);
+   void disarm();
+   uint64_t drain();
+};
+
+/********************************************************************************************
+ * UringFD class - wraps an io_uring instance (without liburing). Operations are queued on the
+ *                 submission ring with the prep methods and all handed to the kernel with a
+ *                 single submitAndWait call, then completions are read with getCompletion.
+ *                 Each operation carries a 64 bit user_data value that comes back with it.
+ *
+ ********************************************************************************************/
+
+class UringFD : public FileDesc {
+public:
+   UringFD(unsigned int entries = 1024);
+   ~UringFD();
+
+   void prepAccept(int fd, uint64_t user_data);
+   void prepRecv(int fd, void *buf, size_t len, uint64_t user_data);
+   void prepRead(int fd, void *buf, size_t len, uint64_t user_data);
+   void prepWritev(int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t user_data);
+   void prepCancel(uint64_t target, uint64_t user_data);
+
+   // Submits everything queued and waits for at least wait_nr completions
+   int submitAndWait(unsigned int wait_nr = 1);
+
+   // Pops the next completion, false if there are none waiting
+   bool getCompletion(uint64_t &user_data, int &res);
+
+private:
+   io_uring_sqe *getSQE();
+   bool popCompletion(uint64_t &user_data, int &res);
+
+   void *_ring_ptr = NULL;
+   size_t _ring_size = 0;
+   io_uring_sqe *_sqes = NULL;
+   size_t _sqes_size = 0;
+
+   // Pointers into the shared submission and completion rings
+   unsigned int *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+   unsigned int *_cq_head, *_cq_tail, *_cq_mask;
+   io_uring_cqe *_cqes;
+
+   // SQEs filled in but not yet handed to the kernel
+   unsigned int _to_submit = 0;
+
+   // Completions taken off the ring to make room while the submission queue was full, not
+   // yet returned by getCompletion (user_data, res)
+   std::deque<std::pair<uint64_t, int>> _backlog;
+};
+
 
 #endif
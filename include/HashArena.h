@@ -0,0 +1,39 @@
+#ifndef HASHARENA_H
+#define HASHARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/****************************************************************************************
+ * HashArena - A block of memory big enough for one Argon2 hash, mapped and pre-faulted once
+ *             (on huge pages when the system has them) and reused for every hash run on the
+ *             thread that installed it. libargon2 gets it through the allocate/deallocate
+ *             callbacks of argon2_context, so a hash no longer pays for mapping, faulting in
+ *             and unmapping 64 MiB each time.
+ *
+ ****************************************************************************************/
+
+class HashArena {
+   public:
+      HashArena(size_t size);
+      ~HashArena();
+
+      // Makes this arena the one Argon2 uses on the calling thread (NULL to go back to malloc)
+      static void setThreadArena(HashArena *arena);
+      static HashArena *getThreadArena();
+
+      // argon2_context allocate_cbk/free_cbk
+      static int allocate(uint8_t **memory, size_t bytes_to_allocate);
+      static void deallocate(uint8_t *memory, size_t bytes_to_allocate);
+
+      size_t getSize() { return _size; };
+      bool usesHugePages() { return _hugepages; };
+
+   private:
+      uint8_t *_mem = NULL;
+      size_t _size;
+      bool _hugepages = false;
+      bool _in_use = false;
+};
+
+#endif
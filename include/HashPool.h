@@ -0,0 +1,127 @@
+#ifndef HASHPOOL_H
+#define HASHPOOL_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "FileDesc.h"
+
+class HashCompletionQueue;
+
+// The password operations the pool runs on behalf of a connection
+enum hash_job_type { hash_check, hash_change };
+
+// hash_done jobs have a result, the others were dropped to protect the server: hash_shed when
+// the wait queue was full, hash_expired when the job waited past its deadline
+enum hash_job_status { hash_done, hash_shed, hash_expired };
+
+// A password hashing request and, once a worker has run it, its result
+struct HashJob {
+   hash_job_type type;
+   std::string name;
+   std::string passwd;
+   bool result = false;
+   hash_job_status status = hash_done;
+
+   // Set by submit, the job is dropped if no worker has started it by the deadline
+   std::chrono::steady_clock::time_point queued;
+   std::chrono::steady_clock::time_point deadline;
+
+   // Which connection gets the result, and the queue of the reactor that owns it. The FD alone
+   // isn't enough since the connection may close and the FD get reused while the job runs.
+   int fd;
+   uint64_t conn_id;
+   HashCompletionQueue *done;
+};
+
+/****************************************************************************************
+ * HashCompletionQueue - Finished jobs waiting for the reactor that owns their connection.
+ *                       The eventfd becomes readable when jobs are pushed so the reactor
+ *                       can wait on it along with its sockets.
+ *
+ ****************************************************************************************/
+
+class HashCompletionQueue {
+   public:
+      HashCompletionQueue();
+      ~HashCompletionQueue();
+
+      void push(std::unique_ptr<HashJob> job);
+      void popAll(std::vector<std::unique_ptr<HashJob>> &jobs);
+
+      // Wakes the owning reactor without a job, so it notices it has been stopped
+      void wake() { _eventfd.notify(); };
+
+      int getFD() { return _eventfd.getFD(); };
+      void drainFD() { _eventfd.drain(); };
+
+   private:
+      EventFD _eventfd;
+
+      std::mutex _lock;
+      std::vector<std::unique_ptr<HashJob>> _jobs;
+};
+
+// Counters for sizing the pool, read with HashPool::getStats
+struct HashPoolStats {
+   uint64_t submitted = 0;
+   uint64_t shed = 0;
+   uint64_t expired = 0;
+   uint64_t completed = 0;
+
+   unsigned int queue_depth = 0;
+   unsigned int max_queue_depth = 0;
+
+   // Time jobs spent queued before a worker started (or dropped) them
+   uint64_t wait_us_total = 0;
+   uint64_t wait_us_max = 0;
+};
+
+/****************************************************************************************
+ * HashPool - A fixed set of worker threads that run the Argon2 password checks and changes
+ *            so the reactor threads never stall on them. Each worker holds one hash worth
+ *            of memory, so the memory budget is applied only by capping the number of
+ *            workers. Jobs beyond that wait in a bounded queue and are shed once it is
+ *            full. An expiry thread sends back those that wait past their deadline.
+ *
+ ****************************************************************************************/
+
+class HashPool {
+   public:
+      HashPool(const char *pwd_file, unsigned int num_workers, size_t mem_budget = 0,
+               unsigned int max_queue = 256, unsigned int deadline_ms = 5000);
+      ~HashPool();
+
+      // Returns false (and drops the job) if the queue is full
+      bool submit(std::unique_ptr<HashJob> job);
+
+      void getStats(HashPoolStats &stats);
+      unsigned int getNumWorkers() { return _workers.size(); };
+
+   private:
+      void runWorker();
+      void runExpiry();
+      void recordWait(const HashJob &job, std::chrono::steady_clock::time_point now);
+
+      std::string _pwd_file;
+
+      unsigned int _max_queue;
+      std::chrono::milliseconds _deadline;
+      HashPoolStats _stats;
+
+      std::vector<std::thread> _workers;
+
+      std::mutex _lock;
+      std::condition_variable _cond;
+      std::condition_variable _expiry_cond;
+      std::thread _expiry;
+      std::deque<std::unique_ptr<HashJob>> _queue;
+      bool _stopping = false;
+};
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <sys/types.h>
+#include <stdint.h>
+#include "MPSCRing.h"
+
+const char journal_dir[] = "journal";
+
+// Records per segment before it is sealed (indexed) and a new one started, 24 MiB each
+const uint64_t journal_segment_records = 1 << 20;
+
+const unsigned int journal_ring_slots = 4096;    // must be a power of two
+const unsigned int journal_flush_ms = 10;
+
+// Longest username interned, longer ones are truncated
+const unsigned int journal_namelen = 32;
+
+const char journal_seg_magic[8] = {'E', 'V', 'J', 'R', 'N', 'L', '0', '1'};
+const char journal_idx_magic[8] = {'E', 'V', 'J', 'I', 'D', 'X', '0', '1'};
+
+enum journal_event { je_none = 0, je_connect = 1, je_login = 2, je_disconnect = 3 };
+enum journal_outcome { jo_ok = 0, jo_denied = 1, jo_unknown_user = 2, jo_bad_passwd = 3 };
+
+/****************************************************************************************
+ * Journal layout, in the journal directory (native byte order):
+ *
+ *    names - interned usernames, each a uint8_t length then the name. A record's user_id is
+ *            the name's position in the file counting from 1, 0 for no user.
+ *    seg-<start_us>.jrn - JournalSegHeader then JournalRecords, in time order
+ *    seg-<start_us>.idx - written when a segment is sealed: JournalIdxHeader then one
+ *                         JournalIdxEntry per record, sorted by address
+ *
+ * Segment names sort in time order, and a segment without an .idx is the one being written
+ * (or one a crash left unsealed, which the next server start seals).
+ ****************************************************************************************/
+
+struct JournalRecord {
+   uint64_t time_us;          // microseconds since the epoch, never decreasing in a journal
+   uint32_t ipaddr;           // IPv4 address, host byte order
+   uint32_t user_id;
+   uint16_t event;            // journal_event
+   uint16_t outcome;          // journal_outcome
+   uint32_t reserved;
+};
+
+struct JournalSegHeader {
+   char magic[8];
+   uint32_t record_size;
+   uint32_t reserved;
+   uint64_t start_us;
+};
+
+struct JournalIdxHeader {
+   char magic[8];
+   uint64_t count;
+   uint64_t min_us;
+   uint64_t max_us;
+};
+
+struct JournalIdxEntry {
+   uint32_t ipaddr;
+   uint32_t recno;
+};
+
+/****************************************************************************************
+ * JournalSegment - Read-only mmap of one journal segment and its index, if it has one
+ *
+ ****************************************************************************************/
+
+class JournalSegment {
+   public:
+      JournalSegment();
+      ~JournalSegment();
+
+      // Maps path (a .jrn file) and its .idx. Returns false if the segment can't be read.
+      bool openSegment(const std::string &path);
+
+      uint64_t getCount() { return _count; };
+      const JournalRecord *getRecords() { return _records; };
+
+      bool hasIndex() { return _idx_header != NULL; };
+      const JournalIdxHeader *getIndexHeader() { return _idx_header; };
+      const JournalIdxEntry *getIndex() { return (const JournalIdxEntry *) (_idx_header + 1); };
+
+      // First record at or after time_us (records are in time order)
+      uint64_t findTime(uint64_t time_us);
+
+      // Sorts a segment's records by address into its .idx file
+      static bool writeIndex(const std::string &path);
+
+   private:
+      void unmap();
+
+      void *_seg_map = NULL;
+      size_t _seg_size = 0;
+      void *_idx_map = NULL;
+      size_t _idx_size = 0;
+
+      const JournalRecord *_records = NULL;
+      uint64_t _count = 0;
+      const JournalIdxHeader *_idx_header = NULL;
+};
+
+/****************************************************************************************
+ * Journal - The optional binary event journal. Producers copy a typed event into a slot of
+ *           an MPSCRing and return without locking, formatting or making a syscall. A
+ *           writer thread interns the usernames, appends the records to the current segment
+ *           in batches and seals segments as they fill.
+ *
+ ****************************************************************************************/
+
+class Journal {
+   public:
+      ~Journal();
+
+      // Starts journaling into dir. Returns false, with the reason in results, if it can't.
+      static bool start(std::string &results, const char *dir = journal_dir);
+      static bool isEnabled();
+
+      // Writes out what is queued and seals the current segment. Events recorded after it are
+      // dropped.
+      static void stop();
+
+      // Records an event if the journal is running
+      static void record(journal_event event, journal_outcome outcome, unsigned long ipaddr,
+                                                                   const std::string &user);
+
+      // Segment paths in dir in time order, and the interned names (names[0] is "")
+      static void listSegments(const std::string &dir, std::vector<std::string> &segments);
+      static bool loadNames(const std::string &dir, std::vector<std::string> &names);
+
+   private:
+      struct JournalEntry {
+         uint64_t time_us;
+         uint32_t ipaddr;
+         uint16_t event;
+         uint16_t outcome;
+         uint8_t namelen;
+         char name[journal_namelen];
+      };
+
+      Journal(const std::string &dir);
+
+      void push(journal_event event, journal_outcome outcome, unsigned long ipaddr,
+                                                              const std::string &user);
+      void runWriter();
+      void stopWriter();
+      bool drain();
+      uint32_t intern(const char *name, size_t len);
+      bool openSegment(uint64_t start_us);
+      void sealSegment();
+      void writeOut(int fd, std::string &buf);
+
+      std::string _dir;
+
+      MPSCRing<JournalEntry> _ring;
+      std::atomic<uint64_t> _dropped{0};
+
+      // Only used by the writer thread
+      std::unordered_map<std::string, uint32_t> _name_ids;
+      int _names_fd = -1;
+      std::string _names_buf;
+      int _seg_fd = -1;
+      std::string _seg_path;
+      uint64_t _seg_count = 0;
+      std::string _seg_buf;
+      uint64_t _last_us = 0;
+
+      // Set after a segment couldn't be opened: when to try again, and records dropped since
+      uint64_t _open_retry_us = 0;
+      uint64_t _lost = 0;
+
+      std::atomic<bool> _stop{false};
+      std::thread _writer;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef LINEBUFFER_H
+#define LINEBUFFER_H
+
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include "FileDesc.h"
+
+// Longest line a client may send, including the newline. Input that fills the buffer without
+// completing a line (or that piles up while a login is being verified) is an error.
+const unsigned int line_buf_size = 1024;
+static_assert((line_buf_size & (line_buf_size - 1)) == 0, "line_buf_size must be a power of two");
+
+/****************************************************************************************
+ * LineBuffer - A fixed-size ring of input that frames newline-terminated lines. Data is read
+ *              into it with one read per readiness event (or received straight into its free
+ *              space), partial lines stay buffered until the rest arrives, and complete ones
+ *              are handed out in place as views. It never grows, moves data or allocates.
+ *
+ ****************************************************************************************/
+
+class LineBuffer {
+   public:
+      LineBuffer() { };
+
+      ssize_t fill(FileDesc &fd);
+
+      // Free space for a receive that completes later, then how much it received
+      char *getSpace(size_t &len);
+      void commit(size_t len) { _tail += len; };
+
+      bool hasLine() { return findNewline() != std::string::npos; };
+      bool getLine(std::string_view &line);
+
+      // True when unprocessed input takes up the whole buffer, so nothing more can be read
+      bool isFull() { return _tail - _head == line_buf_size; };
+
+   private:
+      size_t findNewline();
+
+      char _buf[line_buf_size];
+
+      // A line that wraps past the end of _buf is copied here to hand it out in one piece
+      char _wrapped[line_buf_size];
+
+      // Free-running offsets of the first unread byte and of the end of the data, masked into
+      // _buf when used. Their difference is the amount buffered.
+      size_t _head = 0;
+      size_t _tail = 0;
+
+      // Bytes from _head already searched for a newline
+      size_t _scanned = 0;
+};
+
+#endif
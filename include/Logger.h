@@ -0,0 +1,118 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "MPSCRing.h"
+#include <time.h>
+#include <stdint.h>
+
+const char server_log_file[] = "server.log";
+
+// Ring buffer geometry. Events longer than a slot's text are truncated.
+const unsigned int log_slot_size = 256;
+const unsigned int log_ring_slots = 4096;        // must be a power of two
+
+// How long the flusher sleeps when the ring is empty
+const unsigned int log_flush_ms = 10;
+
+// The active log is a preallocated segment of this size. It is sealed and compressed when it
+// fills or has been open for log_rotate_secs, and only the newest log_keep_segments
+// compressed segments are kept.
+const size_t log_segment_size = 64 * 1024 * 1024;
+const unsigned int log_rotate_secs = 24 * 60 * 60;
+const unsigned int log_keep_segments = 16;
+
+/****************************************************************************************
+ * Logger - The process-wide event log. Producers copy an event into a slot of a bounded,
+ *          lock-free MPSCRing and return, so logging never takes a lock or makes a syscall.
+ *          A background thread drains the ring, stamps each event with its time (formatted
+ *          once per second, like ctime) and copies whole batches into the active segment,
+ *          which is fallocate'd to log_segment_size and mapped into memory. If the ring is
+ *          full, events are dropped and counted instead of blocking, and the count is logged.
+ *
+ *          Rotation happens on the flusher thread between batches: the segment is trimmed
+ *          to its used length and renamed to <log>.<YYYYmmdd-HHMMSS>, and a new one is
+ *          started before the next batch is copied, so no events are lost. A second, low
+ *          priority thread gzips sealed segments and prunes old ones. Segments left by a
+ *          crash are picked up at the next start: the active one is continued after its
+ *          last written byte and any sealed but uncompressed ones are compressed.
+ *
+ ****************************************************************************************/
+
+class Logger {
+   public:
+      ~Logger();
+
+      // The logger for server.log, started on first use
+      static Logger &getLogger();
+
+      void log(const char *event);
+      void log(const char *event, size_t len);
+
+      // Writes out what is queued, trims the active segment and stops the background threads
+      void stop();
+
+      uint64_t getDropped() { return _dropped.load(std::memory_order_relaxed); };
+
+   private:
+      // Sized so that with the ring's sequence number it fills log_slot_size
+      struct LogEntry {
+         time_t when;
+         uint32_t len;
+         char text[log_slot_size - sizeof(uint64_t) - sizeof(time_t) - sizeof(uint32_t)];
+      };
+
+      Logger(const char *filename);
+
+      void runFlusher();
+      bool drain(std::string &buf);
+      void writeOut(std::string &buf);
+      void formatTime(time_t when);
+
+      bool openSegment();
+      void closeSegment();
+      void rotate();
+
+      void runCompressor();
+      void queueCompress(const std::string &path);
+      bool compressSegment(const std::string &path);
+      void findSealed();
+      void pruneSegments();
+
+      std::string _filename;
+      std::string _dir;
+      std::string _base;
+
+      // The active segment, written only by the flusher
+      int _fd = -1;
+      char *_seg = NULL;
+      size_t _seg_used = 0;
+      time_t _seg_opened = 0;
+
+      MPSCRing<LogEntry> _ring;
+
+      std::atomic<uint64_t> _dropped{0};
+      uint64_t _dropped_reported = 0;
+
+      // ctime-style text for _stamp_sec, reformatted when the second changes
+      time_t _stamp_sec = -1;
+      std::string _stamp;
+
+      std::atomic<bool> _stop{false};
+      std::thread _flusher;
+
+      // Sealed segments waiting for the compressor
+      std::mutex _comp_lock;
+      std::condition_variable _comp_cond;
+      std::deque<std::string> _comp_queue;
+      bool _comp_stop = false;
+      std::thread _compressor;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef MPSCRING_H
+#define MPSCRING_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/****************************************************************************************
+ * MPSCRing - A bounded, lock-free ring of T for many producer threads and one consumer.
+ *            A producer reserves a slot with one CAS, fills it in place and publishes it;
+ *            the consumer reads published slots in order and releases them. Each slot's
+ *            sequence number says whose turn it is: pos when free for the producer at pos,
+ *            pos + 1 once published, and pos + slots again when released. Producers never
+ *            wait, reserve() just fails when the ring is full.
+ *
+ ****************************************************************************************/
+
+template <typename T>
+class MPSCRing {
+   public:
+      // num_slots must be a power of two
+      MPSCRing(size_t num_slots):_slots(new Slot[num_slots]), _mask(num_slots - 1) {
+         for (size_t i = 0; i < num_slots; i++)
+            _slots[i].seq.store(i, std::memory_order_relaxed);
+      };
+
+      // Producer: claims the next slot, NULL if the ring is full
+      T *reserve(uint64_t &pos) {
+         pos = _tail.load(std::memory_order_relaxed);
+         while (true) {
+            Slot &slot = _slots[pos & _mask];
+            int64_t diff = (int64_t) slot.seq.load(std::memory_order_acquire) - (int64_t) pos;
+            if (diff == 0) {
+               if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                  return &slot.data;
+            } else if (diff < 0) {
+               return NULL;
+            } else {
+               pos = _tail.load(std::memory_order_relaxed);
+            }
+         }
+      };
+
+      // Producer: hands a filled slot to the consumer
+      void publish(uint64_t pos) {
+         _slots[pos & _mask].seq.store(pos + 1, std::memory_order_release);
+      };
+
+      // Consumer: the next slot in order if it has been published, otherwise NULL
+      T *peek() {
+         Slot &slot = _slots[_head & _mask];
+         if (slot.seq.load(std::memory_order_acquire) != _head + 1)
+            return NULL;
+         return &slot.data;
+      };
+
+      // Consumer: frees the slot returned by peek
+      void release() {
+         _slots[_head & _mask].seq.store(_head + _mask + 1, std::memory_order_release);
+         _head++;
+      };
+
+      // Consumer: how many slots are reserved or published but not yet released
+      size_t getDepth() { return _tail.load(std::memory_order_relaxed) - _head; };
+
+      // Consumer: true if nothing has been reserved past what was released (a false return
+      // with peek() returning NULL means a producer is still filling the next slot)
+      bool empty() { return _tail.load(std::memory_order_relaxed) == _head; };
+
+      size_t getNumSlots() { return _mask + 1; };
+
+   private:
+      struct alignas(64) Slot {
+         std::atomic<uint64_t> seq;
+         T data;
+      };
+
+      std::unique_ptr<Slot[]> _slots;
+      size_t _mask;
+
+      alignas(64) std::atomic<uint64_t> _tail{0};
+      alignas(64) uint64_t _head = 0;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+// Counters only ever go up, readers turn them into rates. mc_writes counts output flushes and
+// mc_throttled the flushes that left a connection too far behind to read more input.
+enum metric_counter { mc_conns_accepted, mc_conns_rejected, mc_bytes_in, mc_bytes_out,
+                      mc_commands, mc_writes, mc_throttled, mc_num_counters };
+
+// Gauges are current levels. Each thread adjusts its own and readers sum them.
+enum metric_gauge { mg_sess_username, mg_sess_passwd, mg_sess_verifying, mg_sess_menu,
+                    mg_sess_changepwd, mg_sess_confirmpwd, mg_log_queue_depth, mg_log_dropped,
+                    mg_num_gauges };
+
+// Latency histograms, recorded in nanoseconds
+enum metric_hist { mh_argon2_verify, mh_hash_wait, mh_cmd_hello, mh_cmd_menu, mh_cmd_exit,
+                   mh_cmd_passwd, mh_cmd_1, mh_cmd_2, mh_cmd_3, mh_cmd_4, mh_cmd_5,
+                   mh_cmd_unknown, mh_reactor_iter, mh_num_hists };
+
+// HDR histogram geometry: values below 2^metrics_sub_bits are exact, larger ones fall in
+// buckets 1/64th the width of their power of two (under 1.6% error), up to 2^metrics_max_bits
+// ns (about 68s) where they are clamped
+const unsigned int metrics_sub_bits = 7;
+const unsigned int metrics_max_bits = 36;
+const unsigned int metrics_hist_buckets = (1 << metrics_sub_bits) +
+                           (metrics_max_bits - metrics_sub_bits) * (1 << (metrics_sub_bits - 1));
+
+// Threads beyond this many share one slot that is not exported
+const unsigned int metrics_max_slots = 64;
+
+const char metrics_magic[8] = {'T', 'C', 'P', 'M', 'E', 'T', 'R', '3'};
+
+// Slow reactor iterations kept for tcpstat -s, the oldest are overwritten
+const unsigned int slow_ring_events = 64;
+const unsigned int slow_max_frames = 16;
+const unsigned int slow_frame_len = 112;
+
+/****************************************************************************************
+ * MetricsSlot - One thread's metrics. Only its thread writes it, with plain relaxed loads
+ *               and stores rather than locked adds, and it is cache-line aligned so no two
+ *               threads ever write the same line. Readers sum every slot.
+ *
+ ****************************************************************************************/
+
+struct alignas(64) MetricsSlot {
+   std::atomic<uint64_t> counters[mc_num_counters];
+   std::atomic<int64_t> gauges[mg_num_gauges];
+   std::atomic<uint64_t> hists[mh_num_hists][metrics_hist_buckets];
+};
+
+// A reactor iteration that ran past the watchdog's threshold, see Watchdog
+struct SlowEvent {
+   std::atomic<uint64_t> seq;          // 0 while being written, else ring position + 1
+   int64_t when_us;                    // wall clock time the iteration started
+   uint64_t duration_ns;
+   uint32_t reactor;
+   int32_t fd;                         // connection being handled, -1 if none
+   char handler[16];                   // reactor activity, like "input" or "hashdone"
+   char status[16];                    // the connection's status when it began, or ""
+   uint32_t num_frames;
+   char frames[slow_max_frames][slow_frame_len];
+};
+
+struct SlowRing {
+   std::atomic<uint64_t> next;
+   SlowEvent events[slow_ring_events];
+};
+
+// Start of the shared memory segment, followed by metrics_max_slots slots and the SlowRing
+struct alignas(64) MetricsHeader {
+   char magic[8];
+   uint32_t slot_size;
+   uint32_t max_slots;
+   std::atomic<uint32_t> num_slots;
+   int32_t pid;
+   int64_t started;
+};
+
+/****************************************************************************************
+ * Metrics - The server's metrics, kept in a shared memory segment (/dev/shm/tcpserver.<port>)
+ *           so tools like tcpstat can read them without the server doing anything. Each
+ *           thread claims a slot the first time it records something; recording is then a
+ *           thread-local lookup and a store. Until start() maps the segment, threads record
+ *           into a private spare slot.
+ *
+ ****************************************************************************************/
+
+class Metrics {
+   public:
+      static bool start(unsigned short port, std::string &results);
+      static std::string getShmName(unsigned short port);
+      static size_t getShmSize();
+
+      // Where a mapped segment keeps its slots and slow events
+      static const MetricsSlot *getSlots(const MetricsHeader *header) {
+         return reinterpret_cast<const MetricsSlot *>(header + 1);
+      };
+      static const SlowRing *getSlowRing(const MetricsHeader *header) {
+         return reinterpret_cast<const SlowRing *>(getSlots(header) + metrics_max_slots);
+      };
+
+      static void recordSlow(uint32_t reactor, int64_t when_us, uint64_t duration_ns, int fd,
+                             const char *handler, const char *status, char **frames,
+                             int num_frames);
+
+      static void count(metric_counter counter, uint64_t amount = 1) {
+         std::atomic<uint64_t> &c = local().counters[counter];
+         c.store(c.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+      };
+
+      static void addGauge(metric_gauge gauge, int64_t amount) {
+         std::atomic<int64_t> &g = local().gauges[gauge];
+         g.store(g.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+      };
+
+      static void setGauge(metric_gauge gauge, int64_t value) {
+         local().gauges[gauge].store(value, std::memory_order_relaxed);
+      };
+
+      static void record(metric_hist hist, uint64_t ns) {
+         std::atomic<uint64_t> &b = local().hists[hist][getBucket(ns)];
+         b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      };
+
+      // HDR bucket math, shared with readers
+      static unsigned int getBucket(uint64_t value);
+      static uint64_t getBucketMax(unsigned int bucket);
+      static uint64_t getPercentile(const uint64_t counts[metrics_hist_buckets], double pct);
+
+      static const char *getName(metric_counter counter);
+      static const char *getName(metric_gauge gauge);
+      static const char *getName(metric_hist hist);
+
+   private:
+      static MetricsSlot &local() {
+         return (_local != NULL) ? *_local : claimSlot();
+      };
+      static MetricsSlot &claimSlot();
+
+      static thread_local MetricsSlot *_local;
+      static std::atomic<MetricsHeader *> _header;
+      static MetricsSlot _spare;
+};
+
+inline unsigned int Metrics::getBucket(uint64_t value) {
+   const uint64_t sub_count = 1 << metrics_sub_bits;
+   const uint64_t half_count = sub_count >> 1;
+
+   if (value < sub_count)
+      return value;
+   if (value >= ((uint64_t) 1 << metrics_max_bits))
+      value = ((uint64_t) 1 << metrics_max_bits) - 1;
+
+   unsigned int shift = (63 - __builtin_clzll(value)) - (metrics_sub_bits - 1);
+   return sub_count + (shift - 1) * half_count + ((value >> shift) - half_count);
+}
+
+#endif
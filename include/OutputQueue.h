@@ -0,0 +1,88 @@
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+
+#include <string>
+#include <memory>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "FileDesc.h"
+
+// Reply bytes a connection can have copied in waiting to be sent
+const unsigned int out_buf_size = 4096;
+static_assert((out_buf_size & (out_buf_size - 1)) == 0, "out_buf_size must be a power of two");
+
+// Pieces of output (runs of copied bytes and shared replies) a connection can have waiting
+const unsigned int out_max_frags = 64;
+static_assert((out_max_frags & (out_max_frags - 1)) == 0, "out_max_frags must be a power of two");
+
+// Most pieces handed to one writev
+const unsigned int out_flush_iovs = 16;
+
+// A connection with this much output waiting (or half its pieces used) stops reading and
+// handling input until the client drains it. Whatever one input line produces must fit in the
+// rest of the queue.
+const unsigned int out_high_water = out_buf_size / 2;
+
+// An immutable reply that any number of connections can queue without copying it. Each queue
+// holds a reference until the reply is sent, so the last one to send it frees it.
+typedef std::shared_ptr<const std::string> SharedReply;
+
+/****************************************************************************************
+ * OutputQueue - A fixed-size queue of output waiting to be sent. Replies made on the fly
+ *               are copied into a byte ring, shared replies are queued by reference, and
+ *               everything goes out in order with as few writev calls as possible when it
+ *               is flushed (or handed to an io_uring send). Whatever the socket doesn't
+ *               take stays queued for the next flush. It never grows or allocates.
+ *
+ ****************************************************************************************/
+
+class OutputQueue {
+   public:
+      OutputQueue() { };
+
+      bool append(const char *data, size_t len);
+      bool append(const SharedReply &reply);
+      ssize_t flush(FileDesc &fd);
+
+      // Asynchronous sends, for io_uring
+      const struct iovec *startSend(int &iovcnt);
+      void finishSend(ssize_t sent);
+      bool isSending() { return _sending; };
+
+      size_t size() { return _bytes; };
+      bool isEmpty() { return _bytes == 0; };
+      bool isBacklogged() { return (_bytes >= out_high_water) ||
+                                   (_frag_tail - _frag_head >= out_max_frags / 2); };
+
+   private:
+      int fillIovecs(struct iovec *iov, size_t &wanted);
+      void consume(size_t len);
+
+      // A contiguous piece of output. Copied bytes point into _buf and have no reply.
+      struct OutFrag {
+         const char *data = NULL;
+         size_t len = 0;
+         SharedReply reply;
+      };
+
+      OutFrag _frags[out_max_frags];
+      size_t _frag_head = 0;
+      size_t _frag_tail = 0;
+
+      char _buf[out_buf_size];
+
+      // Free-running offsets of the first unsent copied byte and of the end of the copied data,
+      // masked into _buf when used
+      size_t _head = 0;
+      size_t _tail = 0;
+
+      // Total bytes waiting, copied and shared
+      size_t _bytes = 0;
+
+      // The pieces an asynchronous send is writing. While one is out, the front of the queue
+      // can't move and flush writes nothing.
+      struct iovec _send_iov[out_flush_iovs];
+      bool _sending = false;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PASSWDINDEX_H
+#define PASSWDINDEX_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <shared_mutex>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+// Password hash and salt sizes in the password file
+const int hashlen = 32;
+const int saltlen = 16;
+
+// One user's record from the password file
+struct PasswdEntry {
+   uint8_t hash[hashlen];
+   uint8_t salt[saltlen];
+   off_t offset;           // file offset of the hash, so it can be overwritten in place
+};
+
+/****************************************************************************************
+ * PasswdIndex - A process-wide, in-memory hash index of a password file, shared by every
+ *               PasswdMgr (and thread) that uses that file. It is loaded on first use. Each
+ *               lookup stats the file, and if it changed, the index picks up appended
+ *               records incrementally or reloads the whole file for anything else (such as
+ *               a compaction). The file is a log, so a later record for a user replaces an
+ *               earlier one. Files are read outside the index lock, so lookups never wait
+ *               on disk I/O.
+ *
+ ****************************************************************************************/
+
+class PasswdIndex {
+   public:
+      // Gets the shared index for a password file, creating it on first use
+      static PasswdIndex &getIndex(const std::string &pwd_file);
+
+      bool lookup(const std::string &name, PasswdEntry &entry);
+
+      // Copies out every user in the file (used by pwconvert)
+      void getAll(std::vector<std::pair<std::string, PasswdEntry>> &users);
+
+      // Parses records from an open password file, from start to the last complete record
+      static off_t parseFile(int fd, off_t start, std::unordered_map<std::string, PasswdEntry> &users);
+
+   private:
+      PasswdIndex(const std::string &pwd_file);
+
+      void refresh();
+      bool isCurrent(const struct stat &file_stat);
+
+      std::string _pwd_file;
+
+      // Serializes refreshes, so only one thread reads the file when it changes
+      std::mutex _refresh_lock;
+
+      std::shared_mutex _lock;
+      std::unordered_map<std::string, PasswdEntry> _users;
+
+      // What the file looked like when we last indexed it
+      struct stat _file_stat;
+      off_t _parsed_size = 0;
+};
+
+#endif
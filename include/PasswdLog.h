@@ -0,0 +1,80 @@
+#ifndef PASSWDLOG_H
+#define PASSWDLOG_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdint.h>
+
+// Compaction is considered once the superseded records make up half of a file at least this big
+const off_t min_compact_size = 64 * 1024;
+const unsigned int compact_check_secs = 5;
+
+/****************************************************************************************
+ * PasswdLog - The write path for the text password file, shared process-wide per file.
+ *             New users and password changes are both appended as complete records (the
+ *             index takes the last record for a name), so nothing is rewritten in place.
+ *             Appends from concurrent threads are group-committed: one thread writes
+ *             everything queued with a single write and fdatasync while the rest wait.
+ *
+ *             Once password changes have made at least half the file superseded records, a
+ *             background thread compacts it: the live records are written to a new file and
+ *             renamed over the old one. Appenders (in any process) hold flock on the file,
+ *             so the compactor can copy over records appended while it worked and rename
+ *             without losing any.
+ *
+ ****************************************************************************************/
+
+class PasswdLog {
+   public:
+      ~PasswdLog();
+
+      // Gets the shared log for a password file, creating it on first use
+      static PasswdLog &getLog(const std::string &pwd_file);
+
+      // Formats a password file record
+      static void makeRecord(std::string &record, const std::string &name, const uint8_t *hash,
+                                                                           const uint8_t *salt);
+
+      // Appends a record and returns once it is durable. supersedes is true when it replaces
+      // an earlier record (a password change), which counts toward compaction.
+      void append(const std::string &record, bool supersedes);
+
+      // Rewrites the file with only the live records
+      void compact();
+
+   private:
+      // A record waiting to be written, owned by the thread waiting on it
+      struct LogWrite {
+         const std::string *record;
+         bool done;
+         bool failed;
+      };
+
+      PasswdLog(const std::string &pwd_file);
+
+      void writeBatch(std::vector<LogWrite *> &batch);
+      void lockCurrentFile();
+      void runCompactor();
+
+      std::string _pwd_file;
+
+      std::mutex _lock;
+      std::condition_variable _committed;
+      std::vector<LogWrite *> _pending;
+      bool _flushing = false;
+
+      // Append fd, only used by the thread doing the flush
+      int _fd = -1;
+
+      // Bytes of records appended that superseded earlier ones, since the last compaction
+      off_t _superseded = 0;
+
+      std::thread _compactor;
+      std::condition_variable _compact_wake;
+      bool _stop = false;
+};
+
+#endif
@@ -4,6 +4,12 @@
 #include <string>
 #include <stdexcept>
 #include "FileDesc.h"
+#include "PasswdIndex.h"
+
+// Argon2 cost parameters used for every password hash
+const uint32_t argon2_t_cost = 2;            // number of passes
+const uint32_t argon2_m_cost = (1<<16);      // 64 mebibytes memory usage (in KiB)
+const uint32_t argon2_parallelism = 1;       // number of threads and lanes
 
 /****************************************************************************************
  * PasswdMgr - Manages user authentication through a file
@@ -25,9 +31,8 @@ class PasswdMgr {
                                                                                  std::vector<uint8_t> *in_salt = NULL);
 
    private:
+      bool lookupUser(const char *name, PasswdEntry &entry);
       bool findUser(const char *name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
-      bool readUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
-      int writeUser(FileFD &pwfile, std::string &name, std::vector<uint8_t> &hash, std::vector<uint8_t> &salt);
 
       std::string _pwd_file;
 };
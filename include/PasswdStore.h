@@ -0,0 +1,116 @@
+#ifndef PASSWDSTORE_H
+#define PASSWDSTORE_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <atomic>
+#include <sys/types.h>
+#include <stdint.h>
+#include "PasswdIndex.h"
+
+/****************************************************************************************
+ * Binary password store layout (native byte order):
+ *
+ *    PasswdStoreHeader
+ *    index - bucket_count uint32_t slots, open addressing with linear probing on the FNV-1a
+ *            hash of the username. A slot holds record number + 1, 0 is empty.
+ *    records - capacity PasswdRecords, the first record_count of them in use
+ *
+ * Lookups only touch the header, the probed slots and one record, so they take the same
+ * time with 1k or 10M users and opening the store is just an mmap.
+ ****************************************************************************************/
+
+const char pwstore_magic[8] = {'P', 'W', 'S', 'T', 'O', 'R', 'E', '1'};
+
+// Longest username a record can hold (plus the null terminator)
+const unsigned int pwstore_namelen = 64;
+
+// Most users a store can hold, so bucket_count (twice this, rounded up to a power of two)
+// still fits its 32-bit field
+const uint64_t pwstore_max_capacity = 1ULL << 30;
+
+struct PasswdStoreHeader {
+   char magic[8];
+   uint32_t record_size;
+   uint32_t bucket_count;        // power of two, at least twice the capacity
+   uint64_t capacity;
+   uint64_t record_count;
+   uint64_t index_offset;
+   uint64_t records_offset;
+};
+
+struct PasswdRecord {
+   char name[pwstore_namelen];
+   uint8_t hash[hashlen];
+   uint8_t salt[saltlen];
+   uint8_t reserved[16];
+};
+
+/****************************************************************************************
+ * PasswdStore - Read-only mmap of a binary password store, shared process-wide per file.
+ *               Password changes and new users are written with pwrite into the same file,
+ *               which the mapping sees immediately through the page cache.
+ *
+ ****************************************************************************************/
+
+class PasswdStore {
+   public:
+      ~PasswdStore();
+
+      // Checks if a file is a binary store (rather than the legacy text format)
+      static bool isStoreFile(const std::string &pwd_file);
+
+      // Gets the shared store for a file, NULL if the file isn't a binary store
+      static PasswdStore *getStore(const std::string &pwd_file);
+
+      // Writes a new store holding users, with room for capacity users in total
+      static void create(const std::string &pwd_file,
+                         const std::vector<std::pair<std::string, PasswdEntry>> &users,
+                         uint64_t capacity);
+
+      // Zero-copy lookup, the record points into the mapping (NULL if not found)
+      const PasswdRecord *find(const std::string &name);
+      bool lookup(const std::string &name, PasswdEntry &entry);
+
+      void addUser(const std::string &name, const uint8_t *hash, const uint8_t *salt);
+
+      // Overwrites a user's hash, false if they aren't in the store
+      bool updateHash(const std::string &name, const uint8_t *hash);
+
+      void getAll(std::vector<std::pair<std::string, PasswdEntry>> &users);
+      uint64_t getCapacity();
+
+   private:
+      // One mmap of the store file. A file replaced by pwconvert gets a new mapping, and old
+      // ones stay valid until the store is destroyed since other threads may still read them.
+      struct StoreMap {
+         int fd;
+         ino_t ino;
+         uint8_t *map;
+         size_t size;
+         const PasswdStoreHeader *header;
+         const uint32_t *index;
+         const PasswdRecord *records;
+      };
+
+      PasswdStore(const std::string &pwd_file);
+
+      StoreMap *getMap();
+      bool isReplaced(const StoreMap *smap);
+      static StoreMap *mapFile(const std::string &pwd_file);
+
+      static const PasswdRecord *findIn(const StoreMap *smap, const std::string &name);
+      static uint64_t hashName(const char *name, size_t len);
+
+      std::string _pwd_file;
+
+      // Serializes writers and remaps, lookups don't take it
+      std::mutex _write_lock;
+
+      std::atomic<StoreMap *> _current{NULL};
+      std::vector<StoreMap *> _maps;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <stdint.h>
+
+// The counters PerfCounters tries to open
+enum perf_counter_type { pc_cycles, pc_instructions, pc_cache_misses, pc_ctx_switches,
+                         pc_dtlb_misses, pc_page_faults, pc_num_counters };
+
+/****************************************************************************************
+ * PerfCounters - Hardware and software performance counters for the calling thread, read
+ *                through perf_event_open. Counters the kernel or hypervisor won't give us
+ *                (common in VMs and with a strict perf_event_paranoid) are simply reported as
+ *                unavailable.
+ *
+ ****************************************************************************************/
+
+class PerfCounters {
+   public:
+      PerfCounters();
+      ~PerfCounters();
+
+      // Reads the current count of every counter into values (0 for unavailable ones, the
+      // last good reading for one that couldn't be read)
+      void readAll(uint64_t values[pc_num_counters]);
+
+      bool isAvailable(perf_counter_type counter) {
+         return (_fds[counter] != -1) || ((counter == pc_ctx_switches) && _rusage_switches);
+      };
+      static const char *getName(perf_counter_type counter);
+
+   private:
+      int _fds[pc_num_counters];
+
+      // Context switches are read with getrusage when perf won't count them
+      bool _rusage_switches = false;
+
+      // Each counter's last successful reading
+      uint64_t _last[pc_num_counters] = { };
+};
+
+#endif
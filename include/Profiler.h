@@ -0,0 +1,63 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+#include "PerfCounters.h"
+
+// The parts of a session the profiler tells apart
+enum profile_phase { pp_accept, pp_username, pp_argon2, pp_command, pp_log, pp_log_write,
+                     pp_num_phases };
+
+/****************************************************************************************
+ * Profiler - Optional (--profile) hardware counter profile of the server, by session phase.
+ *            Each thread reads its PerfCounters whenever it enters or leaves a phase and
+ *            charges the difference to the phase it was in, so a phase nested in another
+ *            (a log line written during a command) is not counted twice. Time outside any
+ *            phase is not counted. report() sums every thread's totals.
+ *
+ *            A phase boundary costs one PerfCounters::readAll, a read() per counter, so
+ *            this is for finding what dominates rather than for running all the time.
+ *
+ ****************************************************************************************/
+
+class Profiler {
+   public:
+      // Must be called before any other thread starts
+      static void enable() { _enabled = true; };
+      static bool isEnabled() { return _enabled; };
+
+      // Switch the calling thread into phase, and back to the phase enter returned
+      static int enter(profile_phase phase);
+      static void leave(int prev);
+
+      static void report(std::ostream &out);
+      static const char *getName(profile_phase phase);
+
+   private:
+      static bool _enabled;
+};
+
+/****************************************************************************************
+ * ProfileScope - Counts the rest of the enclosing block as phase, when profiling
+ ****************************************************************************************/
+
+class ProfileScope {
+   public:
+      ProfileScope(profile_phase phase) {
+         if (Profiler::isEnabled())
+            _prev = Profiler::enter(phase);
+      };
+
+      ~ProfileScope() {
+         if (_prev != not_profiling)
+            Profiler::leave(_prev);
+      };
+
+   private:
+      static const int not_profiling = -2;
+      int _prev = not_profiling;
+};
+
+#endif
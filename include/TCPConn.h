@@ -2,58 +2,110 @@
 #define TCPCONN_H
 
 #include "FileDesc.h"
+#include "HashPool.h"
+#include "Journal.h"
+#include "LineBuffer.h"
+#include "OutputQueue.h"
 
 const int max_attempts = 2;
 
+// The filename/path of the password file
+const char pwdfilename[] = "passwd";
+
 // Methods and attributes to manage a network connection, including tracking the username
 // and a buffer for user input. Status tracks what "phase" of login the user is currently in
 class TCPConn 
 {
 public:
-   TCPConn(/* LogMgr &server_log*/);
+   TCPConn(HashPool &hasher, HashCompletionQueue &hashdone, uint64_t conn_id);
    ~TCPConn();
 
    bool accept(SocketFD &server);
+   void attach(int fd);
 
    int sendText(const char *msg);
    int sendText(const char *msg, int size);
+   int sendText(const std::string &msg) { return sendText(msg.data(), msg.size()); };
+   int sendReply(const SharedReply &reply);
 
    void handleConnection();
+   void handleData(ssize_t len);
+   bool flushOutput();
+   bool finishSend(int res);
+   void processInput();
+   void handleInput();
    void startAuthentication();
    void getUsername();
    void getPasswd();
    void sendMenu();
+   void startPasswordChange();
    void getMenuChoice();
    void setPassword();
    void changePassword();
+   void changedPassword();
+
+   void submitHash(hash_job_type type, const std::string &passwd);
+   void finishHash(HashJob &job);
+   void hashBusy(hash_job_type type);
+   void checkedPasswd(bool correct);
 
    void logEvent(const char* event);
+   void logLoginEvent(journal_outcome outcome, const std::string &user, const char *text);
    
    
    int getSocketFD(); 
-   bool checkIPAddr(std::string ipaddr);
 
+   bool readInput();
+   bool hasUserInput();
    bool getUserInput(std::string &cmd);
+   bool getUserInput(std::string_view &cmd);
 
    void disconnect();
    bool isConnected();
 
    unsigned long getIPAddr() { return _connfd.getIPAddr(); };
+   void detachFilter() { _connfd.detachFilter(); };
    void getIPAddrStr(std::string &buf);
    const char *getUsernameStr() { return _username.c_str(); };
+   const char *getStatusStr();
+   uint64_t getConnID() { return _conn_id; };
+   char *getRecvBuf(size_t &len) { return _inputbuf.getSpace(len); };
+
+   // The output an io_uring send should write next, NULL if there's none or a send is out
+   const struct iovec *startSend(int &iovcnt) { return _outbuf.startSend(iovcnt); };
+
+   bool hasOutput() { return !_outbuf.isEmpty(); };
+   bool isThrottled() { return _outbuf.isBacklogged(); };
+
+   // What the reactor is waiting on for this connection (EPOLLIN/EPOLLOUT and the like)
+   uint32_t getIOEvents() { return _io_events; };
+   void setIOEvents(uint32_t events) { _io_events = events; };
 
 private:
 
 
-   enum statustype { s_username, s_changepwd, s_confirmpwd, s_passwd, s_menu };
+   // s_verifying means a password check or change is running on the hash pool
+   enum statustype { s_username, s_changepwd, s_confirmpwd, s_passwd, s_menu, s_verifying };
+
+   // Moves to a new status, keeping the per-status session gauges current
+   void setStatus(statustype status);
 
    statustype _status = s_username;
 
+   HashPool &_hasher;
+   HashCompletionQueue &_hashdone;
+   uint64_t _conn_id;
+
    SocketFD _connfd;
  
    std::string _username; // The username this connection is associated with
 
-   std::string _inputbuf;
+   LineBuffer _inputbuf;
+
+   // Replies waiting for the reactor to flush them at the end of its loop iteration
+   OutputQueue _outbuf;
+
+   uint32_t _io_events = 0;
 
    std::string _newpwd; // Used to store user input for changing passwords
 
@@ -0,0 +1,108 @@
+#ifndef TCPREACTOR_H
+#define TCPREACTOR_H
+
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include "FileDesc.h"
+#include "TCPConn.h"
+#include "HashPool.h"
+#include "Whitelist.h"
+#include "Watchdog.h"
+
+class TCPServer;
+
+// How a reactor waits for and performs socket I/O
+enum io_backend_type { epoll_backend, uring_backend };
+
+// Number of accepts kept queued on the io_uring at all times
+const unsigned int uring_accept_depth = 16;
+
+// One event loop of the server. Each reactor owns its own SO_REUSEPORT listening socket, epoll
+// instance and connections so reactors on different threads share nothing on the hot path.
+class TCPReactor
+{
+public:
+   TCPReactor(TCPServer &server, HashPool &hasher, Whitelist &whitelist, Watchdog &watchdog,
+              io_backend_type backend = epoll_backend);
+   ~TCPReactor();
+
+   void bindReactor(const char *ip_addr, unsigned short port);
+   void runLoop(int cpu = -1);
+   bool setFilter(const std::vector<struct sock_filter> *prog);
+   void stop();
+   void shutdown();
+
+private:
+   // io_uring user_data holds the operation type in its top byte, the low 24 bits of the
+   // connection's id below that and the FD in the bottom half. The id tells a late completion
+   // for a closed connection apart from one for a new connection that reused its FD.
+   enum uring_op { uring_accept = 1, uring_recv = 2, uring_hashdone = 3, uring_send = 4,
+                   uring_cancel = 5 };
+   static uint64_t uringTag(uring_op op, int fd, uint64_t conn_id = 0) {
+      return ((uint64_t) op << 56) | ((conn_id & 0xffffff) << 32) | (uint32_t) fd; };
+   static uring_op uringOp(uint64_t user_data) { return (uring_op) (user_data >> 56); };
+   static uint64_t uringConn(uint64_t user_data) { return user_data & 0x00ffffffffffffff; };
+
+   void runEpoll();
+   void runUring();
+   void acceptConns();
+   bool admitConn(TCPConn &new_conn);
+   void handleEvent(epoll_event &ev);
+   void handleHashResults();
+   void flushConns();
+   void waitUring(int fd, TCPConn &conn);
+   bool reapClosing(uint64_t user_data);
+   void removeConn(int fd);
+
+   // The server that owns this reactor, used for logging
+   TCPServer &_server;
+
+   // Runs password hashing for this reactor's connections, results come back on _hashdone
+   HashPool &_hasher;
+   HashCompletionQueue _hashdone;
+
+   // The server's compiled whitelist, checked on every accepted connection
+   Whitelist &_whitelist;
+
+   // Times this reactor's loop iterations and reports the ones that stall its connections
+   Watchdog &_watchdog;
+   ReactorBeat _beat;
+
+   // io_uring reads the _hashdone eventfd counter into here
+   uint64_t _hashdone_count;
+
+   uint64_t _next_conn_id = 0;
+
+   // Class to manage this reactor's server socket
+   SocketFD _sockfd;
+
+   // Cleared by stop to make runLoop return
+   std::atomic<bool> _online{true};
+
+   // Whether the listening socket has the whitelist's BPF filter attached
+   std::atomic<bool> _filtered{false};
+
+   io_backend_type _backend;
+
+   // Waits on the server socket and every connection socket for readiness
+   EpollFD _epollfd;
+
+   // Only created when running the io_uring backend
+   std::unique_ptr<UringFD> _uringfd;
+ 
+   // TCPConn objects to manage connections, keyed by their socket FD
+   std::unordered_map<int, std::unique_ptr<TCPConn>> _connmap;
+
+   // Removed connections that still have an io_uring receive or send outstanding, keyed by
+   // uringConn of their tags. The kernel may still use their buffers, so they are only
+   // freed once every cancelled operation has completed.
+   std::unordered_map<uint64_t, std::unique_ptr<TCPConn>> _closing;
+
+   // Connections handled during this loop iteration. Their output is flushed and what the
+   // loop waits on for them is updated once, at the end of the iteration.
+   std::vector<int> _dirty;
+};
+
+
+#endif
@@ -1,11 +1,17 @@
 #ifndef TCPSERVER_H
 #define TCPSERVER_H
 
-#include <list>
+#include <vector>
 #include <memory>
+#include <atomic>
 #include "Server.h"
-#include "FileDesc.h"
-#include "TCPConn.h"
+#include "TCPReactor.h"
+#include "HashPool.h"
+#include "Whitelist.h"
+#include "Watchdog.h"
+
+// Seconds between hash pool statistics lines in the log
+const unsigned int stats_interval = 10;
 
 class TCPServer : public Server 
 {
@@ -13,6 +19,14 @@ public:
    TCPServer();
    ~TCPServer();
 
+   void setThreads(unsigned int num_threads, bool pin_cpus = false);
+   void setIOBackend(io_backend_type backend);
+   void setHashWorkers(unsigned int num_workers);
+   void setHashLimits(size_t mem_budget, unsigned int queue_len, unsigned int deadline_ms);
+   void setKernelFilter(bool kernel_filter);
+   void setJournal(bool journal);
+   void setWatchdog(unsigned int threshold_ms, bool backtraces);
+
    void bindSvr(const char *ip_addr, unsigned short port);
    void listenSvr();
    void shutdown();
@@ -20,11 +34,33 @@ public:
    void logEvent(const char* event);
 
 private:
-   // Class to manage the server socket
-   SocketFD _sockfd;
- 
-   // List of TCPConn objects to manage connections
-   std::list<std::unique_ptr<TCPConn>> _connlist;
+   void runHousekeeping();
+   void logHashStats(uint64_t &last_submitted);
+   void reloadWhitelist(bool force);
+
+   // Compiled from the whitelist file, reloaded on SIGHUP or when the file changes
+   Whitelist _whitelist;
+
+   // Reports reactor loop iterations that stall their connections
+   Watchdog _watchdog;
+
+   // Worker threads that run Argon2 for every reactor
+   std::unique_ptr<HashPool> _hasher;
+
+   // One reactor (listening socket, event loop and connections) per thread
+   std::vector<std::unique_ptr<TCPReactor>> _reactors;
+
+   unsigned int _num_threads = 1;
+   bool _pin_cpus = false;
+   io_backend_type _backend = epoll_backend;
+   unsigned int _hash_workers = 0;
+   size_t _hash_mem_budget = 0;
+   unsigned int _hash_queue_len = 256;
+   unsigned int _hash_deadline_ms = 5000;
+   bool _kernel_filter = false;
+   bool _journal = false;
+
+   std::atomic<bool> _online{false};
 
 };
 
@@ -0,0 +1,115 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include "Metrics.h"
+
+// Reactor iterations that take longer than this are reported (0 turns the watchdog off)
+const unsigned int watchdog_default_ms = 50;
+
+/****************************************************************************************
+ * ReactorBeat - What one reactor thread is doing, for the watchdog. The reactor marks the
+ *               start and end of each loop iteration and labels each handler it runs; the
+ *               watchdog fills in the stall fields when it catches an iteration running long.
+ *               Everything is a relaxed atomic, so labelling a handler costs a few stores.
+ *
+ ****************************************************************************************/
+
+struct alignas(64) ReactorBeat {
+   // Set by the reactor. iter_start is 0 while it waits for events.
+   std::atomic<uint64_t> iter_start{0};
+   std::atomic<uint64_t> iter_seq{0};
+   std::atomic<const char *> handler{NULL};
+   std::atomic<const char *> status{NULL};
+   std::atomic<int> fd{-1};
+
+   // Set by the watchdog: the handler that was running when it saw iteration stall_seq - 1
+   // go past the threshold
+   std::atomic<uint64_t> stall_seq{0};
+   std::atomic<const char *> stall_handler{NULL};
+   std::atomic<const char *> stall_status{NULL};
+   std::atomic<int> stall_fd{-1};
+
+   // Set on the reactor's own thread by the backtrace signal, for iteration frames_seq - 1
+   void *frames[slow_max_frames];
+   volatile int num_frames = 0;
+   volatile uint64_t frames_seq = 0;
+
+   pthread_t thread;
+   unsigned int reactor = 0;
+};
+
+/****************************************************************************************
+ * Watchdog - Measures how long each reactor loop iteration takes and reports the ones
+ *            that stall every session on the reactor. A thread checks the reactors'
+ *            beats several times per threshold; when an iteration has run too long it
+ *            notes the handler and connection status that are running and, if enabled,
+ *            signals the reactor thread to take a backtrace of itself. When the iteration
+ *            ends, the reactor logs it and adds it to the slow event ring in the metrics
+ *            segment, where tcpstat -s shows it.
+ *
+ ****************************************************************************************/
+
+class Watchdog {
+   public:
+      Watchdog();
+      ~Watchdog();
+
+      void setThreshold(unsigned int threshold_ms, bool backtraces);
+      void start();
+
+      // Called on each reactor's thread before its loop starts
+      void addReactor(ReactorBeat &beat);
+
+      void beginIteration(ReactorBeat &beat) {
+         if (_threshold_ns != 0)
+            beat.iter_start.store(getNow(), std::memory_order_relaxed);
+      };
+
+      void setActivity(ReactorBeat &beat, const char *handler, int fd, const char *status) {
+         beat.handler.store(handler, std::memory_order_relaxed);
+         beat.fd.store(fd, std::memory_order_relaxed);
+         beat.status.store(status, std::memory_order_relaxed);
+      };
+
+      void endIteration(ReactorBeat &beat) {
+         if (_threshold_ns == 0)
+            return;
+
+         uint64_t duration = getNow() - beat.iter_start.load(std::memory_order_relaxed);
+         Metrics::record(mh_reactor_iter, duration);
+         if (duration >= _threshold_ns)
+            reportSlow(beat, duration);
+
+         beat.iter_start.store(0, std::memory_order_relaxed);
+         beat.iter_seq.store(beat.iter_seq.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_release);
+      };
+
+      static uint64_t getNow() {
+         struct timespec now;
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+      };
+
+   private:
+      void runWatch();
+      void reportSlow(ReactorBeat &beat, uint64_t duration);
+
+      uint64_t _threshold_ns = (uint64_t) watchdog_default_ms * 1000000;
+      bool _backtraces = false;
+
+      std::mutex _lock;
+      std::vector<ReactorBeat *> _beats;
+
+      std::atomic<bool> _stop{false};
+      std::thread _watcher;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef WHITELIST_H
+#define WHITELIST_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <linux/filter.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+const char whitelist_file[] = "whitelist";
+
+// Bits of the address consumed at each level of the trie (must add up to 32)
+const unsigned int whitelist_strides[] = {16, 4, 4, 4, 4};
+
+// Prefix comparisons per block of the compiled BPF filter, so every jump to the block's
+// return instructions fits in the 8-bit classic BPF jump offset
+const unsigned int bpf_block_size = 200;
+
+// What the longest matching prefix says about an address
+enum whitelist_verdict { wl_none = 0, wl_allow = 1, wl_deny = 2 };
+
+/****************************************************************************************
+ * WhitelistTrie - An immutable multibit trie of IPv4 CIDR prefixes, built once from a list.
+ *                 Prefixes are expanded into the stride-sized tables (longer ones overwrite
+ *                 shorter ones) so each table entry already holds the verdict of the longest
+ *                 prefix covering it. A lookup is at most one table read per stride, with no
+ *                 comparisons against the prefixes themselves.
+ *
+ ****************************************************************************************/
+
+class WhitelistTrie {
+   public:
+      struct Prefix {
+         uint32_t addr;             // host byte order, host bits cleared
+         unsigned int len;
+         whitelist_verdict verdict;
+      };
+
+      WhitelistTrie(std::vector<Prefix> &prefixes);
+
+      // addr is in host byte order
+      whitelist_verdict lookup(uint32_t addr) const;
+
+      size_t getMemSize() const { return _entries.size() * sizeof(uint32_t); };
+
+   private:
+      uint32_t newTable(uint32_t fill);
+
+      // All tables back to back, the root table first. An entry is (child table offset << 2) |
+      // verdict, and a child offset of 0 means there is no child (the root is never a child).
+      std::vector<uint32_t> _entries;
+};
+
+/****************************************************************************************
+ * Whitelist - The server's compiled whitelist file. Each line is an IPv4 address or CIDR
+ *             prefix (a.b.c.d or a.b.c.d/len), optionally starting with '!' to deny it, and
+ *             '#' starts a comment. The longest matching prefix decides, and addresses no
+ *             prefix matches are denied. reload() compiles a new trie and swaps it in
+ *             atomically, so checks running on other threads are never blocked.
+ *
+ ****************************************************************************************/
+
+class Whitelist {
+   public:
+      Whitelist(const char *filename = whitelist_file);
+
+      // addr is in network byte order, as returned by SocketFD::getIPAddr
+      bool isAllowed(unsigned long addr);
+
+      // Recompiles the file. Returns false (keeping the old list) if it can't be read.
+      bool reload(std::string &results);
+
+      // Reloads if the file was replaced or modified since the last load
+      bool reloadIfChanged(std::string &results);
+
+      // Compiles the current list into a classic BPF socket filter that drops SYNs from
+      // addresses it doesn't allow. Returns false if the list is too big for one program.
+      bool compileFilter(std::vector<struct sock_filter> &prog);
+
+   private:
+      static bool parseLine(std::string &line, WhitelistTrie::Prefix &prefix);
+
+      std::string _filename;
+
+      std::shared_ptr<const WhitelistTrie> _trie;
+
+      // The prefixes the current trie was built from, for compileFilter
+      std::vector<WhitelistTrie::Prefix> _prefixes;
+
+      // Serializes reloads, and what the file looked like when last loaded
+      std::mutex _reload_lock;
+      ino_t _file_ino = 0;
+      struct timespec _file_mtim = {0, 0};
+      off_t _file_size = -1;
+};
+
+#endif
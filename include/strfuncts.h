@@ -1,4 +1,5 @@
 #include <string>
+#include <string_view>
 
 // Remove /r and /n from a string
 void clrNewlines(std::string &str);
@@ -9,6 +10,9 @@ bool split(std::string &orig, std::string &left, std::string &right, const char
 // Turns a string into lowercase
 void lower(std::string &str);
 
+// Checks if a string equals an all-lowercase word, ignoring the string's case
+bool matchLower(std::string_view str, const char *word);
+
 // Turns off local echo from a user's terminal
 int hideInput(int fd, bool hide);
 
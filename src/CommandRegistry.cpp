@@ -0,0 +1,144 @@
+#include <vector>
+#include <string>
+#include "CommandRegistry.h"
+#include "TCPConn.h"
+#include "strfuncts.h"
+
+// Every menu command, in the order they are listed in the menu
+constexpr MenuCommand menu_commands[] = {
+   {"1", mh_cmd_1, "C++ got the OOP features from Simula67 Programming language.\n", NULL,
+    "1-5 : provide c++ information."},
+   {"2", mh_cmd_2, "Not purely object oriented: We can write C++ code without using\n"
+                   "classes and it will compile without showing any error message.\n", NULL, NULL},
+   {"3", mh_cmd_3, "C and C++ were invented at same place i.e. at T bell laboratories.\n", NULL,
+    NULL},
+   {"4", mh_cmd_4, "Concept of reference variables: operator overloading borrowed from the Algol 68\n"
+                   "Algol 68 programming language.\n", NULL, NULL},
+   {"5", mh_cmd_5, "A function is the minimum requirement for a C++ program to run.\n", NULL,
+    NULL},
+   {"hello", mh_cmd_hello, "Hello back!\n", NULL, "Hello : self-explanatory"},
+   {"passwd", mh_cmd_passwd, "New Password: \n", &TCPConn::startPasswordChange,
+    "Passwd : change your password"},
+   {"menu", mh_cmd_menu, NULL, &TCPConn::sendMenu, "Menu : display this menu"},
+   {"exit", mh_cmd_exit, "Disconnecting...goodbye!\n", &TCPConn::disconnect,
+    "Exit : disconnect."},
+};
+
+constexpr size_t num_commands = sizeof(menu_commands) / sizeof(menu_commands[0]);
+
+// Hash table slots, the power of two at least twice the number of commands
+constexpr size_t commandSlots(size_t slots = 1) {
+   return (slots >= num_commands * 2) ? slots : commandSlots(slots * 2);
+}
+constexpr size_t command_slots = commandSlots();
+
+/*******************************************************************************************
+ * hashCommand - FNV-1a of the lowercased string, mixed with seed. Usable at compile time.
+ *******************************************************************************************/
+
+constexpr uint32_t hashCommand(const char *str, size_t len, uint32_t seed) {
+   uint32_t hash = 2166136261u ^ seed;
+   for (size_t i = 0; i < len; i++) {
+      char c = ((str[i] >= 'A') && (str[i] <= 'Z')) ? (str[i] - 'A' + 'a') : str[i];
+      hash = (hash ^ (unsigned char) c) * 16777619u;
+   }
+   return hash;
+}
+
+constexpr size_t nameLength(const char *name) {
+   size_t len = 0;
+   while (name[len] != '\0')
+      len++;
+   return len;
+}
+
+// The seed that sends every command to its own slot, and which command is in each slot
+struct CommandHash {
+   bool found = false;
+   uint32_t seed = 0;
+   int slots[command_slots] = { };
+};
+
+/*******************************************************************************************
+ * buildCommandHash - tries seeds until one hashes every command name to a different slot.
+ *                    Run by the compiler, so the table is fixed before the server starts.
+ *******************************************************************************************/
+
+constexpr CommandHash buildCommandHash() {
+   CommandHash table;
+   for (uint32_t seed = 0; seed < 100000; seed++) {
+      for (size_t s = 0; s < command_slots; s++)
+         table.slots[s] = -1;
+
+      bool collided = false;
+      for (size_t i = 0; (i < num_commands) && !collided; i++) {
+         const char *name = menu_commands[i].name;
+         size_t slot = hashCommand(name, nameLength(name), seed) & (command_slots - 1);
+         collided = (table.slots[slot] != -1);
+         table.slots[slot] = i;
+      }
+
+      if (!collided) {
+         table.found = true;
+         table.seed = seed;
+         return table;
+      }
+   }
+   return table;
+}
+
+constexpr CommandHash command_hash = buildCommandHash();
+static_assert(command_hash.found, "menu command names must be unique");
+
+/*******************************************************************************************
+ * makeReplies/makeMenu - build the shared reply buffers once, when the program starts
+ *******************************************************************************************/
+
+std::vector<SharedReply> makeReplies() {
+   std::vector<SharedReply> replies(num_commands);
+   for (size_t i = 0; i < num_commands; i++) {
+      if (menu_commands[i].reply != NULL)
+         replies[i] = std::make_shared<const std::string>(menu_commands[i].reply);
+   }
+   return replies;
+}
+
+SharedReply makeMenu() {
+   std::string menu;
+   menu += "************************************\n";
+   menu += "Available menu choices are: \n";
+   for (const MenuCommand &command : menu_commands) {
+      if (command.help != NULL) {
+         menu += "  ";
+         menu += command.help;
+         menu += "\n";
+      }
+   }
+   menu += "************************************\n";
+   return std::make_shared<const std::string>(menu);
+}
+
+const std::vector<SharedReply> command_replies = makeReplies();
+const SharedReply menu_reply = makeMenu();
+
+/*******************************************************************************************
+ * find - hashes cmd to its slot and checks the command there really is cmd
+ *
+ *    Returns: the command, or NULL if cmd isn't one
+ *******************************************************************************************/
+
+const MenuCommand *CommandRegistry::find(std::string_view cmd) {
+   int index = command_hash.slots[hashCommand(cmd.data(), cmd.size(), command_hash.seed) &
+                                  (command_slots - 1)];
+   if ((index < 0) || !matchLower(cmd, menu_commands[index].name))
+      return NULL;
+   return &menu_commands[index];
+}
+
+const SharedReply &CommandRegistry::getReply(const MenuCommand &command) {
+   return command_replies[&command - menu_commands];
+}
+
+const SharedReply &CommandRegistry::getMenu() {
+   return menu_reply;
+}
@@ -0,0 +1,145 @@
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "Diag.h"
+
+/*******************************************************************************************
+ * allow - Counts a message against the current second, starting a new second if the clock
+ *         has moved on
+ *
+ *    Params:  suppressed - set to how many messages the previous second dropped
+ *
+ *    Returns: true if the message is within diag_per_sec for this second
+ *******************************************************************************************/
+
+bool DiagLimiter::allow(uint32_t &suppressed) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+   uint64_t sec = (uint64_t) now.tv_sec;
+
+   suppressed = 0;
+   uint64_t state = _state.load(std::memory_order_relaxed);
+   while ((state >> 32) != sec) {
+      if (_state.compare_exchange_weak(state, (sec << 32) | 1, std::memory_order_relaxed)) {
+         uint32_t count = (uint32_t) state;
+         if (count > diag_per_sec)
+            suppressed = count - diag_per_sec;
+         return true;
+      }
+   }
+
+   uint32_t count = (uint32_t) _state.fetch_add(1, std::memory_order_relaxed) + 1;
+   return (count <= diag_per_sec);
+}
+
+Diag &Diag::getDiag() {
+   static Diag diag;
+   return diag;
+}
+
+Diag::Diag():_ring(diag_ring_slots) {
+   _writer = std::thread(&Diag::runWriter, this);
+}
+
+/*******************************************************************************************
+ * ~Diag - Stops the writer, which prints whatever is still in the ring first
+ *
+ *******************************************************************************************/
+
+Diag::~Diag() {
+   _stop = true;
+   if (_writer.joinable())
+      _writer.join();
+}
+
+/*******************************************************************************************
+ * write - Copies a message into the next free slot of the ring
+ *
+ *    Params:  msg - the message, without a trailing newline
+ *             suppressed - messages this call site dropped since it last printed, if any
+ *******************************************************************************************/
+
+void Diag::write(const std::string &msg, uint32_t suppressed) {
+   uint64_t pos;
+   DiagEntry *entry = _ring.reserve(pos);
+   if (entry == NULL) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+   }
+
+   size_t len = std::min(msg.size(), sizeof(entry->text));
+   memcpy(entry->text, msg.data(), len);
+   if (suppressed > 0) {
+      std::string note = " (" + std::to_string(suppressed) + " similar suppressed)";
+      size_t notelen = std::min(note.size(), sizeof(entry->text) - len);
+      memcpy(entry->text + len, note.data(), notelen);
+      len += notelen;
+   }
+   entry->len = len;
+   _ring.publish(pos);
+}
+
+/*******************************************************************************************
+ * runWriter - Drains the ring into batches and writes them to stdout, sleeping for
+ *             diag_flush_ms whenever it is empty, until the sink is destroyed
+ *
+ *******************************************************************************************/
+
+void Diag::runWriter() {
+   std::string buf;
+   buf.reserve(diag_ring_slots * 64);
+
+   while (true) {
+      bool stopping = _stop.load();
+      bool drained = drain(buf);
+
+      uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+      if (dropped != _dropped_reported) {
+         buf.append("Console ring full, dropped ");
+         buf.append(std::to_string(dropped - _dropped_reported));
+         buf.append(" messages.\n");
+         _dropped_reported = dropped;
+      }
+
+      size_t written = 0;
+      while (written < buf.size()) {
+         ssize_t results = ::write(STDOUT_FILENO, buf.data() + written, buf.size() - written);
+         if (results < 0) {
+            if (errno == EINTR)
+               continue;
+            break;
+         }
+         written += results;
+      }
+      buf.clear();
+
+      if (stopping)
+         break;
+      if (drained)
+         std::this_thread::sleep_for(std::chrono::milliseconds(diag_flush_ms));
+   }
+}
+
+/*******************************************************************************************
+ * drain - Appends every message published in the ring to buf, one per line, and frees their
+ *         slots. Stops early at a slot a producer has reserved but not finished writing.
+ *
+ *    Returns: true if the ring is now empty or a producer was caught mid-write, false if it
+ *             filled a batch
+ *******************************************************************************************/
+
+bool Diag::drain(std::string &buf) {
+   for (unsigned int count = 0; count < diag_ring_slots; count++) {
+      DiagEntry *entry = _ring.peek();
+      if (entry == NULL)
+         return true;
+
+      buf.append(entry->text, entry->len);
+      buf.push_back('\n');
+      _ring.release();
+   }
+   return false;
+}
@@ -5,6 +5,12 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "FileDesc.h"
@@ -12,7 +18,7 @@
 
 const unsigned int bufsize = 500;
 
-FileDesc::FileDesc() {
+FileDesc::FileDesc():_fd(-1) {
 
 }
 
@@ -97,19 +103,57 @@ bool FileDesc::hasData(long ms_timeout) {
  *****************************************************************************************/
 
 ssize_t FileDesc::readFD(std::string &buf) {
-   char *readbuf = new char[bufsize];
-   bzero(readbuf, sizeof(char) * bufsize);
+   char readbuf[bufsize];
    ssize_t amt_read = 0;
-   if ((amt_read = read(_fd, readbuf, bufsize)) < 0) {
-      delete readbuf;
+   if ((amt_read = read(_fd, readbuf, bufsize)) < 0)
       return -1;
-   }
    
-   buf = readbuf;
-   delete readbuf;
+   // A full read is not null terminated, so copy by length
+   buf.assign(readbuf, amt_read);
    return amt_read;
 }
 
+/*****************************************************************************************
+ * readFD - reads up to len bytes of whatever data is available into the caller's buffer
+ *
+ *    Params: buf - where to store the data
+ *            len - size of buf
+ *
+ *    Returns: returns the amount of data read, 0 if the peer closed, or -1 for failure
+ *****************************************************************************************/
+
+ssize_t FileDesc::readFD(char *buf, size_t len) {
+   return read(_fd, buf, len);
+}
+
+/*****************************************************************************************
+ * readvFD - reads whatever data is available into several of the caller's buffers, filling
+ *           each in turn, with one call
+ *
+ *    Params: iov - the buffers to read into
+ *            iovcnt - how many there are
+ *
+ *    Returns: returns the total amount read, 0 if the peer closed, or -1 for failure
+ *****************************************************************************************/
+
+ssize_t FileDesc::readvFD(const struct iovec *iov, int iovcnt) {
+   return readv(_fd, iov, iovcnt);
+}
+
+/*****************************************************************************************
+ * writevFD - writes several buffers, in order, with one call. On a nonblocking FD it may
+ *            write only part of them.
+ *
+ *    Params: iov - the buffers to write
+ *            iovcnt - how many there are
+ *
+ *    Returns: returns the total amount written, or -1 for failure
+ *****************************************************************************************/
+
+ssize_t FileDesc::writevFD(const struct iovec *iov, int iovcnt) {
+   return writev(_fd, iov, iovcnt);
+}
+
 /*****************************************************************************************
  * writeFD - writes all the string data provided in str to the FD
  *
@@ -137,16 +181,22 @@ ssize_t FileDesc::writeFD(const char *data, unsigned int len) {
  *
  *************************************************************************************/
 bool FileDesc::isOpen() {
+   if (_fd == -1)
+      return false;
    if ((fcntl(_fd, F_GETFD) == -1) && (errno == EBADF))
       return false;
    return true;
 }
 
 /***************************************************************************************
- * closeFD - closes the FD cleanly
+ * closeFD - closes the FD cleanly and marks it invalid so a later reuse of the same FD
+ *           number by the kernel is not mistaken for this one still being open
  ***************************************************************************************/
 void FileDesc::closeFD() {
+   if (_fd == -1)
+      return;
    close(_fd);
+   _fd = -1;
 }
 
 /****************************************************************************************
@@ -169,6 +219,47 @@ SocketFD::~SocketFD() {
 
 }
 
+/*****************************************************************************************
+ * setReusePort - allows several sockets to bind the same address and port, with the kernel
+ *                load balancing incoming connections across them. Must be called before bindFD
+ *
+ *    Throws: socket_error if the socket option could not be set
+ *****************************************************************************************/
+
+void SocketFD::setReusePort() {
+   int on = 1;
+   if ((setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+       (setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)) {
+      throw socket_error("Failed setting SO_REUSEPORT on socket.");
+   }
+}
+
+/*****************************************************************************************
+ * attachFilter - attaches a classic BPF program that the kernel runs on every packet for this
+ *                socket (for a listening TCP socket, the SYN that would start a connection),
+ *                dropping the packet when it returns 0. Replaces any filter already attached.
+ *                Accepted sockets inherit the filter.
+ *
+ *    Returns: false if the kernel rejected the program
+ *****************************************************************************************/
+
+bool SocketFD::attachFilter(const std::vector<struct sock_filter> &prog) {
+   struct sock_fprog fprog;
+   fprog.len = prog.size();
+   fprog.filter = (struct sock_filter *) prog.data();
+   return (setsockopt(_fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == 0);
+}
+
+/*****************************************************************************************
+ * detachFilter - removes the BPF filter from this socket, if it has one
+ *
+ *****************************************************************************************/
+
+void SocketFD::detachFilter() {
+   int unused = 0;
+   setsockopt(_fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+}
+
 /*****************************************************************************************
  * bindFD - Binds the FD to the given network ip address and port, making it available to
  *          accept connections.
@@ -198,12 +289,17 @@ void SocketFD::bindFD(const char *ip_addr, short unsigned int port) {
  *
  *    Params:  ip_addr - the IP address string of the server to connect to in std format
  *             port - the port of the server to connect to
+ *             nonblocking - make the socket nonblocking first and return as soon as the
+ *                           connect is under way. The socket turns writable once it is done
+ *                           (check SO_ERROR for how it went).
  *
- *    Returns: true if the connect worked, false otherwise
+ *    Returns: true if the connect worked or is under way, false otherwise
  *****************************************************************************************/
 
-bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
+bool SocketFD::connectTo(const char *ip_addr, unsigned short port, bool nonblocking) {
 
+   // Replace the socket the constructor made rather than leak it
+   closeFD();
    if ((_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
       throw socket_error("Socket creation failed.");
 
@@ -213,8 +309,11 @@ bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
    inet_pton(AF_INET, ip_addr, &_fd_addr.sin_addr.s_addr);
    _fd_addr.sin_port = htons(port);
 
+   if (nonblocking)
+      setNonBlocking();
+
    if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0)
-      return false;
+      return (nonblocking && (errno == EINPROGRESS));
 
    return true;
 }
@@ -245,6 +344,9 @@ void SocketFD::listenFD(int backlog) {
 bool SocketFD::acceptFD(SocketFD &server) {
    socklen_t len = sizeof(_fd_addr);
 
+   // The constructor created a socket we don't need since accept gives us a new one
+   closeFD();
+
    _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
    if (_fd == -1)
       return false;
@@ -252,6 +354,22 @@ bool SocketFD::acceptFD(SocketFD &server) {
    return true;
 }
 
+/*****************************************************************************************
+ * attachFD - Takes ownership of an already accepted connection FD (for instance one accepted
+ *            through io_uring) and looks up its peer address
+ *
+ *    Params: fd - the connected socket FD
+ *****************************************************************************************/
+
+void SocketFD::attachFD(int fd) {
+   closeFD();
+   _fd = fd;
+
+   socklen_t len = sizeof(_fd_addr);
+   if (getpeername(_fd, (struct sockaddr *) &_fd_addr, &len) != 0)
+      bzero(&_fd_addr, sizeof(_fd_addr));
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -329,10 +447,406 @@ bool FileFD::openFile(fd_file_type ftype) {
    return true;
 }
 
+/******************************************************************************************
+ * EpollFD (constructor) - Creates the epoll instance
+ *
+ *    Params:  max_events - the most events returned by a single call to waitFD
+ *
+ *    Throws: socket_error if the epoll instance could not be created
+ ******************************************************************************************/
+
+EpollFD::EpollFD(int max_events):FileDesc(), _max_events(max_events) {
+   _fd = epoll_create1(EPOLL_CLOEXEC);
+   if (_fd == -1) {
+      throw socket_error("Epoll creation failed.");
+   }
+}
+
+EpollFD::~EpollFD() {
+   closeFD();
+}
+
+/******************************************************************************************
+ * addFD/modFD/delFD - registers, changes or removes an FD in the epoll interest list. The
+ *                     FD number is stored with the event so waitFD reports it back
+ *
+ *    Params:  fd - the file descriptor to watch
+ *             events - the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLRDHUP, etc)
+ *
+ *    Throws: socket_error if the epoll_ctl call fails
+ ******************************************************************************************/
+
+void EpollFD::addFD(int fd, uint32_t events) {
+   epoll_event ev;
+   ev.events = events;
+   ev.data.fd = fd;
+   if (epoll_ctl(_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      throw socket_error("Failed adding file descriptor to epoll.");
+}
+
+void EpollFD::modFD(int fd, uint32_t events) {
+   epoll_event ev;
+   ev.events = events;
+   ev.data.fd = fd;
+   if (epoll_ctl(_fd, EPOLL_CTL_MOD, fd, &ev) == -1)
+      throw socket_error("Failed modifying file descriptor in epoll.");
+}
+
+void EpollFD::delFD(int fd) {
+   epoll_event ev;
+   if ((epoll_ctl(_fd, EPOLL_CTL_DEL, fd, &ev) == -1) && (errno != EBADF) && (errno != ENOENT))
+      throw socket_error("Failed removing file descriptor from epoll.");
+}
+
+/******************************************************************************************
+ * waitFD - waits for one or more of the registered FDs to become ready
+ *
+ *    Params:  events - filled with the ready events (resized to the number found)
+ *             ms_timeout - milliseconds to wait, -1 to wait forever
+ *
+ *    Returns: number of ready events, 0 on timeout or if interrupted by a signal
+ *
+ *    Throws: socket_error if epoll_wait fails for any other reason
+ ******************************************************************************************/
+
+int EpollFD::waitFD(std::vector<epoll_event> &events, int ms_timeout) {
+   events.resize(_max_events);
+
+   int n = epoll_wait(_fd, events.data(), _max_events, ms_timeout);
+   if (n == -1) {
+      if (errno != EINTR)
+         throw socket_error("Epoll wait error.");
+      n = 0;
+   }
+
+   events.resize(n);
+   return n;
+}
+
+/******************************************************************************************
+ * EventFD (constructor) - Creates a nonblocking eventfd with a count of zero
+ *
+ *    Throws: socket_error if the eventfd could not be created
+ ******************************************************************************************/
+
+EventFD::EventFD():FileDesc() {
+   _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (_fd == -1) {
+      throw socket_error("Eventfd creation failed.");
+   }
+}
+
+EventFD::~EventFD() {
+   closeFD();
+}
+
+/******************************************************************************************
+ * notify - adds one to the counter, making the FD readable. Safe to call from any thread.
+ *
+ ******************************************************************************************/
+
+void EventFD::notify() {
+   uint64_t one = 1;
+   ssize_t results = write(_fd, &one, sizeof(one));
+   (void) results;   // Only fails if the counter is about to overflow, which is still readable
+}
+
+/******************************************************************************************
+ * drain - reads and resets the counter so the FD is no longer readable
+ *
+ *    Returns: the number of notifies since the last drain (0 if none)
+ ******************************************************************************************/
+
+uint64_t EventFD::drain() {
+   uint64_t count = 0;
+   if (read(_fd, &count, sizeof(count)) != sizeof(count))
+      return 0;
+   return count;
+}
+
+/******************************************************************************************
+ * TimerFD (constructor) - Creates a nonblocking, disarmed CLOCK_MONOTONIC timerfd
+ *
+ *    Throws: socket_error if the timerfd could not be created
+ ******************************************************************************************/
+
+TimerFD::TimerFD():FileDesc() {
+   _fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (_fd == -1) {
+      throw socket_error("Timerfd creation failed.");
+   }
+}
+
+TimerFD::~TimerFD() {
+   closeFD();
+}
+
+/******************************************************************************************
+ * armAt - fires the timer once at an absolute CLOCK_MONOTONIC time, replacing any earlier
+ *         setting. A time already past fires right away.
+ *
+ *    Params:  when_ns - the time in nanoseconds
+ ******************************************************************************************/
+
+void TimerFD::armAt(uint64_t when_ns) {
+   struct itimerspec spec;
+   bzero(&spec, sizeof(spec));
+
+   // An all-zero it_value would disarm it instead
+   if (when_ns == 0)
+      when_ns = 1;
+   spec.it_value.tv_sec = when_ns / 1000000000;
+   spec.it_value.tv_nsec = when_ns % 1000000000;
+   if (timerfd_settime(_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+      throw socket_error("Timerfd settime failed.");
+}
+
+void TimerFD::disarm() {
+   struct itimerspec spec;
+   bzero(&spec, sizeof(spec));
+   timerfd_settime(_fd, 0, &spec, NULL);
+}
+
+/******************************************************************************************
+ * drain - reads the expiration count so the FD is no longer readable
+ *
+ *    Returns: the number of expirations since the last drain (0 if none)
+ ******************************************************************************************/
+
+uint64_t TimerFD::drain() {
+   uint64_t count = 0;
+   if (read(_fd, &count, sizeof(count)) != sizeof(count))
+      return 0;
+   return count;
+}
+
+/******************************************************************************************
+ * UringFD (constructor) - Creates the io_uring instance and maps its submission queue,
+ *                         completion queue and SQE array into our memory
+ *
+ *    Params:  entries - size of the submission queue
+ *
+ *    Throws: socket_error if io_uring is not available or the rings could not be mapped
+ ******************************************************************************************/
+
+UringFD::UringFD(unsigned int entries):FileDesc() {
+   io_uring_params params;
+   bzero(&params, sizeof(params));
+
+   _fd = syscall(__NR_io_uring_setup, entries, &params);
+   if (_fd == -1)
+      throw socket_error("io_uring setup failed.");
+
+   if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      closeFD();
+      throw socket_error("io_uring on this kernel is too old (no single mmap).");
+   }
+
+   // With single mmap the SQ and CQ rings share one mapping sized for the larger of the two
+   size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+   _ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+   _ring_ptr = mmap(NULL, _ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                    IORING_OFF_SQ_RING);
+   if (_ring_ptr == MAP_FAILED) {
+      _ring_ptr = NULL;
+      closeFD();
+      throw socket_error("io_uring ring mmap failed.");
+   }
+
+   _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+   void *sqes = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                     IORING_OFF_SQES);
+   if (sqes == MAP_FAILED) {
+      munmap(_ring_ptr, _ring_size);
+      _ring_ptr = NULL;
+      closeFD();
+      throw socket_error("io_uring SQE mmap failed.");
+   }
+   _sqes = (io_uring_sqe *) sqes;
+
+   char *ring = (char *) _ring_ptr;
+   _sq_head = (unsigned int *) (ring + params.sq_off.head);
+   _sq_tail = (unsigned int *) (ring + params.sq_off.tail);
+   _sq_mask = (unsigned int *) (ring + params.sq_off.ring_mask);
+   _sq_array = (unsigned int *) (ring + params.sq_off.array);
+   _cq_head = (unsigned int *) (ring + params.cq_off.head);
+   _cq_tail = (unsigned int *) (ring + params.cq_off.tail);
+   _cq_mask = (unsigned int *) (ring + params.cq_off.ring_mask);
+   _cqes = (io_uring_cqe *) (ring + params.cq_off.cqes);
+}
+
+UringFD::~UringFD() {
+   if (_sqes != NULL)
+      munmap(_sqes, _sqes_size);
+   if (_ring_ptr != NULL)
+      munmap(_ring_ptr, _ring_size);
+   closeFD();
+}
+
+/******************************************************************************************
+ * getSQE - gets the next free submission queue entry, submitting what is queued first if
+ *          the ring is full. The kernel refuses submissions (EBUSY) while the completion
+ *          ring is backed up, so waiting completions are moved into _backlog first, where
+ *          getCompletion hands them out before any newer ones.
+ *
+ *    Throws: socket_error if the kernel would take neither the entries nor the completions
+ ******************************************************************************************/
+
+io_uring_sqe *UringFD::getSQE() {
+   unsigned int tail = *_sq_tail;
+   unsigned int head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+   while (tail - head > *_sq_mask) {
+      unsigned int moved = 0;
+      uint64_t user_data;
+      int res;
+      while (popCompletion(user_data, res)) {
+         _backlog.emplace_back(user_data, res);
+         moved++;
+      }
+
+      int submitted = submitAndWait(0);
+      head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+      if ((submitted == 0) && (moved == 0) && (tail - head > *_sq_mask))
+         throw socket_error("io_uring submission queue is full.");
+   }
+
+   unsigned int index = tail & *_sq_mask;
+   io_uring_sqe *sqe = &_sqes[index];
+   bzero(sqe, sizeof(*sqe));
+
+   _sq_array[index] = index;
+   __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+   _to_submit++;
+   return sqe;
+}
+
+/******************************************************************************************
+ * prepAccept/prepRecv/prepRead/prepWritev/prepCancel - queue an operation on the submission
+ *          ring. Nothing is sent to the kernel until submitAndWait.
+ *
+ *    Params:  fd - the FD the operation works on
+ *             buf, len - the data buffer, which must stay valid until the completion arrives
+ *             iov, iovcnt - the pieces to write, which (and whose data) must stay valid until
+ *                           the completion arrives. On a socket the kernel waits for room in
+ *                           the send buffer itself.
+ *             target - user_data of the queued operation to cancel. It still completes, with
+ *                      -ECANCELED unless it had already finished.
+ *             user_data - value handed back with the completion
+ *
+ *    Throws: socket_error if the submission queue is full and can't be flushed
+ ******************************************************************************************/
+
+void UringFD::prepAccept(int fd, uint64_t user_data) {
+   io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = fd;
+   sqe->user_data = user_data;
+}
+
+void UringFD::prepRecv(int fd, void *buf, size_t len, uint64_t user_data) {
+   io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = fd;
+   sqe->addr = (uint64_t) buf;
+   sqe->len = len;
+   sqe->user_data = user_data;
+}
+
+void UringFD::prepRead(int fd, void *buf, size_t len, uint64_t user_data) {
+   io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_READ;
+   sqe->fd = fd;
+   sqe->addr = (uint64_t) buf;
+   sqe->len = len;
+   sqe->off = (uint64_t) -1;
+   sqe->user_data = user_data;
+}
+
+void UringFD::prepWritev(int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t user_data) {
+   io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_WRITEV;
+   sqe->fd = fd;
+   sqe->addr = (uint64_t) iov;
+   sqe->len = iovcnt;
+   sqe->user_data = user_data;
+}
+
+void UringFD::prepCancel(uint64_t target, uint64_t user_data) {
+   io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = target;
+   sqe->user_data = user_data;
+}
+
+/******************************************************************************************
+ * submitAndWait - hands every queued operation to the kernel in one system call and waits
+ *                 for completions
+ *
+ *    Params:  wait_nr - the number of completions to wait for (0 to just submit)
+ *
+ *    Returns: the number of operations the kernel accepted, 0 if interrupted by a signal
+ *
+ *    Throws: socket_error if io_uring_enter fails
+ ******************************************************************************************/
+
+int UringFD::submitAndWait(unsigned int wait_nr) {
+   // Completions set aside by getSQE are already waiting
+   if (!_backlog.empty())
+      wait_nr = 0;
+   unsigned int flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+   int n = syscall(__NR_io_uring_enter, _fd, _to_submit, wait_nr, flags, NULL, 0);
+   if (n == -1) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+         return 0;
+      throw socket_error("io_uring enter failed.");
+   }
+
+   _to_submit -= ((unsigned int) n < _to_submit) ? n : _to_submit;
+   return n;
+}
+
+/******************************************************************************************
+ * getCompletion - gets the next completion, from those getSQE set aside first and then off
+ *                 the completion ring
+ *
+ *    Params:  user_data - set to the user_data of the completed operation
+ *             res - set to the operation's result (same as the syscall, or -errno)
+ *
+ *    Returns: true if a completion was found, false if there were none waiting
+ ******************************************************************************************/
+
+bool UringFD::getCompletion(uint64_t &user_data, int &res) {
+   if (_backlog.empty())
+      return popCompletion(user_data, res);
+
+   user_data = _backlog.front().first;
+   res = _backlog.front().second;
+   _backlog.pop_front();
+   return true;
+}
+
+bool UringFD::popCompletion(uint64_t &user_data, int &res) {
+   unsigned int head = *_cq_head;
+   if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+      return false;
+
+   io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+   user_data = cqe->user_data;
+   res = cqe->res;
+
+   __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
 /*****************************************************************************************
  * readStr - For a file FD, reads in characters until it hits a newline char. Not set up to
  *          work with sockets as it does not buffer and could lose data if partial data
- *          arrives.
+ *          arrives - connections frame their input with a LineBuffer instead.
  *
  *    Params:  buf - the STL string buf to put the results into
  *
@@ -0,0 +1,93 @@
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <argon2.h>
+#include "HashArena.h"
+#include "exceptions.h"
+
+// Explicit huge pages are 2 MiB on the platforms we run on
+const size_t hugepage_size = 2 * 1024 * 1024;
+
+// The arena Argon2 should use on this thread, if any
+static thread_local HashArena *thread_arena = NULL;
+
+/*******************************************************************************************
+ * HashArena (constructor) - Maps and pre-faults the arena. Explicit huge pages are tried
+ *                           first, then a normal mapping with a transparent huge page hint.
+ *
+ *    Params:  size - bytes needed by one hash (m_cost KiB for Argon2)
+ *
+ *    Throws: runtime_error if the memory could not be mapped
+ *******************************************************************************************/
+
+HashArena::HashArena(size_t size):_size(size) {
+   size_t huge_size = (size + hugepage_size - 1) & ~(hugepage_size - 1);
+
+   void *mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+   if (mem != MAP_FAILED) {
+      _hugepages = true;
+      _size = huge_size;
+   } else {
+      mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED)
+         throw std::runtime_error("Could not map Argon2 hash arena.");
+
+#ifdef MADV_HUGEPAGE
+      madvise(mem, size, MADV_HUGEPAGE);
+#endif
+      // Fault every page in now (after the hint, so THP can back it) instead of on first hash
+      volatile uint8_t *touch = (volatile uint8_t *) mem;
+      for (size_t i = 0; i < size; i += 4096)
+         touch[i] = 0;
+   }
+
+   _mem = (uint8_t *) mem;
+}
+
+HashArena::~HashArena() {
+   if (thread_arena == this)
+      thread_arena = NULL;
+   munmap(_mem, _size);
+}
+
+void HashArena::setThreadArena(HashArena *arena) {
+   thread_arena = arena;
+}
+
+HashArena *HashArena::getThreadArena() {
+   return thread_arena;
+}
+
+/*******************************************************************************************
+ * allocate - Argon2 allocation callback. Hands out the thread's arena if it's big enough and
+ *            free, otherwise falls back to malloc like libargon2 would by itself.
+ *
+ *    Returns: ARGON2_OK, or ARGON2_MEMORY_ALLOCATION_ERROR if malloc failed
+ *******************************************************************************************/
+
+int HashArena::allocate(uint8_t **memory, size_t bytes_to_allocate) {
+   HashArena *arena = thread_arena;
+   if ((arena != NULL) && !arena->_in_use && (bytes_to_allocate <= arena->_size)) {
+      arena->_in_use = true;
+      *memory = arena->_mem;
+      return ARGON2_OK;
+   }
+
+   *memory = (uint8_t *) malloc(bytes_to_allocate);
+   return (*memory == NULL) ? ARGON2_MEMORY_ALLOCATION_ERROR : ARGON2_OK;
+}
+
+/*******************************************************************************************
+ * deallocate - Argon2 free callback, the counterpart to allocate. libargon2 has already wiped
+ *              the memory by the time this is called.
+ *
+ *******************************************************************************************/
+
+void HashArena::deallocate(uint8_t *memory, size_t /* bytes_to_allocate */) {
+   HashArena *arena = thread_arena;
+   if ((arena != NULL) && (memory == arena->_mem)) {
+      arena->_in_use = false;
+      return;
+   }
+   free(memory);
+}
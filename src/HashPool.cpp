@@ -0,0 +1,261 @@
+#include <iostream>
+#include "HashPool.h"
+#include "PasswdMgr.h"
+#include "HashArena.h"
+#include "Metrics.h"
+#include "Profiler.h"
+
+// Memory one worker's hash needs
+const size_t hash_mem_size = (size_t) argon2_m_cost * 1024;
+
+HashCompletionQueue::HashCompletionQueue() {
+
+}
+
+HashCompletionQueue::~HashCompletionQueue() {
+
+}
+
+/*******************************************************************************************
+ * push - Adds a finished job and wakes the owning reactor. Called from worker threads.
+ *
+ *******************************************************************************************/
+
+void HashCompletionQueue::push(std::unique_ptr<HashJob> job) {
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      _jobs.push_back(std::move(job));
+   }
+   _eventfd.notify();
+}
+
+/*******************************************************************************************
+ * popAll - Moves every finished job into jobs. Called by the owning reactor.
+ *
+ *******************************************************************************************/
+
+void HashCompletionQueue::popAll(std::vector<std::unique_ptr<HashJob>> &jobs) {
+   jobs.clear();
+
+   std::lock_guard<std::mutex> guard(_lock);
+   jobs.swap(_jobs);
+}
+
+/*******************************************************************************************
+ * HashPool (constructor) - Starts the worker threads and the expiry thread
+ *
+ *    Params:  pwd_file - the password file the jobs are checked against and written to
+ *             num_workers - number of threads (at least one is started)
+ *             mem_budget - bytes of hashing memory allowed (0 for no cap). Nothing tracks what
+ *                          is actually allocated: it only caps the number of workers, at
+ *                          hash_mem_size each.
+ *             max_queue - jobs allowed to wait for a worker before new ones are shed
+ *             deadline_ms - how long a job may wait for a worker before it is dropped
+ *
+ *******************************************************************************************/
+
+HashPool::HashPool(const char *pwd_file, unsigned int num_workers, size_t mem_budget,
+                   unsigned int max_queue, unsigned int deadline_ms):
+                   _pwd_file(pwd_file), _max_queue(max_queue), _deadline(deadline_ms) {
+   if ((mem_budget > 0) && (num_workers > mem_budget / hash_mem_size))
+      num_workers = mem_budget / hash_mem_size;
+   if (num_workers == 0)
+      num_workers = 1;
+
+   for (unsigned int i = 0; i < num_workers; i++)
+      _workers.emplace_back(&HashPool::runWorker, this);
+   _expiry = std::thread(&HashPool::runExpiry, this);
+}
+
+/*******************************************************************************************
+ * HashPool (destructor) - Lets the workers finish the job they are on and joins them and
+ *                         the expiry thread. Jobs still queued are dropped.
+ *
+ *******************************************************************************************/
+
+HashPool::~HashPool() {
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stopping = true;
+   }
+   _cond.notify_all();
+   _expiry_cond.notify_one();
+
+   for (auto &worker : _workers)
+      worker.join();
+   _expiry.join();
+}
+
+/*******************************************************************************************
+ * submit - Queues a job for the next free worker. The result is pushed to job->done.
+ *
+ *    Returns: false if the queue was full and the job was shed (nothing will be pushed)
+ *
+ *******************************************************************************************/
+
+bool HashPool::submit(std::unique_ptr<HashJob> job) {
+   job->queued = std::chrono::steady_clock::now();
+   job->deadline = job->queued + _deadline;
+   bool was_empty;
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stats.submitted++;
+      if (_queue.size() >= _max_queue) {
+         _stats.shed++;
+         return false;
+      }
+
+      was_empty = _queue.empty();
+      _queue.push_back(std::move(job));
+      if (_queue.size() > _stats.max_queue_depth)
+         _stats.max_queue_depth = _queue.size();
+   }
+   _cond.notify_one();
+
+   // The expiry thread sleeps until the oldest job's deadline, or for good if there was none
+   if (was_empty)
+      _expiry_cond.notify_one();
+   return true;
+}
+
+/*******************************************************************************************
+ * getStats - Copies the pool's counters (max_queue_depth is the high water mark since the
+ *            last call)
+ *
+ *******************************************************************************************/
+
+void HashPool::getStats(HashPoolStats &stats) {
+   std::lock_guard<std::mutex> guard(_lock);
+   stats = _stats;
+   stats.queue_depth = _queue.size();
+   _stats.max_queue_depth = _queue.size();
+}
+
+/*******************************************************************************************
+ * runExpiry - Expiry thread loop. Sleeps until the oldest queued job's deadline and sends
+ *             back every job that has waited past it as hash_expired, so clients hear right
+ *             away that the server is busy rather than whenever a worker frees up (workers
+ *             only check deadlines as they take jobs).
+ *
+ *******************************************************************************************/
+
+void HashPool::runExpiry() {
+   std::vector<std::unique_ptr<HashJob>> expired;
+   std::unique_lock<std::mutex> guard(_lock);
+
+   while (!_stopping) {
+      if (_queue.empty()) {
+         _expiry_cond.wait(guard);
+         continue;
+      }
+
+      // Every job gets the same deadline, so the queue is in deadline order
+      auto now = std::chrono::steady_clock::now();
+      if (now <= _queue.front()->deadline) {
+         _expiry_cond.wait_until(guard, _queue.front()->deadline);
+         continue;
+      }
+
+      while (!_queue.empty() && (now > _queue.front()->deadline)) {
+         std::unique_ptr<HashJob> job = std::move(_queue.front());
+         _queue.pop_front();
+
+         recordWait(*job, now);
+         _stats.expired++;
+         job->status = hash_expired;
+         expired.push_back(std::move(job));
+      }
+
+      guard.unlock();
+      for (auto &job : expired) {
+         HashCompletionQueue *done = job->done;
+         done->push(std::move(job));
+      }
+      expired.clear();
+      guard.lock();
+   }
+}
+
+/*******************************************************************************************
+ * recordWait - Records how long a job waited for a worker. Called with _lock held.
+ *
+ *******************************************************************************************/
+
+void HashPool::recordWait(const HashJob &job, std::chrono::steady_clock::time_point now) {
+   Metrics::record(mh_hash_wait,
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(now - job.queued).count());
+   uint64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(now - job.queued).count();
+   _stats.wait_us_total += wait_us;
+   if (wait_us > _stats.wait_us_max)
+      _stats.wait_us_max = wait_us;
+}
+
+/*******************************************************************************************
+ * runWorker - Worker thread loop, takes jobs off the queue and runs them against the
+ *             password file using the worker's own Argon2 memory arena
+ *
+ *******************************************************************************************/
+
+void HashPool::runWorker() {
+   // Each worker hashes in its own arena, set up once here rather than on every hash. Without
+   // one, libargon2 just allocates per hash as before.
+   std::unique_ptr<HashArena> arena;
+   try {
+      arena.reset(new HashArena(hash_mem_size));
+      HashArena::setThreadArena(arena.get());
+   } catch (std::runtime_error &e) {
+      std::cerr << "Hash worker running without an arena: " << e.what() << std::endl;
+   }
+
+   while (true) {
+      std::unique_ptr<HashJob> job;
+      {
+         std::unique_lock<std::mutex> guard(_lock);
+         _cond.wait(guard, [this]() { return _stopping || !_queue.empty(); });
+         if (_stopping)
+            return;
+
+         job = std::move(_queue.front());
+         _queue.pop_front();
+
+         auto now = std::chrono::steady_clock::now();
+         recordWait(*job, now);
+         if (now > job->deadline) {
+            _stats.expired++;
+            job->status = hash_expired;
+         }
+      }
+
+      // The client has likely given up on an expired job, so don't spend a hash on it
+      if (job->status == hash_expired) {
+         HashCompletionQueue *done = job->done;
+         done->push(std::move(job));
+         continue;
+      }
+
+      PasswdMgr pwm(_pwd_file.c_str());
+      try {
+         ProfileScope profile(pp_argon2);
+         if (job->type == hash_check) {
+            auto start = std::chrono::steady_clock::now();
+            job->result = pwm.checkPasswd(job->name.c_str(), job->passwd.c_str());
+            auto end = std::chrono::steady_clock::now();
+            Metrics::record(mh_argon2_verify,
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+         } else
+            job->result = pwm.changePasswd(job->name.c_str(), job->passwd.c_str());
+      } catch (std::runtime_error &e) {
+         std::cerr << "Error in hash worker: " << e.what() << std::endl;
+         job->result = false;
+      }
+
+      // Counted once the hash has actually run, so completed never includes one in progress
+      {
+         std::lock_guard<std::mutex> guard(_lock);
+         _stats.completed++;
+      }
+
+      HashCompletionQueue *done = job->done;
+      done->push(std::move(job));
+   }
+}
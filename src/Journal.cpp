@@ -0,0 +1,528 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "Journal.h"
+#include "Logger.h"
+
+// The running journal, if any
+static std::atomic<Journal *> active_journal{NULL};
+
+JournalSegment::JournalSegment() {
+
+}
+
+JournalSegment::~JournalSegment() {
+   unmap();
+}
+
+void JournalSegment::unmap() {
+   if (_seg_map != NULL)
+      munmap(_seg_map, _seg_size);
+   if (_idx_map != NULL)
+      munmap(_idx_map, _idx_size);
+   _seg_map = _idx_map = NULL;
+   _records = NULL;
+   _idx_header = NULL;
+   _count = 0;
+}
+
+/*******************************************************************************************
+ * mapFile - Maps a whole file read-only
+ *
+ *    Returns: the mapping, or NULL if the file can't be opened, is smaller than min_size or
+ *             can't be mapped
+ *******************************************************************************************/
+
+static void *mapFile(const std::string &path, size_t min_size, size_t &size) {
+   int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+      return NULL;
+
+   struct stat file_stat;
+   void *map = NULL;
+   if ((fstat(fd, &file_stat) == 0) && ((size_t) file_stat.st_size >= min_size)) {
+      size = file_stat.st_size;
+      map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+         map = NULL;
+   }
+   close(fd);
+   return map;
+}
+
+/*******************************************************************************************
+ * openSegment - Maps a segment, and its index if it was sealed. An index whose count doesn't
+ *               match the segment is ignored.
+ *
+ *    Params:  path - the segment's .jrn file
+ *
+ *    Returns: false if the segment is missing or its header is wrong
+ *******************************************************************************************/
+
+bool JournalSegment::openSegment(const std::string &path) {
+   unmap();
+
+   _seg_map = mapFile(path, sizeof(JournalSegHeader), _seg_size);
+   if (_seg_map == NULL)
+      return false;
+
+   const JournalSegHeader *header = (const JournalSegHeader *) _seg_map;
+   if ((memcmp(header->magic, journal_seg_magic, sizeof(journal_seg_magic)) != 0) ||
+       (header->record_size != sizeof(JournalRecord))) {
+      unmap();
+      return false;
+   }
+
+   // The segment may still be being written, so ignore any partial record at the end
+   _records = (const JournalRecord *) (header + 1);
+   _count = (_seg_size - sizeof(JournalSegHeader)) / sizeof(JournalRecord);
+
+   std::string idx_path = path.substr(0, path.size() - 4) + ".idx";
+   _idx_map = mapFile(idx_path, sizeof(JournalIdxHeader), _idx_size);
+   if (_idx_map != NULL) {
+      const JournalIdxHeader *idx_header = (const JournalIdxHeader *) _idx_map;
+      if ((memcmp(idx_header->magic, journal_idx_magic, sizeof(journal_idx_magic)) == 0) &&
+          (idx_header->count == _count) &&
+          (_idx_size >= sizeof(JournalIdxHeader) + _count * sizeof(JournalIdxEntry)))
+         _idx_header = idx_header;
+   }
+   return true;
+}
+
+/*******************************************************************************************
+ * findTime - Binary searches the records for the first one at or after time_us
+ *
+ *    Returns: its record number, getCount() if every record is earlier
+ *******************************************************************************************/
+
+uint64_t JournalSegment::findTime(uint64_t time_us) {
+   const JournalRecord *found = std::lower_bound(_records, _records + _count, time_us,
+                        [](const JournalRecord &rec, uint64_t t) { return rec.time_us < t; });
+   return found - _records;
+}
+
+/*******************************************************************************************
+ * writeIndex - Builds a sealed segment's index: every record's address and number, sorted
+ *              by address, plus the segment's time range. Written to a temporary file and
+ *              renamed, so readers never see a partial index.
+ *
+ *    Params:  path - the segment's .jrn file
+ *
+ *    Returns: false if the segment couldn't be read or the index written
+ *******************************************************************************************/
+
+bool JournalSegment::writeIndex(const std::string &path) {
+   JournalSegment seg;
+   if (!seg.openSegment(path))
+      return false;
+
+   std::vector<JournalIdxEntry> entries(seg.getCount());
+   const JournalRecord *records = seg.getRecords();
+   for (uint64_t i = 0; i < seg.getCount(); i++) {
+      entries[i].ipaddr = records[i].ipaddr;
+      entries[i].recno = i;
+   }
+   std::sort(entries.begin(), entries.end(), [](const JournalIdxEntry &a, const JournalIdxEntry &b) {
+      return (a.ipaddr < b.ipaddr) || ((a.ipaddr == b.ipaddr) && (a.recno < b.recno));
+   });
+
+   JournalIdxHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, journal_idx_magic, sizeof(journal_idx_magic));
+   header.count = seg.getCount();
+   if (header.count > 0) {
+      header.min_us = records[0].time_us;
+      header.max_us = records[header.count - 1].time_us;
+   }
+
+   std::string idx_path = path.substr(0, path.size() - 4) + ".idx";
+   std::string tmp_path = idx_path + ".tmp";
+   int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd == -1)
+      return false;
+
+   size_t entries_size = entries.size() * sizeof(JournalIdxEntry);
+   bool ok = (write(fd, &header, sizeof(header)) == sizeof(header)) &&
+             (write(fd, entries.data(), entries_size) == (ssize_t) entries_size);
+   close(fd);
+
+   if (!ok || (rename(tmp_path.c_str(), idx_path.c_str()) != 0)) {
+      unlink(tmp_path.c_str());
+      return false;
+   }
+   return true;
+}
+
+/*******************************************************************************************
+ * listSegments - Finds every segment in a journal directory
+ *
+ *    Params:  dir - the journal directory
+ *             segments - set to the paths of the .jrn files, oldest first
+ *******************************************************************************************/
+
+void Journal::listSegments(const std::string &dir, std::vector<std::string> &segments) {
+   segments.clear();
+
+   DIR *dirp = opendir(dir.c_str());
+   if (dirp == NULL)
+      return;
+
+   struct dirent *ent;
+   while ((ent = readdir(dirp)) != NULL) {
+      std::string name(ent->d_name);
+      if ((name.compare(0, 4, "seg-") == 0) && (name.size() > 8) &&
+          (name.compare(name.size() - 4, 4, ".jrn") == 0))
+         segments.push_back(dir + "/" + name);
+   }
+   closedir(dirp);
+
+   std::sort(segments.begin(), segments.end());
+}
+
+/*******************************************************************************************
+ * loadNames - Reads the interned usernames of a journal
+ *
+ *    Params:  dir - the journal directory
+ *             names - set to the names by id, names[0] being "" for no user
+ *
+ *    Returns: false if the names file exists but couldn't be read
+ *******************************************************************************************/
+
+bool Journal::loadNames(const std::string &dir, std::vector<std::string> &names) {
+   names.assign(1, "");
+
+   std::string path = dir + "/names";
+   size_t size = 0;
+   void *map = mapFile(path, 1, size);
+   if (map == NULL) {
+      struct stat file_stat;
+      return (stat(path.c_str(), &file_stat) != 0) || (file_stat.st_size == 0);
+   }
+
+   const uint8_t *pos = (const uint8_t *) map;
+   const uint8_t *end = pos + size;
+   while ((pos < end) && (pos + 1 + *pos <= end)) {
+      names.emplace_back((const char *) pos + 1, *pos);
+      pos += 1 + *pos;
+   }
+
+   munmap(map, size);
+   return true;
+}
+
+/*******************************************************************************************
+ * start - Creates the journal directory if needed, seals any segments a previous run left
+ *         unsealed and starts the writer on a new segment
+ *
+ *    Params:  results - set to a description of the journal, or why it couldn't start
+ *             dir - the journal directory
+ *
+ *    Returns: true if the journal is running
+ *******************************************************************************************/
+
+bool Journal::start(std::string &results, const char *dir) {
+   static std::mutex start_lock;
+   std::lock_guard<std::mutex> guard(start_lock);
+
+   if (active_journal.load() != NULL) {
+      results = "Journal already running.";
+      return true;
+   }
+
+   if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+      results = std::string("Could not create journal directory ") + dir + ": " + strerror(errno);
+      return false;
+   }
+
+   std::vector<std::string> segments;
+   listSegments(dir, segments);
+   unsigned int sealed = 0;
+   for (auto &seg_path : segments) {
+      struct stat idx_stat;
+      std::string idx_path = seg_path.substr(0, seg_path.size() - 4) + ".idx";
+      if ((stat(idx_path.c_str(), &idx_stat) != 0) && JournalSegment::writeIndex(seg_path))
+         sealed++;
+   }
+
+   std::vector<std::string> names;
+   if (!loadNames(dir, names)) {
+      results = std::string("Could not read the journal's names in ") + dir;
+      return false;
+   }
+
+   // Owns the journal so it is flushed and sealed at exit. The Logger is created first so it
+   // is destroyed after the journal, which may still log while it shuts down.
+   Logger::getLogger();
+   static std::unique_ptr<Journal> journal_owner;
+
+   std::unique_ptr<Journal> journal(new Journal(dir));
+   for (uint32_t id = 1; id < names.size(); id++)
+      journal->_name_ids[names[id]] = id;
+
+   journal->_names_fd = open((std::string(dir) + "/names").c_str(),
+                             O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+   if (journal->_names_fd == -1) {
+      results = std::string("Could not open the journal's names in ") + dir;
+      return false;
+   }
+
+   journal->_writer = std::thread(&Journal::runWriter, journal.get());
+   active_journal = journal.get();
+   journal_owner = std::move(journal);
+
+   results = std::string("Journaling events to ") + dir + " (" + std::to_string(segments.size()) +
+             " existing segments, " + std::to_string(sealed) + " sealed at startup).";
+   return true;
+}
+
+bool Journal::isEnabled() {
+   return active_journal.load(std::memory_order_relaxed) != NULL;
+}
+
+Journal::Journal(const std::string &dir):_dir(dir), _ring(journal_ring_slots) {
+
+}
+
+/*******************************************************************************************
+ * stop - Stops the running journal's writer, if there is one. Used when the server exits
+ *        without running destructors, so the last events still reach a sealed segment.
+ *
+ *******************************************************************************************/
+
+void Journal::stop() {
+   Journal *journal = active_journal.exchange(NULL);
+   if (journal != NULL)
+      journal->stopWriter();
+}
+
+/*******************************************************************************************
+ * stopWriter - Stops the writer, which writes out the ring and seals the current segment
+ *
+ *******************************************************************************************/
+
+void Journal::stopWriter() {
+   _stop = true;
+   if (_writer.joinable())
+      _writer.join();
+}
+
+Journal::~Journal() {
+   active_journal = NULL;
+   stopWriter();
+
+   if (_names_fd != -1)
+      close(_names_fd);
+}
+
+/*******************************************************************************************
+ * record - Queues an event for the running journal, doing nothing if there isn't one
+ *
+ *    Params:  event, outcome - what happened
+ *             ipaddr - the peer's IPv4 address in network byte order (SocketFD::getIPAddr)
+ *             user - the username involved, empty for none
+ *******************************************************************************************/
+
+void Journal::record(journal_event event, journal_outcome outcome, unsigned long ipaddr,
+                                                                   const std::string &user) {
+   Journal *journal = active_journal.load(std::memory_order_acquire);
+   if (journal != NULL)
+      journal->push(event, outcome, ipaddr, user);
+}
+
+void Journal::push(journal_event event, journal_outcome outcome, unsigned long ipaddr,
+                                                                 const std::string &user) {
+   uint64_t pos;
+   JournalEntry *entry = _ring.reserve(pos);
+   if (entry == NULL) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+   }
+
+   entry->time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::system_clock::now().time_since_epoch()).count();
+   entry->ipaddr = ntohl((uint32_t) ipaddr);
+   entry->event = event;
+   entry->outcome = outcome;
+   entry->namelen = std::min((size_t) journal_namelen, user.size());
+   memcpy(entry->name, user.data(), entry->namelen);
+   _ring.publish(pos);
+}
+
+/*******************************************************************************************
+ * runWriter - Drains the ring into the current segment every journal_flush_ms until the
+ *             journal is destroyed, then seals the segment
+ *
+ *******************************************************************************************/
+
+void Journal::runWriter() {
+   uint64_t dropped_reported = 0;
+
+   while (true) {
+      bool stopping = _stop.load();
+      bool drained = drain();
+      writeOut(_names_fd, _names_buf);
+      writeOut(_seg_fd, _seg_buf);
+
+      uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+      if (dropped != dropped_reported) {
+         std::string event = "Journal ring full, dropped " +
+                             std::to_string(dropped - dropped_reported) + " events.";
+         Logger::getLogger().log(event.c_str());
+         dropped_reported = dropped;
+      }
+
+      if (stopping)
+         break;
+      if (drained)
+         std::this_thread::sleep_for(std::chrono::milliseconds(journal_flush_ms));
+   }
+
+   sealSegment();
+}
+
+/*******************************************************************************************
+ * drain - Turns published ring entries into records for the current segment, opening a new
+ *         segment when there is none and sealing it once full
+ *
+ *    Returns: true if the ring is empty or a producer is mid-write (nothing more to do now)
+ *******************************************************************************************/
+
+bool Journal::drain() {
+   for (unsigned int count = 0; count < journal_ring_slots; count++) {
+      JournalEntry *entry = _ring.peek();
+      if (entry == NULL)
+         return true;
+
+      // Producers stamp their events after reserving a slot, so slots can be published out of
+      // time order. Keep the segment's time from going back.
+      _last_us = std::max(_last_us, entry->time_us);
+      if ((_seg_fd == -1) && !openSegment(_last_us)) {
+         _ring.release();
+         _lost++;
+         continue;
+      }
+
+      JournalRecord rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.time_us = _last_us;
+      rec.ipaddr = entry->ipaddr;
+      rec.user_id = entry->namelen ? intern(entry->name, entry->namelen) : 0;
+      rec.event = entry->event;
+      rec.outcome = entry->outcome;
+      _ring.release();
+
+      _seg_buf.append((const char *) &rec, sizeof(rec));
+      if (++_seg_count >= journal_segment_records) {
+         writeOut(_names_fd, _names_buf);
+         writeOut(_seg_fd, _seg_buf);
+         sealSegment();
+      }
+   }
+   return false;
+}
+
+/*******************************************************************************************
+ * intern - Looks up a username's id, assigning the next one (and queueing the name for the
+ *          names file) if it is new
+ *
+ *******************************************************************************************/
+
+uint32_t Journal::intern(const char *name, size_t len) {
+   std::string key(name, len);
+   auto nptr = _name_ids.find(key);
+   if (nptr != _name_ids.end())
+      return nptr->second;
+
+   uint32_t id = _name_ids.size() + 1;
+   _name_ids[key] = id;
+   _names_buf.push_back((char) len);
+   _names_buf.append(name, len);
+   return id;
+}
+
+/*******************************************************************************************
+ * openSegment - Starts a new segment file named for its first record's time. After a failed
+ *               open it isn't tried again for journal_flush_ms, and the records that arrive
+ *               in the meantime are dropped. Only the first failure is logged, and how many
+ *               records were lost once a segment opens again.
+ *
+ *    Returns: true if the segment is open
+ *******************************************************************************************/
+
+bool Journal::openSegment(uint64_t start_us) {
+   if (start_us < _open_retry_us)
+      return false;
+
+   char name[64];
+   snprintf(name, sizeof(name), "/seg-%020llu.jrn", (unsigned long long) start_us);
+   _seg_path = _dir + name;
+   _seg_count = 0;
+
+   _seg_fd = open(_seg_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+   if (_seg_fd == -1) {
+      if (_open_retry_us == 0)
+         Logger::getLogger().log(("Could not open journal segment " + _seg_path + ": " +
+                                  strerror(errno)).c_str());
+      _open_retry_us = start_us + journal_flush_ms * 1000;
+      return false;
+   }
+
+   if (_open_retry_us != 0) {
+      std::string event = "Journal segment " + _seg_path + " opened, " + std::to_string(_lost) +
+                          " events were lost while segments couldn't be.";
+      Logger::getLogger().log(event.c_str());
+      _open_retry_us = 0;
+      _lost = 0;
+   }
+
+   JournalSegHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, journal_seg_magic, sizeof(journal_seg_magic));
+   header.record_size = sizeof(JournalRecord);
+   header.start_us = start_us;
+   _seg_buf.insert(0, (const char *) &header, sizeof(header));
+   return true;
+}
+
+/*******************************************************************************************
+ * sealSegment - Closes the current segment and writes its index
+ *
+ *******************************************************************************************/
+
+void Journal::sealSegment() {
+   if (_seg_fd == -1)
+      return;
+
+   close(_seg_fd);
+   _seg_fd = -1;
+   if (!JournalSegment::writeIndex(_seg_path))
+      Logger::getLogger().log(("Could not write journal index for " + _seg_path).c_str());
+}
+
+/*******************************************************************************************
+ * writeOut - Writes a buffer to fd with as few writes as possible, then empties it
+ *
+ *******************************************************************************************/
+
+void Journal::writeOut(int fd, std::string &buf) {
+   size_t written = 0;
+   while ((fd != -1) && (written < buf.size())) {
+      ssize_t results = write(fd, buf.data() + written, buf.size() - written);
+      if (results < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+      written += results;
+   }
+   buf.clear();
+}
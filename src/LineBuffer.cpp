@@ -0,0 +1,108 @@
+#include <cstring>
+#include <errno.h>
+#include <algorithm>
+#include <sys/uio.h>
+#include "LineBuffer.h"
+
+const size_t line_buf_mask = line_buf_size - 1;
+
+/*******************************************************************************************
+ * fill - reads whatever is available from fd into the free space (both pieces of it, if it
+ *        wraps) with a single readv. On a level-triggered socket anything left over is read
+ *        on the next readiness event.
+ *
+ *    Returns: bytes read, 0 if the peer closed, -1 on error (errno is ENOBUFS if the buffer
+ *             had no room)
+ *******************************************************************************************/
+
+ssize_t LineBuffer::fill(FileDesc &fd) {
+   struct iovec iov[2];
+   iov[0].iov_base = getSpace(iov[0].iov_len);
+   if (iov[0].iov_len == 0) {
+      errno = ENOBUFS;
+      return -1;
+   }
+
+   // Whatever free space getSpace couldn't give contiguously is at the start of _buf
+   iov[1].iov_base = _buf;
+   iov[1].iov_len = line_buf_size - (_tail - _head) - iov[0].iov_len;
+
+   ssize_t amt_read = fd.readvFD(iov, (iov[1].iov_len > 0) ? 2 : 1);
+   if (amt_read > 0)
+      _tail += amt_read;
+   return amt_read;
+}
+
+/*******************************************************************************************
+ * getSpace - returns the contiguous free space after the buffered data. An empty buffer is
+ *            rewound first so the whole of it is available.
+ *
+ *    Params:  len - set to the size of the space (0 if the buffer is full)
+ *******************************************************************************************/
+
+char *LineBuffer::getSpace(size_t &len) {
+   // Nothing can be receiving into _buf while the caller asks for space, so rewinding is safe
+   if (_head == _tail)
+      _head = _tail = 0;
+
+   size_t start = _tail & line_buf_mask;
+   len = std::min(line_buf_size - (_tail - _head), line_buf_size - start);
+   return _buf + start;
+}
+
+/*******************************************************************************************
+ * findNewline - searches for the newline ending the next line, starting where the last search
+ *               stopped
+ *
+ *    Returns: free-running offset of the newline, or std::string::npos if there isn't one
+ *******************************************************************************************/
+
+size_t LineBuffer::findNewline() {
+   while (_head + _scanned != _tail) {
+      size_t start = (_head + _scanned) & line_buf_mask;
+      size_t len = std::min(_tail - _head - _scanned, line_buf_size - start);
+
+      char *newline = (char *) memchr(_buf + start, '\n', len);
+      if (newline != NULL) {
+         _scanned += newline - (_buf + start);
+         return _head + _scanned;
+      }
+      _scanned += len;
+   }
+   return std::string::npos;
+}
+
+/*******************************************************************************************
+ * getLine - takes the next complete line out of the buffer
+ *
+ *    Params:  line - set to the line without its newline or a trailing \r, left alone if there
+ *                    isn't one. It points into the buffer and stays valid until the next
+ *                    fill or getSpace.
+ *
+ *    Returns: true if a line was taken out
+ *******************************************************************************************/
+
+bool LineBuffer::getLine(std::string_view &line) {
+   size_t newline = findNewline();
+   if (newline == std::string::npos)
+      return false;
+
+   size_t start = _head & line_buf_mask;
+   size_t len = newline - _head;
+   const char *data = _buf + start;
+
+   if (start + len > line_buf_size) {
+      size_t first = line_buf_size - start;
+      memcpy(_wrapped, _buf + start, first);
+      memcpy(_wrapped + first, _buf, len - first);
+      data = _wrapped;
+   }
+
+   if ((len > 0) && (data[len - 1] == '\r'))
+      len--;
+   line = std::string_view(data, len);
+
+   _head = newline + 1;
+   _scanned = 0;
+   return true;
+}
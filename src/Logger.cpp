@@ -0,0 +1,473 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "Logger.h"
+#include "Metrics.h"
+#include "Profiler.h"
+
+// Compression reads sealed segments in chunks of this size
+const size_t log_compress_chunk = 256 * 1024;
+
+/*******************************************************************************************
+ * getLogger - Returns the server's logger, opening the log and starting the flusher thread
+ *             the first time
+ *
+ *******************************************************************************************/
+
+Logger &Logger::getLogger() {
+   static Logger logger(server_log_file);
+   return logger;
+}
+
+Logger::Logger(const char *filename):_filename(filename), _ring(log_ring_slots) {
+   size_t slash = _filename.rfind('/');
+   if (slash == std::string::npos) {
+      _dir = ".";
+      _base = _filename;
+   } else {
+      _dir = _filename.substr(0, slash);
+      _base = _filename.substr(slash + 1);
+   }
+
+   findSealed();
+   if (!openSegment())
+      perror("Could not open server.log");
+
+   _compressor = std::thread(&Logger::runCompressor, this);
+   _flusher = std::thread(&Logger::runFlusher, this);
+}
+
+Logger::~Logger() {
+   stop();
+}
+
+/*******************************************************************************************
+ * stop - Stops the flusher, which writes out whatever is still in the ring first, then
+ *        trims the active segment and stops the compressor. A segment still being
+ *        compressed is left sealed and compressed at the next start. Events logged
+ *        afterwards are discarded.
+ *
+ *******************************************************************************************/
+
+void Logger::stop() {
+   _stop = true;
+   if (_flusher.joinable())
+      _flusher.join();
+
+   closeSegment();
+
+   {
+      std::lock_guard<std::mutex> guard(_comp_lock);
+      _comp_stop = true;
+   }
+   _comp_cond.notify_all();
+   if (_compressor.joinable())
+      _compressor.join();
+}
+
+void Logger::log(const char *event) {
+   log(event, strlen(event));
+}
+
+/*******************************************************************************************
+ * log - Copies an event into the next free slot of the ring
+ *
+ *    Params:  event - the event text, without the timestamp or newline
+ *             len - length of event
+ *******************************************************************************************/
+
+void Logger::log(const char *event, size_t len) {
+   ProfileScope profile(pp_log);
+   uint64_t pos;
+   LogEntry *entry = _ring.reserve(pos);
+   if (entry == NULL) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+   }
+
+   if (len > sizeof(entry->text))
+      len = sizeof(entry->text);
+   entry->when = time(NULL);
+   entry->len = len;
+   memcpy(entry->text, event, len);
+   _ring.publish(pos);
+}
+
+/*******************************************************************************************
+ * runFlusher - Drains the ring into batches and writes them out, sleeping for log_flush_ms
+ *              whenever it is empty, until the logger is destroyed
+ *
+ *******************************************************************************************/
+
+void Logger::runFlusher() {
+   std::string buf;
+   buf.reserve(log_ring_slots * 64);
+
+   while (true) {
+      bool stopping = _stop.load();
+      Metrics::setGauge(mg_log_queue_depth, _ring.getDepth());
+      Metrics::setGauge(mg_log_dropped, _dropped.load(std::memory_order_relaxed));
+      bool drained, progress;
+      {
+         ProfileScope profile(pp_log_write);
+         drained = drain(buf);
+         progress = !buf.empty();
+         writeOut(buf);
+      }
+
+      if (stopping)
+         break;
+
+      if ((_seg_used > 0) && (time(NULL) - _seg_opened >= (time_t) log_rotate_secs))
+         rotate();
+
+      // Also back off if a producer was caught mid-write, rather than spin until it finishes
+      if (drained || !progress)
+         std::this_thread::sleep_for(std::chrono::milliseconds(log_flush_ms));
+   }
+}
+
+/*******************************************************************************************
+ * drain - Formats every event published in the ring into buf and frees their slots. Stops
+ *         early at a slot a producer has reserved but not finished writing.
+ *
+ *    Returns: true if the ring is now empty, false if it stopped at an unfinished slot or
+ *             filled a batch
+ *******************************************************************************************/
+
+bool Logger::drain(std::string &buf) {
+   for (unsigned int count = 0; count < log_ring_slots; count++) {
+      LogEntry *entry = _ring.peek();
+      if (entry == NULL)
+         return _ring.empty();
+
+      formatTime(entry->when);
+      buf.append(_stamp);
+      buf.append(" : ");
+      buf.append(entry->text, entry->len);
+      buf.push_back('\n');
+      _ring.release();
+   }
+   return false;
+}
+
+/*******************************************************************************************
+ * writeOut - Copies a batch into the active segment, adding a line about any events dropped
+ *            since the last batch, then empties buf. Rotates first if the batch does not fit,
+ *            so a batch is only split if it is larger than a whole segment.
+ *
+ *******************************************************************************************/
+
+void Logger::writeOut(std::string &buf) {
+   uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+   if (dropped != _dropped_reported) {
+      formatTime(time(NULL));
+      buf.append(_stamp);
+      buf.append(" : Logger ring full, dropped ");
+      buf.append(std::to_string(dropped - _dropped_reported));
+      buf.append(" events.\n");
+      _dropped_reported = dropped;
+   }
+
+   if ((_seg_used > 0) && (buf.size() > log_segment_size - _seg_used))
+      rotate();
+
+   size_t written = 0;
+   while ((_seg != NULL) && (written < buf.size())) {
+      if (_seg_used == log_segment_size) {
+         rotate();
+         continue;
+      }
+
+      size_t len = std::min(buf.size() - written, log_segment_size - _seg_used);
+      memcpy(_seg + _seg_used, buf.data() + written, len);
+      _seg_used += len;
+      written += len;
+   }
+   buf.clear();
+}
+
+/*******************************************************************************************
+ * formatTime - Sets _stamp to the ctime format of when (without the newline), only
+ *              formatting when the second differs from the last one
+ *
+ *******************************************************************************************/
+
+void Logger::formatTime(time_t when) {
+   if (when == _stamp_sec)
+      return;
+
+   struct tm local;
+   char stamp[64];
+   localtime_r(&when, &local);
+   strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", &local);
+   _stamp = stamp;
+   _stamp_sec = when;
+}
+
+/*******************************************************************************************
+ * openSegment - Opens the active segment, preallocates it to log_segment_size and maps it.
+ *               An existing file is continued after its last non-zero byte (the rest is
+ *               preallocated space), unless it is already full, in which case it is sealed
+ *               and a new one started.
+ *
+ *    Returns: true if the segment is mapped, false otherwise (errno is set)
+ *******************************************************************************************/
+
+bool Logger::openSegment() {
+   _fd = open(_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (_fd == -1)
+      return false;
+
+   struct stat st;
+   if (fstat(_fd, &st) == 0 && (size_t) st.st_size > log_segment_size) {
+      // Too big to continue (e.g. a log from before rotation), so seal it as is
+      _seg_used = st.st_size;
+      rotate();
+      return (_seg != NULL);
+   }
+
+   // Filesystems without fallocate get a sparse file instead
+   if ((posix_fallocate(_fd, 0, log_segment_size) != 0) &&
+       (ftruncate(_fd, log_segment_size) == -1)) {
+      int err = errno;
+      close(_fd);
+      _fd = -1;
+      errno = err;
+      return false;
+   }
+
+   void *seg = mmap(NULL, log_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+   if (seg == MAP_FAILED) {
+      int err = errno;
+      close(_fd);
+      _fd = -1;
+      errno = err;
+      return false;
+   }
+   _seg = (char *) seg;
+   _seg_opened = time(NULL);
+
+   _seg_used = std::min((size_t) st.st_size, log_segment_size);
+   while ((_seg_used > 0) && (_seg[_seg_used - 1] == '\0'))
+      _seg_used--;
+
+   if (_seg_used == log_segment_size)
+      rotate();
+   return true;
+}
+
+/*******************************************************************************************
+ * closeSegment - Unmaps the active segment and trims the file to the bytes written
+ *
+ *******************************************************************************************/
+
+void Logger::closeSegment() {
+   if (_seg != NULL) {
+      munmap(_seg, log_segment_size);
+      _seg = NULL;
+   }
+
+   if (_fd != -1) {
+      if (ftruncate(_fd, _seg_used) == -1)
+         perror("Could not trim server.log");
+      close(_fd);
+      _fd = -1;
+   }
+}
+
+/*******************************************************************************************
+ * rotate - Seals the active segment under a timestamped name, hands it to the compressor
+ *          and starts a new one. Only called from the flusher (or before it starts).
+ *
+ *******************************************************************************************/
+
+void Logger::rotate() {
+   closeSegment();
+
+   if (_seg_used > 0) {
+      time_t now = time(NULL);
+      struct tm local;
+      char stamp[32];
+      localtime_r(&now, &local);
+      strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+
+      // Two rotations in the same second get a sequence number
+      std::string sealed = _filename + "." + stamp;
+      struct stat st;
+      for (int seq = 1; (stat(sealed.c_str(), &st) == 0) ||
+                        (stat((sealed + ".gz").c_str(), &st) == 0); seq++)
+         sealed = _filename + "." + stamp + "." + std::to_string(seq);
+
+      // Reopening the same full segment would only rotate again, so stop logging instead
+      if (rename(_filename.c_str(), sealed.c_str()) == -1) {
+         perror("Could not rotate server.log");
+         return;
+      }
+      queueCompress(sealed);
+   }
+
+   _seg_used = 0;
+   if (!openSegment())
+      perror("Could not open new server.log segment");
+}
+
+/*******************************************************************************************
+ * findSealed - Queues sealed segments that were never compressed (the server stopped first)
+ *              and removes compressions that were cut short
+ *
+ *******************************************************************************************/
+
+void Logger::findSealed() {
+   DIR *dir = opendir(_dir.c_str());
+   if (dir == NULL)
+      return;
+
+   std::string prefix = _base + ".";
+   std::vector<std::string> sealed;
+   struct dirent *ent;
+   while ((ent = readdir(dir)) != NULL) {
+      std::string name(ent->d_name);
+      if ((name.compare(0, prefix.size(), prefix) != 0) || (name.size() == prefix.size()) ||
+          !isdigit((unsigned char) name[prefix.size()]))
+         continue;
+
+      std::string path = _dir + "/" + name;
+      if ((name.size() > 7) && (name.compare(name.size() - 7, 7, ".gz.tmp") == 0))
+         unlink(path.c_str());
+      else if ((name.size() <= 3) || (name.compare(name.size() - 3, 3, ".gz") != 0))
+         sealed.push_back(path);
+   }
+   closedir(dir);
+
+   std::sort(sealed.begin(), sealed.end());
+   for (auto &path : sealed)
+      queueCompress(path);
+}
+
+void Logger::queueCompress(const std::string &path) {
+   {
+      std::lock_guard<std::mutex> guard(_comp_lock);
+      _comp_queue.push_back(path);
+   }
+   _comp_cond.notify_one();
+}
+
+/*******************************************************************************************
+ * runCompressor - Compresses sealed segments as they are queued, at a low priority so it
+ *                 only uses CPU the server's threads leave idle
+ *
+ *******************************************************************************************/
+
+void Logger::runCompressor() {
+   setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+   std::unique_lock<std::mutex> guard(_comp_lock);
+   while (true) {
+      _comp_cond.wait(guard, [this]{ return _comp_stop || !_comp_queue.empty(); });
+      if (_comp_stop)
+         break;
+
+      std::string path = _comp_queue.front();
+      _comp_queue.pop_front();
+
+      guard.unlock();
+      if (compressSegment(path))
+         pruneSegments();
+      guard.lock();
+   }
+}
+
+/*******************************************************************************************
+ * compressSegment - gzips a sealed segment into <segment>.gz and removes the original. The
+ *                   .gz only appears once it is complete.
+ *
+ *    Returns: true if the segment was compressed, false if it failed or the logger is
+ *             shutting down (the segment is left for the next start)
+ *******************************************************************************************/
+
+bool Logger::compressSegment(const std::string &path) {
+   int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (in == -1)
+      return false;
+
+   std::string tmp = path + ".gz.tmp";
+   gzFile out = gzopen(tmp.c_str(), "wb6");
+   if (out == NULL) {
+      close(in);
+      return false;
+   }
+
+   std::vector<char> chunk(log_compress_chunk);
+   bool ok = true;
+   ssize_t len;
+   while ((len = read(in, chunk.data(), chunk.size())) != 0) {
+      if ((len < 0) && (errno == EINTR))
+         continue;
+
+      // Checking between chunks keeps shutdown quick even for a large segment
+      if ((len < 0) || (gzwrite(out, chunk.data(), len) != len) || _stop) {
+         ok = false;
+         break;
+      }
+   }
+   close(in);
+
+   if ((gzclose(out) != Z_OK) || !ok) {
+      unlink(tmp.c_str());
+      return false;
+   }
+
+   if (rename(tmp.c_str(), (path + ".gz").c_str()) == -1) {
+      unlink(tmp.c_str());
+      return false;
+   }
+   unlink(path.c_str());
+   return true;
+}
+
+/*******************************************************************************************
+ * pruneSegments - Deletes the oldest compressed segments beyond log_keep_segments
+ *
+ *******************************************************************************************/
+
+void Logger::pruneSegments() {
+   DIR *dir = opendir(_dir.c_str());
+   if (dir == NULL)
+      return;
+
+   std::string prefix = _base + ".";
+   std::vector<std::pair<time_t, std::string>> segments;
+   struct dirent *ent;
+   while ((ent = readdir(dir)) != NULL) {
+      std::string name(ent->d_name);
+      if ((name.compare(0, prefix.size(), prefix) != 0) || (name.size() <= prefix.size() + 3) ||
+          !isdigit((unsigned char) name[prefix.size()]) ||
+          (name.compare(name.size() - 3, 3, ".gz") != 0))
+         continue;
+
+      std::string path = _dir + "/" + name;
+      struct stat st;
+      if (stat(path.c_str(), &st) == 0)
+         segments.push_back(std::make_pair(st.st_mtime, path));
+   }
+   closedir(dir);
+
+   if (segments.size() <= log_keep_segments)
+      return;
+
+   std::sort(segments.begin(), segments.end());
+   for (size_t i = 0; i < segments.size() - log_keep_segments; i++)
+      unlink(segments[i].second.c_str());
+}
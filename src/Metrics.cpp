@@ -0,0 +1,208 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstring>
+#include <new>
+#include "Metrics.h"
+
+const char *metric_counter_names[mc_num_counters] = {"conns_accepted", "conns_rejected",
+                                                     "bytes_in", "bytes_out", "commands",
+                                                     "writes", "throttled"};
+
+const char *metric_gauge_names[mg_num_gauges] = {"sess_username", "sess_passwd", "sess_verifying",
+                                                 "sess_menu", "sess_changepwd", "sess_confirmpwd",
+                                                 "log_queue_depth", "log_dropped"};
+
+const char *metric_hist_names[mh_num_hists] = {"argon2_verify", "hash_wait", "cmd_hello",
+                                               "cmd_menu", "cmd_exit", "cmd_passwd", "cmd_1",
+                                               "cmd_2", "cmd_3", "cmd_4", "cmd_5", "cmd_unknown",
+                                               "reactor_iter"};
+
+thread_local MetricsSlot *Metrics::_local = NULL;
+std::atomic<MetricsHeader *> Metrics::_header{NULL};
+MetricsSlot Metrics::_spare;
+
+std::string Metrics::getShmName(unsigned short port) {
+   return "/tcpserver." + std::to_string(port);
+}
+
+size_t Metrics::getShmSize() {
+   return sizeof(MetricsHeader) + (size_t) metrics_max_slots * sizeof(MetricsSlot) + sizeof(SlowRing);
+}
+
+/*******************************************************************************************
+ * start - Creates the shared memory segment for the server on port and starts exporting.
+ *         Threads move onto their own slots the next time they record. A segment left by an
+ *         earlier server is unlinked rather than reused, so a reader still mapping it keeps
+ *         its (stale) copy instead of faulting.
+ *
+ *    Params:  port - the server's port, which names the segment
+ *             results - a description of what happened, for the log
+ *
+ *    Returns: true if metrics are being exported, false if the segment could not be made
+ *******************************************************************************************/
+
+bool Metrics::start(unsigned short port, std::string &results) {
+   std::string name = getShmName(port);
+   size_t size = getShmSize();
+
+   shm_unlink(name.c_str());
+   int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+   if (fd == -1) {
+      results = "Could not create metrics segment " + name + ": " + strerror(errno);
+      return false;
+   }
+
+   // Pages of the segment are only used once a slot touches them
+   if (ftruncate(fd, size) == -1) {
+      results = "Could not size metrics segment " + name + ": " + strerror(errno);
+      close(fd);
+      return false;
+   }
+
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      results = "Could not map metrics segment " + name + ": " + strerror(errno);
+      return false;
+   }
+
+   MetricsHeader *header = new (map) MetricsHeader;
+   header->slot_size = sizeof(MetricsSlot);
+   header->max_slots = metrics_max_slots;
+   header->num_slots.store(0, std::memory_order_relaxed);
+   header->pid = getpid();
+   header->started = time(NULL);
+
+   // Readers check the magic last, so they never see a half-initialized header
+   std::atomic_thread_fence(std::memory_order_release);
+   memcpy(header->magic, metrics_magic, sizeof(header->magic));
+   _header.store(header, std::memory_order_release);
+
+   results = "Exporting metrics in shared memory segment " + name + ".";
+   return true;
+}
+
+/*******************************************************************************************
+ * claimSlot - Gives the calling thread its own slot in the segment, or the spare slot if
+ *             metrics haven't started (it tries again next time) or the slots are used up
+ *
+ *******************************************************************************************/
+
+MetricsSlot &Metrics::claimSlot() {
+   MetricsHeader *header = _header.load(std::memory_order_acquire);
+   if (header == NULL)
+      return _spare;
+
+   uint32_t slot = header->num_slots.load(std::memory_order_relaxed);
+   do {
+      if (slot >= metrics_max_slots) {
+         _local = &_spare;
+         return _spare;
+      }
+   } while (!header->num_slots.compare_exchange_weak(slot, slot + 1, std::memory_order_acq_rel));
+
+   _local = const_cast<MetricsSlot *>(getSlots(header)) + slot;
+   return *_local;
+}
+
+/*******************************************************************************************
+ * recordSlow - Adds a slow reactor iteration to the segment's ring, overwriting the oldest.
+ *              Its seq is cleared while it is written so readers can skip a torn entry.
+ *              Does nothing before start().
+ *
+ *    Params:  frames - num_frames symbolized backtrace lines, truncated to fit
+ *******************************************************************************************/
+
+void Metrics::recordSlow(uint32_t reactor, int64_t when_us, uint64_t duration_ns, int fd,
+                         const char *handler, const char *status, char **frames,
+                         int num_frames) {
+   MetricsHeader *header = _header.load(std::memory_order_acquire);
+   if (header == NULL)
+      return;
+
+   SlowRing *ring = const_cast<SlowRing *>(getSlowRing(header));
+   uint64_t pos = ring->next.fetch_add(1, std::memory_order_relaxed);
+   SlowEvent &ev = ring->events[pos % slow_ring_events];
+
+   ev.seq.store(0, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   ev.when_us = when_us;
+   ev.duration_ns = duration_ns;
+   ev.reactor = reactor;
+   ev.fd = fd;
+   strncpy(ev.handler, (handler != NULL) ? handler : "", sizeof(ev.handler) - 1);
+   ev.handler[sizeof(ev.handler) - 1] = '\0';
+   strncpy(ev.status, (status != NULL) ? status : "", sizeof(ev.status) - 1);
+   ev.status[sizeof(ev.status) - 1] = '\0';
+
+   if (num_frames > (int) slow_max_frames)
+      num_frames = slow_max_frames;
+   ev.num_frames = (num_frames > 0) ? num_frames : 0;
+   for (int i = 0; i < num_frames; i++) {
+      strncpy(ev.frames[i], frames[i], slow_frame_len - 1);
+      ev.frames[i][slow_frame_len - 1] = '\0';
+   }
+
+   ev.seq.store(pos + 1, std::memory_order_release);
+}
+
+/*******************************************************************************************
+ * getBucketMax - Returns the largest value that falls in bucket, which is what percentiles
+ *                report (so they never understate)
+ *
+ *******************************************************************************************/
+
+uint64_t Metrics::getBucketMax(unsigned int bucket) {
+   const uint64_t sub_count = 1 << metrics_sub_bits;
+   const uint64_t half_count = sub_count >> 1;
+
+   if (bucket < sub_count)
+      return bucket;
+
+   unsigned int shift = (bucket - sub_count) / half_count + 1;
+   uint64_t sub = (bucket - sub_count) % half_count + half_count;
+   return (sub << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+/*******************************************************************************************
+ * getPercentile - Returns the value at pct (0 to 100) of a histogram's counts
+ *
+ *    Returns: the value, or 0 if the histogram is empty
+ *******************************************************************************************/
+
+uint64_t Metrics::getPercentile(const uint64_t counts[metrics_hist_buckets], double pct) {
+   uint64_t total = 0;
+   for (unsigned int i = 0; i < metrics_hist_buckets; i++)
+      total += counts[i];
+   if (total == 0)
+      return 0;
+
+   uint64_t rank = (uint64_t) ((pct / 100.0) * total + 0.5);
+   if (rank < 1)
+      rank = 1;
+
+   uint64_t seen = 0;
+   for (unsigned int i = 0; i < metrics_hist_buckets; i++) {
+      seen += counts[i];
+      if (seen >= rank)
+         return getBucketMax(i);
+   }
+   return getBucketMax(metrics_hist_buckets - 1);
+}
+
+const char *Metrics::getName(metric_counter counter) {
+   return metric_counter_names[counter];
+}
+
+const char *Metrics::getName(metric_gauge gauge) {
+   return metric_gauge_names[gauge];
+}
+
+const char *Metrics::getName(metric_hist hist) {
+   return metric_hist_names[hist];
+}
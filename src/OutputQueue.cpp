@@ -0,0 +1,182 @@
+#include <cstring>
+#include <errno.h>
+#include <algorithm>
+#include "OutputQueue.h"
+
+const size_t out_buf_mask = out_buf_size - 1;
+const size_t out_frag_mask = out_max_frags - 1;
+
+/*******************************************************************************************
+ * append - copies data onto the end of the queue. Copies that follow each other in the byte
+ *          ring are merged into one piece, so they go out as one iovec.
+ *
+ *    Returns: false (and queues nothing) if there isn't room for all of it
+ *******************************************************************************************/
+
+bool OutputQueue::append(const char *data, size_t len) {
+   if (len == 0)
+      return true;
+   if (len > out_buf_size - (_tail - _head))
+      return false;
+
+   size_t start = _tail & out_buf_mask;
+   size_t first = std::min(len, out_buf_size - start);
+
+   OutFrag *last = (_frag_tail != _frag_head) ? &_frags[(_frag_tail - 1) & out_frag_mask] : NULL;
+   bool extend = (last != NULL) && !last->reply && (last->data + last->len == _buf + start);
+
+   // One new piece unless this continues the last one, and another if it wraps
+   size_t needed = (extend ? 0 : 1) + ((first < len) ? 1 : 0);
+   if (needed > out_max_frags - (_frag_tail - _frag_head))
+      return false;
+
+   memcpy(_buf + start, data, first);
+   memcpy(_buf, data + first, len - first);
+   _tail += len;
+   _bytes += len;
+
+   if (extend)
+      last->len += first;
+   else {
+      OutFrag &frag = _frags[_frag_tail++ & out_frag_mask];
+      frag.data = _buf + start;
+      frag.len = first;
+   }
+
+   if (first < len) {
+      OutFrag &frag = _frags[_frag_tail++ & out_frag_mask];
+      frag.data = _buf;
+      frag.len = len - first;
+   }
+   return true;
+}
+
+/*******************************************************************************************
+ * append - queues a reference to a shared reply, which stays alive until it has been sent
+ *
+ *    Returns: false (and queues nothing) if there isn't room for another piece
+ *******************************************************************************************/
+
+bool OutputQueue::append(const SharedReply &reply) {
+   if (!reply || reply->empty())
+      return true;
+   if (_frag_tail - _frag_head == out_max_frags)
+      return false;
+
+   OutFrag &frag = _frags[_frag_tail++ & out_frag_mask];
+   frag.data = reply->data();
+   frag.len = reply->size();
+   frag.reply = reply;
+   _bytes += reply->size();
+   return true;
+}
+
+/*******************************************************************************************
+ * flush - writes as much of the queue as the (nonblocking) fd will take, out_flush_iovs
+ *         pieces per writev, until it is empty or a write comes up short
+ *
+ *    Returns: bytes written (0 if the queue was empty), -1 if the first write failed. errno is
+ *             EAGAIN if the socket's send buffer was full or an asynchronous send is still
+ *             out, and what's left stays queued either way.
+ *******************************************************************************************/
+
+ssize_t OutputQueue::flush(FileDesc &fd) {
+   if (_sending) {
+      errno = EAGAIN;
+      return -1;
+   }
+
+   ssize_t total = 0;
+   while (!isEmpty()) {
+      struct iovec iov[out_flush_iovs];
+      size_t wanted;
+      int iovcnt = fillIovecs(iov, wanted);
+
+      ssize_t written = fd.writevFD(iov, iovcnt);
+      if (written < 0)
+         return (total > 0) ? total : -1;
+
+      consume(written);
+      total += written;
+      if ((size_t) written < wanted)
+         break;
+   }
+   return total;
+}
+
+/*******************************************************************************************
+ * startSend - hands the front of the queue to an asynchronous writev (io_uring). The iovecs
+ *             and what they point to stay valid, and nothing else is sent, until finishSend.
+ *
+ *    Params:  iovcnt - set to the number of iovecs
+ *
+ *    Returns: the iovecs, NULL if the queue is empty or a send is already out
+ *******************************************************************************************/
+
+const struct iovec *OutputQueue::startSend(int &iovcnt) {
+   if (_sending || isEmpty())
+      return NULL;
+
+   size_t wanted;
+   iovcnt = fillIovecs(_send_iov, wanted);
+   _sending = true;
+   return _send_iov;
+}
+
+/*******************************************************************************************
+ * finishSend - takes what an asynchronous send wrote (nothing if it failed) off the queue
+ *
+ *******************************************************************************************/
+
+void OutputQueue::finishSend(ssize_t sent) {
+   _sending = false;
+   if (sent > 0)
+      consume(sent);
+}
+
+/*******************************************************************************************
+ * fillIovecs - points iov at up to out_flush_iovs pieces from the front of the queue
+ *
+ *    Params:  wanted - set to the total bytes they cover
+ *
+ *    Returns: the number of iovecs filled in
+ *******************************************************************************************/
+
+int OutputQueue::fillIovecs(struct iovec *iov, size_t &wanted) {
+   int iovcnt = 0;
+   wanted = 0;
+   for (size_t i = _frag_head; (i != _frag_tail) && (iovcnt < (int) out_flush_iovs); i++) {
+      OutFrag &frag = _frags[i & out_frag_mask];
+      iov[iovcnt].iov_base = (void *) frag.data;
+      iov[iovcnt++].iov_len = frag.len;
+      wanted += frag.len;
+   }
+   return iovcnt;
+}
+
+/*******************************************************************************************
+ * consume - drops len sent bytes off the front of the queue, releasing the shared replies
+ *           that were sent in full
+ *******************************************************************************************/
+
+void OutputQueue::consume(size_t len) {
+   _bytes -= len;
+
+   while (len > 0) {
+      OutFrag &frag = _frags[_frag_head & out_frag_mask];
+      size_t used = std::min(len, frag.len);
+      if (!frag.reply)
+         _head += used;
+      frag.data += used;
+      frag.len -= used;
+      len -= used;
+
+      if (frag.len == 0) {
+         frag.reply.reset();
+         _frag_head++;
+      }
+   }
+
+   if (isEmpty())
+      _head = _tail = _frag_head = _frag_tail = 0;
+}
@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "PasswdIndex.h"
+#include "exceptions.h"
+
+/*******************************************************************************************
+ * getIndex - Returns the one index for the given password file, creating it the first time
+ *
+ *******************************************************************************************/
+
+PasswdIndex &PasswdIndex::getIndex(const std::string &pwd_file) {
+   static std::mutex registry_lock;
+   static std::map<std::string, std::unique_ptr<PasswdIndex>> registry;
+
+   std::lock_guard<std::mutex> guard(registry_lock);
+   std::unique_ptr<PasswdIndex> &index = registry[pwd_file];
+   if (!index)
+      index.reset(new PasswdIndex(pwd_file));
+   return *index;
+}
+
+PasswdIndex::PasswdIndex(const std::string &pwd_file):_pwd_file(pwd_file) {
+   bzero(&_file_stat, sizeof(_file_stat));
+}
+
+/*******************************************************************************************
+ * lookup - Finds a user in the index, first bringing the index up to date with the file
+ *
+ *    Params:  name - the username to look for
+ *             entry - filled with the user's hash, salt and file offset if found
+ *
+ *    Returns: true if the user exists, false otherwise
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *******************************************************************************************/
+
+bool PasswdIndex::lookup(const std::string &name, PasswdEntry &entry) {
+   refresh();
+
+   std::shared_lock<std::shared_mutex> guard(_lock);
+   auto uptr = _users.find(name);
+   if (uptr == _users.end())
+      return false;
+
+   entry = uptr->second;
+   return true;
+}
+
+/*******************************************************************************************
+ * getAll - Brings the index up to date and copies out every user in it
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *******************************************************************************************/
+
+void PasswdIndex::getAll(std::vector<std::pair<std::string, PasswdEntry>> &users) {
+   refresh();
+
+   std::shared_lock<std::shared_mutex> guard(_lock);
+   users.assign(_users.begin(), _users.end());
+}
+
+/*******************************************************************************************
+ * refresh - Compares the file against what we indexed last. Unchanged costs one stat. If the
+ *           same file only grew (appended records), only the new records are parsed.
+ *           Anything else (replaced, truncated or rewritten in place) reloads the whole file.
+ *           Either way the file is read into a separate map first and the index lock is
+ *           only held to merge or swap it in.
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *******************************************************************************************/
+
+void PasswdIndex::refresh() {
+   struct stat file_stat;
+   if (stat(_pwd_file.c_str(), &file_stat) != 0)
+      throw pwfile_error("Could not stat passwd file");
+
+   {
+      std::shared_lock<std::shared_mutex> guard(_lock);
+      if (isCurrent(file_stat))
+         return;
+   }
+
+   std::lock_guard<std::mutex> refresh_guard(_refresh_lock);
+
+   // Another thread may have caught the index up while we waited for the lock. Only
+   // refreshers change _file_stat and _parsed_size, so we can read them from here on.
+   {
+      std::shared_lock<std::shared_mutex> guard(_lock);
+      if (isCurrent(file_stat))
+         return;
+   }
+
+   int fd = open(_pwd_file.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+      throw pwfile_error("Could not open passwd file for reading");
+
+   // Stat what we actually opened, the path may have been replaced since
+   if (fstat(fd, &file_stat) != 0) {
+      close(fd);
+      throw pwfile_error("Could not stat passwd file");
+   }
+
+   bool appended = (file_stat.st_ino == _file_stat.st_ino) &&
+                   (file_stat.st_dev == _file_stat.st_dev) &&
+                   (file_stat.st_size > _parsed_size) && (_parsed_size > 0);
+
+   std::unordered_map<std::string, PasswdEntry> users;
+   off_t parsed_size;
+   try {
+      parsed_size = parseFile(fd, appended ? _parsed_size : 0, users);
+   } catch (pwfile_error &e) {
+      close(fd);
+      throw;
+   }
+   close(fd);
+
+   std::unique_lock<std::shared_mutex> guard(_lock);
+   if (appended) {
+      for (auto &user : users)
+         _users[user.first] = user.second;
+   } else {
+      _users.swap(users);
+   }
+   _parsed_size = parsed_size;
+   _file_stat = file_stat;
+}
+
+/*******************************************************************************************
+ * isCurrent - true if the file is the same one, with the same size and mtime, that we last
+ *             indexed. Must be called with _lock held.
+ *
+ *******************************************************************************************/
+
+bool PasswdIndex::isCurrent(const struct stat &file_stat) {
+   return (file_stat.st_ino == _file_stat.st_ino) && (file_stat.st_dev == _file_stat.st_dev) &&
+          (file_stat.st_size == _file_stat.st_size) &&
+          (file_stat.st_mtim.tv_sec == _file_stat.st_mtim.tv_sec) &&
+          (file_stat.st_mtim.tv_nsec == _file_stat.st_mtim.tv_nsec);
+}
+
+/*******************************************************************************************
+ * parseFile - Reads the password file from start to the end in large chunks and indexes each
+ *             complete record. Records are name\n{32 byte hash}{16 byte salt}\n. The hash
+ *             and salt are taken by length, so a '\n' byte in them doesn't break parsing. A
+ *             later record for the same name replaces the earlier one.
+ *
+ *    Params:  fd - the open password file
+ *             start - file offset to start parsing at (must be the start of a record)
+ *             users - the records parsed are added into this
+ *
+ *    Returns: file offset just past the last complete record
+ *
+ *    Throws: pwfile_error if the password file could not be read
+ *******************************************************************************************/
+
+off_t PasswdIndex::parseFile(int fd, off_t start, std::unordered_map<std::string, PasswdEntry> &users) {
+   std::vector<char> buf;
+   char chunk[65536];
+   ssize_t amt_read;
+   off_t pos = start;
+   while ((amt_read = pread(fd, chunk, sizeof(chunk), pos)) > 0) {
+      buf.insert(buf.end(), chunk, chunk + amt_read);
+      pos += amt_read;
+   }
+
+   if (amt_read < 0)
+      throw pwfile_error("Could not read passwd file");
+
+   size_t i = 0;
+   while (i < buf.size()) {
+      char *nl = (char *) memchr(&buf[i], '\n', buf.size() - i);
+      if (nl == NULL)
+         break;
+
+      size_t namelen = nl - &buf[i];
+      size_t datapos = i + namelen + 1;
+      if (datapos + hashlen + saltlen + 1 > buf.size())
+         break;
+
+      std::string name(&buf[i], namelen);
+      PasswdEntry &entry = users[name];
+      memcpy(entry.hash, &buf[datapos], hashlen);
+      memcpy(entry.salt, &buf[datapos + hashlen], saltlen);
+      entry.offset = start + datapos;
+
+      i = datapos + hashlen + saltlen + 1;
+   }
+
+   return start + i;
+}
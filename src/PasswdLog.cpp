@@ -0,0 +1,275 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <chrono>
+#include "PasswdLog.h"
+#include "PasswdIndex.h"
+#include "exceptions.h"
+
+/*******************************************************************************************
+ * getLog - Returns the one log for the given password file, creating it the first time
+ *
+ *******************************************************************************************/
+
+PasswdLog &PasswdLog::getLog(const std::string &pwd_file) {
+   static std::mutex registry_lock;
+   static std::map<std::string, std::unique_ptr<PasswdLog>> registry;
+
+   std::lock_guard<std::mutex> guard(registry_lock);
+   std::unique_ptr<PasswdLog> &log = registry[pwd_file];
+   if (!log)
+      log.reset(new PasswdLog(pwd_file));
+   return *log;
+}
+
+PasswdLog::PasswdLog(const std::string &pwd_file):_pwd_file(pwd_file) {
+
+}
+
+PasswdLog::~PasswdLog() {
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stop = true;
+   }
+   _compact_wake.notify_all();
+   if (_compactor.joinable())
+      _compactor.join();
+
+   if (_fd != -1)
+      close(_fd);
+}
+
+/*******************************************************************************************
+ * makeRecord - Formats a record as name\n{32 byte hash}{16 byte salt}\n
+ *
+ *******************************************************************************************/
+
+void PasswdLog::makeRecord(std::string &record, const std::string &name, const uint8_t *hash,
+                                                                         const uint8_t *salt) {
+   record.clear();
+   record.reserve(name.size() + hashlen + saltlen + 2);
+   record.append(name);
+   record.push_back('\n');
+   record.append((const char *) hash, hashlen);
+   record.append((const char *) salt, saltlen);
+   record.push_back('\n');
+}
+
+/*******************************************************************************************
+ * append - Queues a record and waits for it to be written and synced. If no thread is
+ *          flushing, this one takes everything queued and writes it; otherwise it waits and
+ *          its record goes out with the next batch.
+ *
+ *    Params:  record - the formatted record (see makeRecord)
+ *             supersedes - true if it replaces an earlier record for the same user
+ *
+ *    Throws: pwfile_error if the batch holding this record could not be written
+ *******************************************************************************************/
+
+void PasswdLog::append(const std::string &record, bool supersedes) {
+   LogWrite write = {&record, false, false};
+
+   std::unique_lock<std::mutex> guard(_lock);
+   _pending.push_back(&write);
+
+   while (!write.done) {
+      if (_flushing) {
+         _committed.wait(guard);
+         continue;
+      }
+
+      // Lead the next batch, which includes our record
+      _flushing = true;
+      std::vector<LogWrite *> batch;
+      batch.swap(_pending);
+      guard.unlock();
+
+      writeBatch(batch);
+
+      guard.lock();
+      _flushing = false;
+      _committed.notify_all();
+   }
+
+   if (write.failed)
+      throw pwfile_error("Could not write to passwd file");
+
+   if (supersedes) {
+      _superseded += record.size();
+      if (!_compactor.joinable())
+         _compactor = std::thread(&PasswdLog::runCompactor, this);
+   }
+}
+
+/*******************************************************************************************
+ * writeBatch - Writes a batch of records with a single write and fdatasync while holding the
+ *              file lock, then marks them done (or failed)
+ *
+ *******************************************************************************************/
+
+void PasswdLog::writeBatch(std::vector<LogWrite *> &batch) {
+   std::string buf;
+   for (LogWrite *write : batch)
+      buf.append(*write->record);
+
+   bool failed = false;
+   try {
+      lockCurrentFile();
+
+      size_t written = 0;
+      while (written < buf.size()) {
+         ssize_t results = ::write(_fd, buf.data() + written, buf.size() - written);
+         if (results < 0) {
+            if (errno == EINTR)
+               continue;
+            failed = true;
+            break;
+         }
+         written += results;
+      }
+
+      if (!failed && (fdatasync(_fd) != 0))
+         failed = true;
+      flock(_fd, LOCK_UN);
+   } catch (pwfile_error &e) {
+      failed = true;
+   }
+
+   std::lock_guard<std::mutex> guard(_lock);
+   for (LogWrite *write : batch) {
+      write->failed = failed;
+      write->done = true;
+   }
+}
+
+/*******************************************************************************************
+ * lockCurrentFile - Opens the password file for appending (if needed) and takes its flock.
+ *                   If a compaction renamed a new file into place meanwhile, our fd is for
+ *                   the old one, so reopen and try again.
+ *
+ *    Throws: pwfile_error if the file can't be opened or locked
+ *******************************************************************************************/
+
+void PasswdLog::lockCurrentFile() {
+   while (true) {
+      if (_fd == -1) {
+         _fd = open(_pwd_file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+         if (_fd == -1)
+            throw pwfile_error("Could not open passwd file for appending");
+      }
+
+      if (flock(_fd, LOCK_EX) != 0)
+         throw pwfile_error("Could not lock passwd file");
+
+      struct stat fd_stat, path_stat;
+      if ((fstat(_fd, &fd_stat) == 0) && (stat(_pwd_file.c_str(), &path_stat) == 0) &&
+          (fd_stat.st_ino == path_stat.st_ino) && (fd_stat.st_dev == path_stat.st_dev))
+         return;
+
+      flock(_fd, LOCK_UN);
+      close(_fd);
+      _fd = -1;
+   }
+}
+
+/*******************************************************************************************
+ * compact - Rewrites the password file with one record per user. The bulk of the file is
+ *           read and written out without any lock, then under the file lock whatever was
+ *           appended meanwhile is copied across raw and the new file is renamed into place.
+ *
+ *    Throws: pwfile_error if the file could not be read or the new one written
+ *******************************************************************************************/
+
+void PasswdLog::compact() {
+   int fd = open(_pwd_file.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+      throw pwfile_error("Could not open passwd file for compaction");
+
+   std::string tmp_file = _pwd_file + ".compact";
+   int tmp_fd = -1;
+   try {
+      std::unordered_map<std::string, PasswdEntry> users;
+      off_t parsed = PasswdIndex::parseFile(fd, 0, users);
+
+      std::string buf, record;
+      for (auto &user : users) {
+         makeRecord(record, user.first, user.second.hash, user.second.salt);
+         buf.append(record);
+      }
+
+      struct stat file_stat;
+      fstat(fd, &file_stat);
+
+      tmp_fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    file_stat.st_mode & 0777);
+      if ((tmp_fd == -1) || (write(tmp_fd, buf.data(), buf.size()) != (ssize_t) buf.size()))
+         throw pwfile_error("Could not write compacted passwd file");
+
+      // Hold off appenders while we catch up with them and swap the files
+      if (flock(fd, LOCK_EX) != 0)
+         throw pwfile_error("Could not lock passwd file");
+
+      struct stat path_stat;
+      if ((stat(_pwd_file.c_str(), &path_stat) != 0) || (path_stat.st_ino != file_stat.st_ino))
+         throw pwfile_error("Passwd file was replaced during compaction");
+
+      fstat(fd, &file_stat);
+      char chunk[65536];
+      ssize_t amt_read;
+      while ((parsed < file_stat.st_size) &&
+             ((amt_read = pread(fd, chunk, sizeof(chunk), parsed)) > 0)) {
+         if (write(tmp_fd, chunk, amt_read) != amt_read)
+            throw pwfile_error("Could not write compacted passwd file");
+         parsed += amt_read;
+      }
+
+      if ((fsync(tmp_fd) != 0) || (rename(tmp_file.c_str(), _pwd_file.c_str()) != 0))
+         throw pwfile_error("Could not replace passwd file with compacted one");
+
+      close(tmp_fd);
+      close(fd);
+   } catch (pwfile_error &e) {
+      if (tmp_fd != -1) {
+         close(tmp_fd);
+         unlink(tmp_file.c_str());
+      }
+      close(fd);
+      throw;
+   }
+}
+
+/*******************************************************************************************
+ * runCompactor - Background thread started by the first password change. Every few seconds
+ *                it compacts the file if superseded records are half of it or more.
+ *
+ *******************************************************************************************/
+
+void PasswdLog::runCompactor() {
+   std::unique_lock<std::mutex> guard(_lock);
+   while (!_stop) {
+      _compact_wake.wait_for(guard, std::chrono::seconds(compact_check_secs));
+      if (_stop)
+         break;
+
+      struct stat file_stat;
+      if ((stat(_pwd_file.c_str(), &file_stat) != 0) || (file_stat.st_size < min_compact_size) ||
+          (_superseded * 2 < file_stat.st_size))
+         continue;
+
+      off_t superseded = _superseded;
+      guard.unlock();
+      try {
+         compact();
+         guard.lock();
+         _superseded -= superseded;
+      } catch (pwfile_error &e) {
+         // Leave the file as it is, we'll try again at the next check
+         guard.lock();
+      }
+   }
+}
@@ -0,0 +1,425 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "PasswdStore.h"
+#include "exceptions.h"
+
+// Holds a store file's flock for as long as it's in scope, serializing writers across processes
+class StoreFileLock {
+   public:
+      StoreFileLock(int fd):_fd(fd) {
+         if (flock(_fd, LOCK_EX) != 0)
+            throw pwfile_error("Could not lock passwd store");
+      };
+      ~StoreFileLock() { flock(_fd, LOCK_UN); };
+
+   private:
+      int _fd;
+};
+
+/*******************************************************************************************
+ * isStoreFile - Checks for the binary store magic at the start of the file
+ *
+ *******************************************************************************************/
+
+bool PasswdStore::isStoreFile(const std::string &pwd_file) {
+   int fd = open(pwd_file.c_str(), O_RDONLY);
+   if (fd == -1)
+      return false;
+
+   char magic[sizeof(pwstore_magic)];
+   bool results = (read(fd, magic, sizeof(magic)) == sizeof(magic)) &&
+                  (memcmp(magic, pwstore_magic, sizeof(magic)) == 0);
+   close(fd);
+   return results;
+}
+
+/*******************************************************************************************
+ * getStore - Returns the one store for the given file, mapping it the first time. Whether a
+ *            file is a store is only checked the first time it is asked about.
+ *
+ *    Returns: the store, or NULL if the file is not a binary store
+ *******************************************************************************************/
+
+PasswdStore *PasswdStore::getStore(const std::string &pwd_file) {
+   static std::mutex registry_lock;
+   static std::map<std::string, std::unique_ptr<PasswdStore>> registry;
+
+   std::lock_guard<std::mutex> guard(registry_lock);
+   auto sptr = registry.find(pwd_file);
+   if (sptr != registry.end())
+      return sptr->second.get();
+
+   std::unique_ptr<PasswdStore> &store = registry[pwd_file];
+   if (isStoreFile(pwd_file))
+      store.reset(new PasswdStore(pwd_file));
+   return store.get();
+}
+
+PasswdStore::PasswdStore(const std::string &pwd_file):_pwd_file(pwd_file) {
+   StoreMap *smap = mapFile(_pwd_file);
+   _maps.push_back(smap);
+   _current = smap;
+}
+
+PasswdStore::~PasswdStore() {
+   for (StoreMap *smap : _maps) {
+      munmap(smap->map, smap->size);
+      close(smap->fd);
+      delete smap;
+   }
+}
+
+/*******************************************************************************************
+ * mapFile - Opens and maps a store file read-only and checks its header
+ *
+ *    Throws: pwfile_error if the file can't be mapped or its layout doesn't add up
+ *******************************************************************************************/
+
+PasswdStore::StoreMap *PasswdStore::mapFile(const std::string &pwd_file) {
+   int fd = open(pwd_file.c_str(), O_RDWR | O_CLOEXEC);
+   if (fd == -1)
+      throw pwfile_error("Could not open passwd store");
+
+   struct stat file_stat;
+   if ((fstat(fd, &file_stat) != 0) || ((size_t) file_stat.st_size < sizeof(PasswdStoreHeader))) {
+      close(fd);
+      throw pwfile_error("Passwd store is truncated");
+   }
+
+   void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      close(fd);
+      throw pwfile_error("Could not map passwd store");
+   }
+
+   StoreMap *smap = new StoreMap;
+   smap->fd = fd;
+   smap->ino = file_stat.st_ino;
+   smap->map = (uint8_t *) map;
+   smap->size = file_stat.st_size;
+   smap->header = (const PasswdStoreHeader *) map;
+
+   const PasswdStoreHeader *header = smap->header;
+   if ((memcmp(header->magic, pwstore_magic, sizeof(pwstore_magic)) != 0) ||
+       (header->record_size != sizeof(PasswdRecord)) ||
+       (header->bucket_count == 0) || ((header->bucket_count & (header->bucket_count - 1)) != 0) ||
+       (header->index_offset + header->bucket_count * sizeof(uint32_t) > smap->size) ||
+       (header->records_offset + header->capacity * sizeof(PasswdRecord) > smap->size)) {
+      munmap(map, smap->size);
+      close(fd);
+      delete smap;
+      throw pwfile_error("Passwd store header is corrupt");
+   }
+
+   smap->index = (const uint32_t *) (smap->map + header->index_offset);
+   smap->records = (const PasswdRecord *) (smap->map + header->records_offset);
+   return smap;
+}
+
+/*******************************************************************************************
+ * getMap - Returns the current mapping, first mapping the file again if pwconvert replaced
+ *          it since (costs one stat per call)
+ *
+ *    Throws: pwfile_error if the replacement file can't be mapped
+ *******************************************************************************************/
+
+PasswdStore::StoreMap *PasswdStore::getMap() {
+   StoreMap *smap = _current.load(std::memory_order_acquire);
+
+   struct stat file_stat;
+   if ((stat(_pwd_file.c_str(), &file_stat) != 0) || (file_stat.st_ino == smap->ino))
+      return smap;
+
+   std::lock_guard<std::mutex> guard(_write_lock);
+   smap = _current.load(std::memory_order_acquire);
+   if (file_stat.st_ino != smap->ino) {
+      smap = mapFile(_pwd_file);
+      _maps.push_back(smap);
+      _current.store(smap, std::memory_order_release);
+   }
+   return smap;
+}
+
+/*******************************************************************************************
+ * isReplaced - Checks whether pwconvert has renamed a new store over the one smap maps. A
+ *              writer checks once it holds the file's lock, which pwconvert keeps until its
+ *              replacement is in place, so nothing is written to a file that was already read.
+ *
+ *******************************************************************************************/
+
+bool PasswdStore::isReplaced(const StoreMap *smap) {
+   struct stat file_stat;
+   return (stat(_pwd_file.c_str(), &file_stat) == 0) && (file_stat.st_ino != smap->ino);
+}
+
+/*******************************************************************************************
+ * hashName - FNV-1a, used to place and find usernames in the index
+ *
+ *******************************************************************************************/
+
+uint64_t PasswdStore::hashName(const char *name, size_t len) {
+   uint64_t hash = 14695981039346656037ULL;
+   for (size_t i = 0; i < len; i++) {
+      hash ^= (uint8_t) name[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+/*******************************************************************************************
+ * find - Probes the current mapping's index for a username
+ *
+ *    Returns: pointer to the user's record inside the mapping, NULL if not found
+ *
+ *    Throws: pwfile_error if the store was replaced and the new one can't be mapped
+ *******************************************************************************************/
+
+const PasswdRecord *PasswdStore::find(const std::string &name) {
+   return findIn(getMap(), name);
+}
+
+/*******************************************************************************************
+ * findIn - Probes one mapping's index for a username, so callers that go on to use the
+ *          mapping (for offsets or writes) see the same file the record came from
+ *
+ *    Returns: pointer to the user's record inside smap, NULL if not found
+ *******************************************************************************************/
+
+const PasswdRecord *PasswdStore::findIn(const StoreMap *smap, const std::string &name) {
+   if (name.size() >= pwstore_namelen)
+      return NULL;
+
+   uint32_t mask = smap->header->bucket_count - 1;
+   uint64_t slot = hashName(name.c_str(), name.size()) & mask;
+
+   // The table is never more than half full, so the probe always hits an empty slot
+   uint32_t recnum;
+   while ((recnum = __atomic_load_n(&smap->index[slot], __ATOMIC_ACQUIRE)) != 0) {
+      const PasswdRecord *record = &smap->records[recnum - 1];
+      if ((strncmp(record->name, name.c_str(), pwstore_namelen) == 0))
+         return record;
+      slot = (slot + 1) & mask;
+   }
+   return NULL;
+}
+
+/*******************************************************************************************
+ * lookup - Finds a user, copying their hash and salt and recording the file offset of the
+ *          hash (so it can be changed in place like the text format)
+ *
+ *    Returns: true if found
+ *******************************************************************************************/
+
+bool PasswdStore::lookup(const std::string &name, PasswdEntry &entry) {
+   StoreMap *smap = getMap();
+   const PasswdRecord *record = findIn(smap, name);
+   if (record == NULL)
+      return false;
+
+   memcpy(entry.hash, record->hash, hashlen);
+   memcpy(entry.salt, record->salt, saltlen);
+   entry.offset = ((const uint8_t *) record - smap->map) + offsetof(PasswdRecord, hash);
+   return true;
+}
+
+/*******************************************************************************************
+ * addUser - Adds a user into the store's spare capacity. The record is written first, then
+ *           its index slot, then the count, so a concurrent lookup sees either no user or a
+ *           complete one. The file is locked while the count is read and claimed, and
+ *           synced before returning.
+ *
+ *    Throws: pwfile_error if the store is full (rerun pwconvert with a larger capacity) or the
+ *            lock or writes fail
+ *******************************************************************************************/
+
+void PasswdStore::addUser(const std::string &name, const uint8_t *hash, const uint8_t *salt) {
+   if (name.size() >= pwstore_namelen)
+      throw pwfile_error("Username too long for passwd store");
+
+   // my_adduser can run beside a server, so the free record is claimed under the file's lock
+   while (true) {
+      StoreMap *smap = getMap();
+      std::lock_guard<std::mutex> guard(_write_lock);
+      StoreFileLock file_lock(smap->fd);
+      if (isReplaced(smap))
+         continue;
+
+      const PasswdStoreHeader *header = smap->header;
+      if (header->record_count >= header->capacity)
+         throw pwfile_error("Passwd store is full, convert it again with a larger capacity");
+
+      PasswdRecord record;
+      bzero(&record, sizeof(record));
+      memcpy(record.name, name.c_str(), name.size());
+      memcpy(record.hash, hash, hashlen);
+      memcpy(record.salt, salt, saltlen);
+
+      uint64_t recnum = header->record_count;
+      off_t rec_offset = header->records_offset + recnum * sizeof(PasswdRecord);
+      if (pwrite(smap->fd, &record, sizeof(record), rec_offset) != sizeof(record))
+         throw pwfile_error("Could not write passwd store record");
+
+      uint32_t mask = header->bucket_count - 1;
+      uint64_t slot = hashName(name.c_str(), name.size()) & mask;
+      while (smap->index[slot] != 0)
+         slot = (slot + 1) & mask;
+
+      uint32_t slot_val = recnum + 1;
+      off_t slot_offset = header->index_offset + slot * sizeof(uint32_t);
+      if (pwrite(smap->fd, &slot_val, sizeof(slot_val), slot_offset) != sizeof(slot_val))
+         throw pwfile_error("Could not write passwd store index");
+
+      uint64_t count = recnum + 1;
+      if (pwrite(smap->fd, &count, sizeof(count), offsetof(PasswdStoreHeader, record_count))
+          != sizeof(count))
+         throw pwfile_error("Could not write passwd store header");
+
+      if (fdatasync(smap->fd) != 0)
+         throw pwfile_error("Could not sync passwd store");
+      return;
+   }
+}
+
+/*******************************************************************************************
+ * updateHash - Writes a new hash over a user's record with a single pwrite. The hash is
+ *              the only field that changes, so the record is never seen half-updated except
+ *              within the hash itself. The user is looked up again under the file's lock,
+ *              since pwconvert may have replaced the store (and moved every record) while
+ *              the new hash was computed.
+ *
+ *    Params:  name - the user to update
+ *             hash - the new hash
+ *
+ *    Returns: false if the user is no longer in the store
+ *
+ *    Throws: pwfile_error if the lock or write fails
+ *******************************************************************************************/
+
+bool PasswdStore::updateHash(const std::string &name, const uint8_t *hash) {
+   while (true) {
+      StoreMap *smap = getMap();
+      std::lock_guard<std::mutex> guard(_write_lock);
+      StoreFileLock file_lock(smap->fd);
+      if (isReplaced(smap))
+         continue;
+
+      const PasswdRecord *record = findIn(smap, name);
+      if (record == NULL)
+         return false;
+
+      off_t offset = ((const uint8_t *) record - smap->map) + offsetof(PasswdRecord, hash);
+      if (pwrite(smap->fd, hash, hashlen, offset) != hashlen)
+         throw pwfile_error("Could not write passwd store record");
+
+      if (fdatasync(smap->fd) != 0)
+         throw pwfile_error("Could not sync passwd store");
+      return true;
+   }
+}
+
+/*******************************************************************************************
+ * getAll - Copies out every user (used by pwconvert to rebuild a store)
+ *
+ *******************************************************************************************/
+
+void PasswdStore::getAll(std::vector<std::pair<std::string, PasswdEntry>> &users) {
+   StoreMap *smap = getMap();
+
+   users.clear();
+   for (uint64_t i = 0; i < smap->header->record_count; i++) {
+      const PasswdRecord *record = &smap->records[i];
+      PasswdEntry entry;
+      memcpy(entry.hash, record->hash, hashlen);
+      memcpy(entry.salt, record->salt, saltlen);
+      entry.offset = 0;
+      users.emplace_back(std::string(record->name, strnlen(record->name, pwstore_namelen)), entry);
+   }
+}
+
+uint64_t PasswdStore::getCapacity() {
+   return getMap()->header->capacity;
+}
+
+/*******************************************************************************************
+ * create - Builds a store file from a list of users. It is written to a temporary file and
+ *          renamed over pwd_file, so running servers switch to it atomically.
+ *
+ *    Params:  pwd_file - the store to write
+ *             users - the users to put in it (names must be shorter than pwstore_namelen)
+ *             capacity - total users the store can hold before it has to be rebuilt
+ *
+ *    Throws: pwfile_error if a name is too long, capacity is more than pwstore_max_capacity or
+ *            the file can't be written
+ *******************************************************************************************/
+
+void PasswdStore::create(const std::string &pwd_file,
+                         const std::vector<std::pair<std::string, PasswdEntry>> &users,
+                         uint64_t capacity) {
+   if (capacity < users.size())
+      capacity = users.size();
+   if (capacity == 0)
+      capacity = 1;
+   if (capacity > pwstore_max_capacity)
+      throw pwfile_error("Passwd store capacity is limited to " +
+                         std::to_string(pwstore_max_capacity) + " users");
+
+   PasswdStoreHeader header;
+   bzero(&header, sizeof(header));
+   memcpy(header.magic, pwstore_magic, sizeof(pwstore_magic));
+   header.record_size = sizeof(PasswdRecord);
+   header.bucket_count = 1;
+   while (header.bucket_count < capacity * 2)
+      header.bucket_count <<= 1;
+   header.capacity = capacity;
+   header.record_count = users.size();
+   header.index_offset = sizeof(PasswdStoreHeader);
+   header.records_offset = header.index_offset + header.bucket_count * sizeof(uint32_t);
+
+   std::vector<uint32_t> index(header.bucket_count, 0);
+   std::vector<PasswdRecord> records(users.size());
+   uint32_t mask = header.bucket_count - 1;
+
+   for (size_t i = 0; i < users.size(); i++) {
+      const std::string &name = users[i].first;
+      if (name.size() >= pwstore_namelen)
+         throw pwfile_error("Username too long for passwd store: " + name);
+
+      PasswdRecord &record = records[i];
+      bzero(&record, sizeof(record));
+      memcpy(record.name, name.c_str(), name.size());
+      memcpy(record.hash, users[i].second.hash, hashlen);
+      memcpy(record.salt, users[i].second.salt, saltlen);
+
+      uint64_t slot = hashName(name.c_str(), name.size()) & mask;
+      while (index[slot] != 0)
+         slot = (slot + 1) & mask;
+      index[slot] = i + 1;
+   }
+
+   std::string tmp_file = pwd_file + ".tmp";
+   int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd == -1)
+      throw pwfile_error("Could not create " + tmp_file);
+
+   off_t total_size = header.records_offset + capacity * sizeof(PasswdRecord);
+   bool ok = (ftruncate(fd, total_size) == 0) &&
+             (pwrite(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+             (pwrite(fd, index.data(), index.size() * sizeof(uint32_t), header.index_offset) ==
+              (ssize_t) (index.size() * sizeof(uint32_t))) &&
+             (pwrite(fd, records.data(), records.size() * sizeof(PasswdRecord), header.records_offset) ==
+              (ssize_t) (records.size() * sizeof(PasswdRecord))) &&
+             (fsync(fd) == 0);
+   close(fd);
+
+   if (!ok || (rename(tmp_file.c_str(), pwd_file.c_str()) != 0)) {
+      unlink(tmp_file.c_str());
+      throw pwfile_error("Could not write " + pwd_file);
+   }
+}
@@ -0,0 +1,80 @@
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <strings.h>
+#include "PerfCounters.h"
+
+const char *counter_names[pc_num_counters] = {"cycles", "instructions", "cache-misses",
+                                               "context-switches", "dTLB-load-misses",
+                                               "page-faults"};
+
+/*******************************************************************************************
+ * PerfCounters (constructor) - Opens each counter for the calling thread on any CPU. User
+ *                              space only, so it works with perf_event_paranoid up to 2,
+ *                              except context switches: they happen in the kernel, so
+ *                              excluding it would always count 0. If that one is refused it
+ *                              comes from getrusage instead.
+ *
+ *******************************************************************************************/
+
+PerfCounters::PerfCounters() {
+   const uint32_t types[pc_num_counters] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                            PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE,
+                                            PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE};
+   const uint64_t configs[pc_num_counters] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                              PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES,
+                                              PERF_COUNT_HW_CACHE_DTLB |
+                                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                                              PERF_COUNT_SW_PAGE_FAULTS};
+
+   for (int i = 0; i < pc_num_counters; i++) {
+      perf_event_attr attr;
+      bzero(&attr, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[i];
+      attr.config = configs[i];
+      attr.exclude_kernel = (i != pc_ctx_switches);
+      attr.exclude_hv = 1;
+
+      _fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+   }
+
+   _rusage_switches = (_fds[pc_ctx_switches] == -1);
+}
+
+PerfCounters::~PerfCounters() {
+   for (int i = 0; i < pc_num_counters; i++) {
+      if (_fds[i] != -1)
+         close(_fds[i]);
+   }
+}
+
+/*******************************************************************************************
+ * readAll - reads the running count of every counter. Take two readings and subtract to
+ *           measure a section of code. A counter that fails to read repeats its last good
+ *           reading, so the difference is 0 rather than wrapping around.
+ *
+ *******************************************************************************************/
+
+void PerfCounters::readAll(uint64_t values[pc_num_counters]) {
+   for (int i = 0; i < pc_num_counters; i++) {
+      uint64_t count;
+      if ((_fds[i] != -1) && (read(_fds[i], &count, sizeof(count)) == sizeof(count)))
+         _last[i] = count;
+   }
+
+   if (_rusage_switches) {
+      struct rusage usage;
+      if (getrusage(RUSAGE_THREAD, &usage) == 0)
+         _last[pc_ctx_switches] = usage.ru_nvcsw + usage.ru_nivcsw;
+   }
+
+   for (int i = 0; i < pc_num_counters; i++)
+      values[i] = _last[i];
+}
+
+const char *PerfCounters::getName(perf_counter_type counter) {
+   return counter_names[counter];
+}
@@ -0,0 +1,176 @@
+#include <mutex>
+#include <vector>
+#include <iomanip>
+#include <time.h>
+#include "Profiler.h"
+
+const char *phase_names[pp_num_phases] = {"accept", "username", "argon2", "command", "log",
+                                          "log_write"};
+
+/*******************************************************************************************
+ * ProfileThread - One thread's counters and totals. Only its thread writes the totals;
+ *                 report() reads them from another, hence the relaxed atomics.
+ *
+ *******************************************************************************************/
+
+struct ProfileThread {
+   PerfCounters counters;
+   int current = -1;
+   uint64_t mark[pc_num_counters];
+   uint64_t mark_ns = 0;
+
+   std::atomic<uint64_t> calls[pp_num_phases];
+   std::atomic<uint64_t> wall_ns[pp_num_phases];
+   std::atomic<uint64_t> totals[pp_num_phases][pc_num_counters];
+
+   ProfileThread() {
+      for (int p = 0; p < pp_num_phases; p++) {
+         calls[p] = 0;
+         wall_ns[p] = 0;
+         for (int c = 0; c < pc_num_counters; c++)
+            totals[p][c] = 0;
+      }
+   };
+};
+
+bool Profiler::_enabled = false;
+
+// Every thread that has entered a phase. Never freed, so threads that have already exited are
+// still in the report.
+static std::mutex threads_lock;
+static std::vector<ProfileThread *> threads;
+static thread_local ProfileThread *local_thread = NULL;
+
+static uint64_t getNowNs() {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void addRelaxed(std::atomic<uint64_t> &total, uint64_t amount) {
+   total.store(total.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/*******************************************************************************************
+ * switchPhase - charges everything counted since the thread's last switch to the phase it
+ *               was in, then makes phase the current one
+ *
+ *******************************************************************************************/
+
+static void switchPhase(ProfileThread &thread, int phase) {
+   uint64_t now[pc_num_counters];
+   thread.counters.readAll(now);
+   uint64_t now_ns = getNowNs();
+
+   if (thread.current >= 0) {
+      for (int c = 0; c < pc_num_counters; c++)
+         addRelaxed(thread.totals[thread.current][c], now[c] - thread.mark[c]);
+      addRelaxed(thread.wall_ns[thread.current], now_ns - thread.mark_ns);
+   }
+
+   for (int c = 0; c < pc_num_counters; c++)
+      thread.mark[c] = now[c];
+   thread.mark_ns = now_ns;
+   thread.current = phase;
+}
+
+/*******************************************************************************************
+ * enter - starts counting the calling thread's work as phase, opening its counters the
+ *         first time
+ *
+ *    Returns: the phase it was in before (-1 for none), to pass to leave
+ *******************************************************************************************/
+
+int Profiler::enter(profile_phase phase) {
+   if (local_thread == NULL) {
+      local_thread = new ProfileThread;
+      std::lock_guard<std::mutex> guard(threads_lock);
+      threads.push_back(local_thread);
+   }
+
+   int prev = local_thread->current;
+   addRelaxed(local_thread->calls[phase], 1);
+   switchPhase(*local_thread, phase);
+   return prev;
+}
+
+void Profiler::leave(int prev) {
+   switchPhase(*local_thread, prev);
+}
+
+/*******************************************************************************************
+ * report - writes the per call averages of every phase that ran, summed over all threads,
+ *          and each phase's share of the counted cycles (of wall time if cycles can't be
+ *          counted here)
+ *
+ *******************************************************************************************/
+
+void Profiler::report(std::ostream &out) {
+   uint64_t calls[pp_num_phases] = {0}, wall_ns[pp_num_phases] = {0};
+   uint64_t totals[pp_num_phases][pc_num_counters] = {{0}};
+   bool available[pc_num_counters] = {false};
+
+   {
+      std::lock_guard<std::mutex> guard(threads_lock);
+      for (ProfileThread *thread : threads) {
+         for (int c = 0; c < pc_num_counters; c++)
+            available[c] |= thread->counters.isAvailable((perf_counter_type) c);
+
+         for (int p = 0; p < pp_num_phases; p++) {
+            calls[p] += thread->calls[p].load(std::memory_order_relaxed);
+            wall_ns[p] += thread->wall_ns[p].load(std::memory_order_relaxed);
+            for (int c = 0; c < pc_num_counters; c++)
+               totals[p][c] += thread->totals[p][c].load(std::memory_order_relaxed);
+         }
+      }
+   }
+
+   bool by_cycles = available[pc_cycles];
+   uint64_t grand_total = 0;
+   for (int p = 0; p < pp_num_phases; p++)
+      grand_total += by_cycles ? totals[p][pc_cycles] : wall_ns[p];
+
+   out << "Profile by phase, per call (nested phases are not counted in their parent):\n";
+   out << std::left << std::setw(11) << "phase" << std::right << std::setw(10) << "calls"
+       << std::setw(11) << "wall_us";
+   for (int c = 0; c < pc_num_counters; c++) {
+      if (available[c])
+         out << std::setw(18) << PerfCounters::getName((perf_counter_type) c);
+   }
+   if (available[pc_cycles] && available[pc_instructions])
+      out << std::setw(7) << "IPC";
+   out << std::setw(9) << (by_cycles ? "%cycles" : "%wall") << "\n";
+
+   for (int p = 0; p < pp_num_phases; p++) {
+      if (calls[p] == 0)
+         continue;
+
+      double n = (double) calls[p];
+      out << std::left << std::setw(11) << phase_names[p] << std::right << std::setw(10)
+          << calls[p] << std::fixed << std::setprecision(2) << std::setw(11)
+          << wall_ns[p] / n / 1000.0;
+      for (int c = 0; c < pc_num_counters; c++) {
+         if (available[c])
+            out << std::setw(18) << totals[p][c] / n;
+      }
+      if (available[pc_cycles] && available[pc_instructions]) {
+         double ipc = (totals[p][pc_cycles] == 0) ? 0.0 :
+                      (double) totals[p][pc_instructions] / totals[p][pc_cycles];
+         out << std::setw(7) << ipc;
+      }
+
+      uint64_t share = by_cycles ? totals[p][pc_cycles] : wall_ns[p];
+      out << std::setprecision(1) << std::setw(8)
+          << ((grand_total == 0) ? 0.0 : share * 100.0 / grand_total) << "%\n";
+   }
+
+   for (int c = 0; c < pc_num_counters; c++) {
+      if (!available[c])
+         out << "(" << PerfCounters::getName((perf_counter_type) c) << " not available here)\n";
+   }
+   out << std::flush;
+}
+
+const char *Profiler::getName(profile_phase phase) {
+   return phase_names[phase];
+}
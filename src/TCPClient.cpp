@@ -5,10 +5,10 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <strings.h>
-#include <stropts.h>
 #include <string.h>
 #include <sys/select.h>
 #include <stdio.h>
+#include <time.h>
 #include <stdexcept>
 
 #include "TCPClient.h"
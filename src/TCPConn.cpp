@@ -2,23 +2,61 @@
 #include <strings.h>
 #include <unistd.h>
 #include <cstring>
+#include <errno.h>
 #include <algorithm>
-#include <iostream>
+#include <chrono>
+#include <cctype>
 #include "TCPConn.h"
 #include "strfuncts.h"
-#include <fstream>
+#include "Logger.h"
+#include "Diag.h"
+#include "Metrics.h"
+#include "Profiler.h"
+#include "Journal.h"
 #include "PasswdMgr.h"
+#include "CommandRegistry.h"
 
-// The filename/path of the password file
-const char pwdfilename[] = "passwd";
+// The session gauge for each statustype, in the enum's order
+const metric_gauge status_gauges[] = {mg_sess_username, mg_sess_changepwd, mg_sess_confirmpwd,
+                                      mg_sess_passwd, mg_sess_menu, mg_sess_verifying};
 
-TCPConn::TCPConn(){ // LogMgr &server_log):_server_log(server_log) {
+// Printable statustype names, in the enum's order
+const char *status_names[] = {"username", "changepwd", "confirmpwd", "passwd", "menu",
+                              "verifying"};
 
+/**********************************************************************************************
+ * TCPConn (constructor) - stores the hashing services this connection uses from its reactor
+ *
+ *    Params:  hasher - the pool that runs this connection's password hashing
+ *             hashdone - completion queue of the reactor that owns this connection
+ *             conn_id - unique (per reactor) id of this connection, used to match hash results
+ **********************************************************************************************/
+
+TCPConn::TCPConn(HashPool &hasher, HashCompletionQueue &hashdone, uint64_t conn_id):
+                 _hasher(hasher), _hashdone(hashdone), _conn_id(conn_id) {
+   Metrics::addGauge(status_gauges[_status], 1);
 }
 
 
 TCPConn::~TCPConn() {
+   disconnect();
+   Metrics::addGauge(status_gauges[_status], -1);
+}
+
+/**********************************************************************************************
+ * setStatus - changes the connection's status and moves it between the session gauges. The
+ *             reactor that owns the connection is the only thread that calls this, so its
+ *             gauges always balance.
+ *
+ **********************************************************************************************/
+
+void TCPConn::setStatus(statustype status) {
+   if (status == _status)
+      return;
 
+   Metrics::addGauge(status_gauges[_status], -1);
+   Metrics::addGauge(status_gauges[status], 1);
+   _status = status;
 }
 
 /**********************************************************************************************
@@ -30,16 +68,36 @@ TCPConn::~TCPConn() {
  **********************************************************************************************/
 
 bool TCPConn::accept(SocketFD &server) {
-   return _connfd.acceptFD(server);
+   if (!_connfd.acceptFD(server))
+      return false;
+
+   // Reads must never block the server loop that is shared by every connection
+   _connfd.setNonBlocking();
+   return true;
 }
 
 /**********************************************************************************************
- * sendText - simply calls the sendText FileDesc method to send a string to this FD
+ * attach - takes ownership of a connection that was already accepted elsewhere (the io_uring
+ *          loop accepts asynchronously)
+ *
+ *    Params: fd - the accepted socket FD
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPConn::attach(int fd) {
+   _connfd.attachFD(fd);
+   _connfd.setNonBlocking();
+}
+
+/**********************************************************************************************
+ * sendText - queues a string to be sent to this connection. The reactor flushes the queue
+ *            once per loop iteration, so every reply to one batch of input goes out together.
  *
  *    Params:  msg - the string to be sent
  *             size - if we know how much data we should expect to send, this should be populated
  *
- *    Throws: runtime_error for unrecoverable errors
+ *    Returns: 0 if queued, -1 if the client left too much output unread (and is disconnected)
  **********************************************************************************************/
 
 int TCPConn::sendText(const char *msg) {
@@ -47,12 +105,91 @@ int TCPConn::sendText(const char *msg) {
 }
 
 int TCPConn::sendText(const char *msg, int size) {
-   if (_connfd.writeFD(msg, size) < 0) {
+   if (!_outbuf.append(msg, size)) {
+      DIAG_INFO("Client is not reading its output, disconnecting.");
+      _connfd.closeFD();
+      return -1;  
+   }
+   return 0;
+}
+
+/**********************************************************************************************
+ * sendReply - queues a shared reply to be sent to this connection by reference, without
+ *             copying it
+ *
+ *    Returns: 0 if queued, -1 if the client left too much output unread (and is disconnected)
+ **********************************************************************************************/
+
+int TCPConn::sendReply(const SharedReply &reply) {
+   if (!_outbuf.append(reply)) {
+      DIAG_INFO("Client is not reading its output, disconnecting.");
+      _connfd.closeFD();
       return -1;  
    }
    return 0;
 }
 
+/**********************************************************************************************
+ * flushOutput - sends as much queued output as the socket will take. Once the queue drains,
+ *               input held back while it was over out_high_water is handled and the replies
+ *               to it are sent as well.
+ *
+ *    Returns: false if the write failed and the connection was closed, true otherwise
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::flushOutput() {
+   while (isConnected() && hasOutput()) {
+      ssize_t written = _outbuf.flush(_connfd);
+      if (written < 0) {
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return true;
+         _connfd.closeFD();
+         return false;
+      }
+
+      Metrics::count(mc_writes);
+      Metrics::count(mc_bytes_out, written);
+
+      // A short write means the send buffer is full, the reactor waits for it to be writable
+      if (hasOutput())
+         return true;
+
+      processInput();
+   }
+   return isConnected();
+}
+
+/**********************************************************************************************
+ * finishSend - takes the result of an io_uring send of the queued output. As with flushOutput,
+ *              once the queue drains any input held back while it was over out_high_water is
+ *              handled.
+ *
+ *    Params:  res - bytes written, or -errno
+ *
+ *    Returns: false if the send failed and the connection was closed, true otherwise
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::finishSend(int res) {
+   _outbuf.finishSend(res);
+   if (res < 0) {
+      if ((res == -EAGAIN) || (res == -EINTR))
+         return isConnected();
+      _connfd.closeFD();
+      return false;
+   }
+
+   Metrics::count(mc_writes);
+   Metrics::count(mc_bytes_out, res);
+
+   if (!hasOutput())
+      processInput();
+   return isConnected();
+}
+
 /**********************************************************************************************
  * startAuthentication - Sets the status to request username
  *
@@ -62,25 +199,88 @@ int TCPConn::sendText(const char *msg, int size) {
 void TCPConn::startAuthentication() {
 
    // Skipping this for now
-   _status = s_username;
+   setStatus(s_username);
 
-   _connfd.writeFD("Username: "); 
+   sendText("Username: "); 
 }
 
 /**********************************************************************************************
- * handleConnection - performs a check of the connection, looking for data on the socket and
- *                    handling it based on the _status, or stage, of the connection
+ * handleConnection - called when the socket is readable. Reads whatever data is available and
+ *                    handles each complete line based on the _status, or stage, of the
+ *                    connection. Partial lines stay buffered until the rest arrives, so this
+ *                    never waits on the client.
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
 void TCPConn::handleConnection() {
 
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
+   // Reading stops while the client isn't draining its output, the reactor resumes it
+   if (isThrottled())
+      return;
+
+   if (!readInput())
+      return;
+
+   processInput();
+}
 
+/**********************************************************************************************
+ * handleData - called with data the server already received for this connection (the io_uring
+ *              loop receives straight into the input buffer's free space from getRecvBuf) and
+ *              handles each complete line
+ *
+ *    Params: len - the amount received, 0 or less if the client closed or the receive failed
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::handleData(ssize_t len) {
+   if (len <= 0) {
+      disconnect();
+      return;
+   }
+
+   Metrics::count(mc_bytes_in, len);
+   _inputbuf.commit(len);
+   processInput();
+}
+
+/**********************************************************************************************
+ * processInput - handles every complete line waiting in the input buffer, then disconnects the
+ *                client if what's left fills the buffer (a line longer than line_buf_size, or
+ *                too much input sent while a hash job runs)
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::processInput() {
    try {
+      // Input that arrives while a hash job runs stays buffered until finishHash, and input
+      // from a client that isn't reading its replies stays buffered until it does
+      while (isConnected() && (_status != s_verifying) && !isThrottled() && hasUserInput()) {
+         handleInput();
+      }
+
+      if (isConnected() && !isThrottled() && _inputbuf.isFull()) {
+         sendText("Input line too long, disconnecting.\n");
+         DIAG_INFO("Input overflowed the line buffer, disconnecting.");
+         disconnect();
+      }
+   } catch (socket_error &e) {
+      DIAG_WARN("Socket error, disconnecting.");
+      disconnect();
+      return;
+   }
+}
+
+/**********************************************************************************************
+ * handleInput - handles one line of buffered user input based on the _status of the connection
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::handleInput() {
       switch (_status) {
          case s_username:
             getUsername();
@@ -91,6 +291,9 @@ void TCPConn::handleConnection() {
             break;
    
          case s_changepwd:
+            setPassword();
+            break;
+
          case s_confirmpwd:
             changePassword();
             break;
@@ -103,13 +306,6 @@ void TCPConn::handleConnection() {
             throw std::runtime_error("Invalid connection status!");
             break;
       }
-   } catch (socket_error &e) {
-      std::cout << "Socket error, disconnecting.";
-      disconnect();
-      return;
-   }
-
-   nanosleep(&sleeptime, NULL);
 }
 
 /**********************************************************************************************
@@ -122,32 +318,27 @@ void TCPConn::handleConnection() {
 void TCPConn::getUsername() {
    // Read in a line from the connection
    std::string input;
-   _connfd.readStr(input);
+   if (!getUserInput(input))
+      return;
+   ProfileScope profile(pp_username);
    lower(input);
    _username = input;
-   PasswdMgr pwm("passwd");
+   PasswdMgr pwm(pwdfilename);
    //const char* in = input.c_str();
 
    // Check to see if the username exists in the password file
    if(pwm.checkUser(input.c_str())){
-      _status = s_passwd;
+      setStatus(s_passwd);
       _username.clear(); // Make sure _username is clear just in case
       _username.append(input); // Copy input into _username
-      _connfd.writeFD("Password: "); 
-      std::cout << "User " << _username << " has established a connection.\n"; 
+      sendText("Password: "); 
+      DIAG_DEBUG("User " << _username << " has established a connection.");
    } else {
-      _connfd.writeFD("There is no account for the given username,\n");
-      _connfd.writeFD("please create an account with the my_adduser program.\n");
-      std::cout << "Incorrect username, disconnecting.";
-
-      std::string event ("IP Address: ");
-      std::string ipaddr_str;
-      getIPAddrStr(ipaddr_str);
-      event.append(ipaddr_str);
-      event.append(" ; User: ");
-      event.append(input);
-      event.append("; Incorrect username.");
-      logEvent(event.c_str());
+      sendText("There is no account for the given username,\n");
+      sendText("please create an account with the my_adduser program.\n");
+      DIAG_INFO("Incorrect username, disconnecting.");
+
+      logLoginEvent(jo_unknown_user, input, "Incorrect username.");
 
       disconnect();
    }
@@ -155,8 +346,9 @@ void TCPConn::getUsername() {
 
 /**********************************************************************************************
  * getPasswd - called from handleConnection when status is s_passwd--if it finds user data,
- *             it assumes it's a password and hashes it, comparing to the database hash. Users
- *             get two tries before they are disconnected
+ *             it assumes it's a password and hands it to the hash pool to compare against the
+ *             database hash. The connection waits in s_verifying until checkedPasswd is called
+ *             with the result.
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
@@ -164,42 +356,98 @@ void TCPConn::getUsername() {
 void TCPConn::getPasswd() {
    // Read in a line from the connection
    std::string input;
-   _connfd.readStr(input);
-   PasswdMgr pwm("passwd");
+   if (!getUserInput(input))
+      return;
+
+   submitHash(hash_check, input);
+}
 
-   // Now call checkPasswd() on the username and passwd 
-   if(pwm.checkPasswd(_username.c_str(), input.c_str())){
+/**********************************************************************************************
+ * submitHash - sends a password check or change for this connection's user to the hash pool
+ *              and puts the connection in s_verifying until the result comes back. If the pool
+ *              is too busy to take it, the user is told to retry right away.
+ *
+ **********************************************************************************************/
+
+void TCPConn::submitHash(hash_job_type type, const std::string &passwd) {
+   std::unique_ptr<HashJob> job(new HashJob());
+   job->type = type;
+   job->name = _username;
+   job->passwd = passwd;
+   job->fd = getSocketFD();
+   job->conn_id = _conn_id;
+   job->done = &_hashdone;
+
+   setStatus(s_verifying);
+   if (!_hasher.submit(std::move(job)))
+      hashBusy(type);
+}
+
+/**********************************************************************************************
+ * hashBusy - the hash pool shed or expired this connection's job. Tells the user to retry and
+ *            goes back to the state the job was submitted from. A shed login does not count
+ *            as a failed attempt.
+ *
+ **********************************************************************************************/
+
+void TCPConn::hashBusy(hash_job_type type) {
+   if (type == hash_check) {
+      setStatus(s_passwd);
+      sendText("Server busy, please retry.\nPassword: ");
+   } else {
+      setStatus(s_menu);
+      sendText("Server busy, your password was not changed. Please retry.\n");
+   }
+}
+
+/**********************************************************************************************
+ * finishHash - called by the reactor with the result of this connection's hash job. Then
+ *              handles any input that was buffered while the job ran.
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::finishHash(HashJob &job) {
+   if (job.status != hash_done)
+      hashBusy(job.type);
+   else if (job.type == hash_check)
+      checkedPasswd(job.result);
+   else
+      changedPassword();
+
+   processInput();
+}
+
+/**********************************************************************************************
+ * checkedPasswd - finishes a login attempt once the hash pool has checked the password. Users
+ *                 get two tries before they are disconnected
+ *
+ *    Params:  correct - true if the password matched the database hash
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::checkedPasswd(bool correct) {
+   setStatus(s_passwd);
+
+   if(correct){
       // The password matched what was in the file
-      _connfd.writeFD("Correct, welcome to the server!\n");
+      sendText("Correct, welcome to the server!\n");
       sendMenu(); // Send the menu to the user
-      _status = s_menu;
+      setStatus(s_menu);
 
-      std::string event ("IP Address: ");
-      std::string ipaddr_str;
-      getIPAddrStr(ipaddr_str);
-      event.append(ipaddr_str);
-      event.append(" ; User: ");
-      event.append(_username);
-      event.append("; Successful connection.");
-      logEvent(event.c_str());
+      logLoginEvent(jo_ok, _username, "Successful connection.");
 
 
    } else if(_pwd_attempts == 0){
-      _connfd.writeFD("Incorrect password, please try again. 1 remaining attempt.\n");
-      _connfd.writeFD("Password: "); 
+      sendText("Incorrect password, please try again. 1 remaining attempt.\n");
+      sendText("Password: "); 
       _pwd_attempts++;
    } else {
-       _connfd.writeFD("Incorrect, this failed login has been logged.\n");
-       _connfd.writeFD("You will now be disconnected from the server.\n");
-
-      std::string event ("IP Address: ");
-      std::string ipaddr_str;
-      getIPAddrStr(ipaddr_str);
-      event.append(ipaddr_str);
-      event.append(" ; User: ");
-      event.append(_username);
-      event.append("; Failed to insert password twice.");
-      logEvent(event.c_str());
+       sendText("Incorrect, this failed login has been logged.\n");
+       sendText("You will now be disconnected from the server.\n");
+
+      logLoginEvent(jo_bad_passwd, _username, "Failed to insert password twice.");
 
        disconnect();
    }
@@ -207,76 +455,56 @@ void TCPConn::getPasswd() {
 }
 
 /**********************************************************************************************
- * changePassword - called from handleConnection when status is s_changepwd or s_confirmpwd--
- *                  if it finds user data, with status s_changepwd, it saves the user-entered
- *                  password. If s_confirmpwd, it checks to ensure the saved password from
- *                  the s_changepwd phase is equal, then saves the new pwd to the database
+ * setPassword - called from handleConnection when status is s_changepwd--saves the user-entered
+ *               password and asks for it again
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::changePassword() {
-   std::string passwd1, passwd2;
-   
-   // Read in two strings, compare them, if they match change the password
-   // if they don't match have the user input 2 new strings
-   bool valid_passwd = false;
-   while (!valid_passwd) {
-      _connfd.readStr(passwd1);
-      clrNewlines(passwd1);      
-
-      _connfd.writeFD("Enter the password again: \n");
-
-      _connfd.readStr(passwd2);
-      clrNewlines(passwd2);
-
-      if (passwd2.compare(passwd1) == 0)
-         valid_passwd = true;
-      else{
-         _connfd.writeFD("Passwords must match. Try again with password 1:\n");
-         passwd1.clear();
-         passwd2.clear();
-      }
-   }
-
-   // Now open up a password manager and change the password
-   PasswdMgr pwm("passwd");
-   pwm.changePasswd(_username.c_str(), passwd1.c_str());
-
-   // Set the status to menu
-   _status = s_menu;
-   _connfd.writeFD("Your password is updated. You may now enter a new menu choice. \n");
+void TCPConn::setPassword() {
+   if (!getUserInput(_newpwd))
+      return;
 
+   setStatus(s_confirmpwd);
+   sendText("Enter the password again: \n");
 }
 
 /**********************************************************************************************
- * checkIPAddr - Compares the passed in string against the whitelist
+ * changePassword - called from handleConnection when status is s_confirmpwd--checks to ensure
+ *                  the saved password from the s_changepwd phase is equal, then has the hash
+ *                  pool save the new pwd to the database. If they don't match the user starts
+ *                  over.
  *
- * Returns: True if the passed in input matchs one of the IP addresses listed in the
- *    whitelist.  Returns false if the file fails to open correctly (also prints out an error
- *    message), or if the passed in ip address does not match anything in the white list. 
+ *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::checkIPAddr(std::string ipaddr){
-   // Set up the file stream and empty string for comparison 
-   std::ifstream inputFile("whitelist");
-   std::string line; 
+void TCPConn::changePassword() {
+   std::string passwd2;
+   if (!getUserInput(passwd2))
+      return;
 
-   // Now iterate through each line of the file and compare the line to the ipaddr_str
-   if(inputFile){
-      // The stream opened correctly, now iteratre and compare, return true when you get a hit
-      while(std::getline(inputFile, line)){
-         if(ipaddr.compare(line) == 0){
-            return true;
-         }
-      }
-   } else {
-      // Make sure the ifstream opened correctly
-      perror("Failure to open file whitelist in TCPConn.\n");
-      return false; 
+   if (passwd2.compare(_newpwd) != 0) {
+      sendText("Passwords must match. Try again with password 1:\n");
+      _newpwd.clear();
+      setStatus(s_changepwd);
+      return;
    }
 
-   return false; 
+   // Now have the hash pool change the password
+   submitHash(hash_change, _newpwd);
+   _newpwd.clear();
+}
+
+/**********************************************************************************************
+ * changedPassword - called once the hash pool has written the new password
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::changedPassword() {
+   // Set the status to menu
+   setStatus(s_menu);
+   sendText("Your password is updated. You may now enter a new menu choice. \n");
 }
 
 /**********************************************************************************************
@@ -291,9 +519,54 @@ int TCPConn::getSocketFD() {
 }
 
 /**********************************************************************************************
- * getUserInput - Gets user data and includes a buffer to look for a carriage return before it is
- *                considered a complete user input. Performs some post-processing on it, removing
- *                the newlines
+ * readInput - reads the data available on the socket into the input buffer with one read. The
+ *             socket is level-triggered, so anything that didn't fit raises another event.
+ *
+ *    Returns: false if the client closed the connection (and disconnects), true otherwise
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::readInput() {
+   ssize_t amt_read = _inputbuf.fill(_connfd);
+   if (amt_read > 0) {
+      Metrics::count(mc_bytes_in, amt_read);
+      return true;
+   }
+
+   // 0 bytes on a readable socket means the peer closed it, EAGAIN is a spurious wakeup
+   if ((amt_read == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+      disconnect();
+      return false;
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * hasUserInput - checks the input buffer for a complete (newline terminated) line
+ *
+ **********************************************************************************************/
+
+bool TCPConn::hasUserInput() {
+   return _inputbuf.hasLine();
+}
+
+/**********************************************************************************************
+ * getUserInput - Takes the next complete line out of the input buffer without copying it
+ *
+ *    Params: cmd - set to a view of the line without its newline, valid until more input is
+ *                  read. Left alone if no command found.
+ *
+ *    Returns: true if a carriage return was found and cmd was populated, false otherwise.
+ **********************************************************************************************/
+
+bool TCPConn::getUserInput(std::string_view &cmd) {
+   return _inputbuf.getLine(cmd);
+}
+
+/**********************************************************************************************
+ * getUserInput - Takes the next complete line out of the input buffer. Performs some
+ *                post-processing on it, removing the newlines
  *
  *    Params: cmd - the buffer to store commands - contents left alone if no command found
  *
@@ -303,75 +576,55 @@ int TCPConn::getSocketFD() {
  **********************************************************************************************/
 
 bool TCPConn::getUserInput(std::string &cmd) {
-   std::string readbuf;
-
-   // read the data on the socket
-   _connfd.readFD(readbuf);
-
-   // concat the data onto anything we've read before
-   _inputbuf += readbuf;
-
    // If it doesn't have a carriage return, then it's not a command
-   int crpos;
-   if ((crpos = _inputbuf.find("\n")) == std::string::npos)
+   std::string_view line;
+   if (!_inputbuf.getLine(line))
       return false;
 
-   cmd = _inputbuf.substr(0, crpos);
-   _inputbuf.erase(0, crpos+1);
+   cmd.assign(line.data(), line.size());
 
-   // Remove \r if it is there
+   // Remove any \r or \n left inside the line
    clrNewlines(cmd);
 
    return true;
 }
 
 /**********************************************************************************************
- * getMenuChoice - Gets the user's command and interprets it, calling the appropriate function
- *                 if required.
+ * getMenuChoice - Gets the user's command and looks it up in the CommandRegistry, sending its
+ *                 reply and calling its action if it has one.
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
 void TCPConn::getMenuChoice() {
-   if (!_connfd.hasData())
-      return;
-   std::string cmd;
+   // The command is parsed where it sits in the input buffer, so nothing here allocates
+   std::string_view cmd;
    if (!getUserInput(cmd))
       return;
-   lower(cmd);      
-
-   std::string msg;
-   if (cmd.compare("hello") == 0) {
-      _connfd.writeFD("Hello back!\n");
-   } else if (cmd.compare("menu") == 0) {
-      sendMenu();
-   } else if (cmd.compare("exit") == 0) {
-      _connfd.writeFD("Disconnecting...goodbye!\n");
-      disconnect();
-   } else if (cmd.compare("passwd") == 0) {
-      _connfd.writeFD("New Password: \n");
-      _status = s_changepwd;
-   } else if (cmd.compare("1") == 0) {
-      _connfd.writeFD("C++ got the OOP features from Simula67 Programming language.\n");
-   } else if (cmd.compare("2") == 0) {
-      msg += "Not purely object oriented: We can write C++ code without using\n";
-      msg += "classes and it will compile without showing any error message.\n";
-      _connfd.writeFD(msg);
-   } else if (cmd.compare("3") == 0) {
-      _connfd.writeFD("C and C++ were invented at same place i.e. at T bell laboratories.\n");
-   } else if (cmd.compare("4") == 0) {
-      msg += "Concept of reference variables: operator overloading borrowed from the Algol 68\n";
-      msg += "Algol 68 programming language.\n";
-      _connfd.writeFD(msg);
-   } else if (cmd.compare("5") == 0) {
-      _connfd.writeFD("A function is the minimum requirement for a C++ program to run.\n");
+   ProfileScope profile(pp_command);
+   auto start = std::chrono::steady_clock::now();
+
+   metric_hist latency = mh_cmd_unknown;
+   const MenuCommand *command = CommandRegistry::find(cmd);
+   if (command != NULL) {
+      latency = command->latency;
+      sendReply(CommandRegistry::getReply(*command));
+      if (isConnected() && (command->action != NULL))
+         (this->*command->action)();
    } else {
-      msg = "Unrecognized command: ";
-      msg += cmd;
-      msg += "\n";
-      _connfd.writeFD(msg);
+      const char prefix[] = "Unrecognized command: ";
+      char msg[sizeof(prefix) + line_buf_size];
+      size_t len = sizeof(prefix) - 1;
+      memcpy(msg, prefix, len);
+      for (char c : cmd)
+         msg[len++] = std::tolower((unsigned char) c);
+      msg[len++] = '\n';
+      sendText(msg, len);
    }
 
+   auto end = std::chrono::steady_clock::now();
+   Metrics::count(mc_commands);
+   Metrics::record(latency, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
 }
 
 /**********************************************************************************************
@@ -380,39 +633,53 @@ void TCPConn::getMenuChoice() {
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 void TCPConn::sendMenu() {
-   std::string menustr;
-
-   menustr += "************************************\n";
-   menustr += "Available menu choices are: \n";
-   menustr += "  1-5 : provide c++ information.\n";
-   menustr += "  Hello : self-explanatory\n";
-   menustr += "  Passwd : change your password\n";
-   menustr += "  Menu : display this menu\n";
-   menustr += "  Exit : disconnect.\n";
-   menustr += "************************************\n";
+   sendReply(CommandRegistry::getMenu());
+}
 
-   _connfd.writeFD(menustr);
+/**********************************************************************************************
+ * startPasswordChange - moves the connection to asking for a new password (the passwd command
+ *                       already prompted for it)
+ *
+ **********************************************************************************************/
+void TCPConn::startPasswordChange() {
+   setStatus(s_changepwd);
 }
 
 
 /**********************************************************************************************
- * disconnect - cleans up the socket as required and closes the FD
+ * disconnect - cleans up the socket as required and closes the FD. Queued output (usually the
+ *              reason for disconnecting) gets one nonblocking attempt to go out first.
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 void TCPConn::disconnect() {
+   if (isConnected() && hasOutput()) {
+      ssize_t written = _outbuf.flush(_connfd);
+      if (written > 0) {
+         Metrics::count(mc_writes);
+         Metrics::count(mc_bytes_out, written);
+      }
+   }
    
    _connfd.closeFD();
 }
 
 
 /**********************************************************************************************
- * isConnected - performs a simple check on the socket to see if it is still open 
+ * isConnected - checks if the socket is still open. It is only ever closed through _connfd, so
+ *               this doesn't need to ask the kernel.
  *
- *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 bool TCPConn::isConnected() {
-   return _connfd.isOpen();
+   return _connfd.getFD() != -1;
+}
+
+/**********************************************************************************************
+ * getStatusStr - the name of the connection's current status, a string that never goes away
+ *
+ **********************************************************************************************/
+const char *TCPConn::getStatusStr() {
+   return status_names[_status];
 }
 
 /**********************************************************************************************
@@ -423,29 +690,41 @@ void TCPConn::getIPAddrStr(std::string &buf) {
    return _connfd.getIPAddrStr(buf);
 }
 
+/**********************************************************************************************
+ * logLoginEvent - Records the result of a login step, as a binary journal record if the
+ *                 journal is running and otherwise as a line in the text log
+ *
+ *    Params:  outcome - the result
+ *             user - the username given
+ *             text - what happened, for the text log
+ **********************************************************************************************/
+
+void TCPConn::logLoginEvent(journal_outcome outcome, const std::string &user, const char *text) {
+   if (Journal::isEnabled()) {
+      Journal::record(je_login, outcome, getIPAddr(), user);
+      return;
+   }
+
+   std::string event ("IP Address: ");
+   std::string ipaddr_str;
+   getIPAddrStr(ipaddr_str);
+   event.append(ipaddr_str);
+   event.append(" ; User: ");
+   event.append(user);
+   event.append("; ");
+   event.append(text);
+   logEvent(event.c_str());
+}
+
 /**
- * logEvent - takes a string and writes it to the log file, after a date/time
+ * logEvent - takes a string and queues it for the shared Logger, which writes it to the log
+ *            file after a date/time without blocking this thread
  * 
  *    params - event string to write to the file
  * 
  */
 void TCPConn::logEvent(const char* event){
-   // Open the file with the append option
-   FileFD logFile("server.log");
-   if (!logFile.openFile(FileFD::appendfd))
-      perror ("Could not open server.log\n");
-   
-   // Get the current time and write it to the buffer
-   time_t now = time(0);
-   char* localTime = ctime(&now);
-   std::string local(localTime);
-   clrNewlines(local);
-   logFile.writeFD(local);
-   logFile.writeFD(" : "); // Just to make the line more readable
-
-   // Now write the event sting and a newline. 
-   logFile.writeFD(event);
-   logFile.writeFD("\n");
+   Logger::getLogger().log(event);
 }
 
 
@@ -0,0 +1,559 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <errno.h>
+#include <vector>
+#include <memory>
+#include "TCPReactor.h"
+#include "TCPServer.h"
+#include "Diag.h"
+#include "Metrics.h"
+#include "Profiler.h"
+
+TCPReactor::TCPReactor(TCPServer &server, HashPool &hasher, Whitelist &whitelist,
+                       Watchdog &watchdog, io_backend_type backend):
+                       _server(server), _hasher(hasher), _whitelist(whitelist),
+                       _watchdog(watchdog), _backend(backend) {
+
+}
+
+
+TCPReactor::~TCPReactor() {
+
+}
+
+/**********************************************************************************************
+ * bindReactor - Sets up this reactor's own server socket. SO_REUSEPORT lets every reactor bind
+ *               the same address and port, and the kernel spreads new connections across them.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::bindReactor(const char *ip_addr, unsigned short port) {
+
+   _sockfd.setReusePort();
+
+   // Set the socket to nonblocking
+   _sockfd.setNonBlocking();
+
+   _sockfd.bindFD(ip_addr, port);
+}
+
+/**********************************************************************************************
+ * runLoop - Runs this reactor's event loop on the calling thread with the I/O backend it was
+ *           given, until stop is called. If io_uring was asked for but the kernel doesn't
+ *           allow it, falls back to epoll.
+ *
+ *    Params:  cpu - the CPU to pin the calling thread to, or -1 to leave it unpinned
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::runLoop(int cpu) {
+
+   if (cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+   }
+
+   // Start the server socket listening
+   _sockfd.listenFD(SOMAXCONN);
+
+   if (_backend == uring_backend) {
+      try {
+         _uringfd.reset(new UringFD());
+      } catch (socket_error &e) {
+         DIAG_WARN("io_uring unavailable (" << e.what() << "), falling back to epoll.");
+         _backend = epoll_backend;
+      }
+   }
+
+   _watchdog.addReactor(_beat);
+
+   if (_backend == uring_backend)
+      runUring();
+   else
+      runEpoll();
+}
+
+/**********************************************************************************************
+ * runEpoll - Registers this reactor's server socket with epoll and loops waiting for readiness
+ *            events. New connections are accepted into TCPConn objects and registered as well,
+ *            so only the connections that actually have data are handled on each pass and
+ *            idle connections cost nothing.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::runEpoll() {
+
+   std::vector<epoll_event> events;
+
+   _epollfd.addFD(_sockfd.getFD(), EPOLLIN);
+   _epollfd.addFD(_hashdone.getFD(), EPOLLIN);
+
+   while (_online) {
+      _epollfd.waitFD(events);
+      _watchdog.beginIteration(_beat);
+
+      for (epoll_event &ev : events) {
+         if (ev.data.fd == _sockfd.getFD())
+            acceptConns();
+         else if (ev.data.fd == _hashdone.getFD()) {
+            _hashdone.drainFD();
+            handleHashResults();
+         } else
+            handleEvent(ev);
+      }
+
+      flushConns();
+      _watchdog.endIteration(_beat);
+   } 
+   
+}
+
+/**********************************************************************************************
+ * runUring - Completion-based loop. Accepts, receives and sends are queued on the io_uring
+ *            and each pass hands all new requests to the kernel and waits for completions in
+ *            a single system call. Received data goes straight into the connection's buffer
+ *            and replies are written straight from its output queue, so there is no separate
+ *            readiness notification and read or write per connection.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::runUring() {
+
+   // Keep several accepts outstanding so a burst of connections isn't serialized
+   for (unsigned int i = 0; i < uring_accept_depth; i++)
+      _uringfd->prepAccept(_sockfd.getFD(), uringTag(uring_accept, 0));
+   _uringfd->prepRead(_hashdone.getFD(), &_hashdone_count, sizeof(_hashdone_count),
+                      uringTag(uring_hashdone, 0));
+
+   while (_online) {
+      _uringfd->submitAndWait(1);
+      _watchdog.beginIteration(_beat);
+
+      uint64_t user_data;
+      int res;
+      while (_uringfd->getCompletion(user_data, res)) {
+         int fd = (int) (user_data & 0xffffffff);
+
+         if (reapClosing(user_data))
+            continue;
+
+         if (uringOp(user_data) == uring_hashdone) {
+            handleHashResults();
+            _uringfd->prepRead(_hashdone.getFD(), &_hashdone_count, sizeof(_hashdone_count),
+                               uringTag(uring_hashdone, 0));
+            continue;
+         }
+
+         if (uringOp(user_data) == uring_accept) {
+            _watchdog.setActivity(_beat, "accept", res, NULL);
+            if (res >= 0) {
+               ProfileScope profile(pp_accept);
+               std::unique_ptr<TCPConn> new_conn(new TCPConn(_hasher, _hashdone, _next_conn_id++));
+               new_conn->attach(res);
+               if (admitConn(*new_conn)) {
+                  _connmap[res] = std::move(new_conn);
+                  _dirty.push_back(res);
+               }
+            }
+            _uringfd->prepAccept(_sockfd.getFD(), uringTag(uring_accept, 0));
+            continue;
+         }
+
+         // Anything else is for a connection, and ignored if that connection is gone
+         auto cptr = _connmap.find(fd);
+         if ((cptr == _connmap.end()) ||
+             (uringConn(user_data) != uringConn(uringTag(uring_recv, fd, cptr->second->getConnID()))))
+            continue;
+
+         TCPConn &conn = *cptr->second;
+         if (uringOp(user_data) == uring_send) {
+            // Whatever the send didn't write goes out with the next one, from flushConns
+            conn.setIOEvents(conn.getIOEvents() & ~EPOLLOUT);
+            _watchdog.setActivity(_beat, "output", fd, conn.getStatusStr());
+            if (conn.finishSend(res))
+               _dirty.push_back(fd);
+            else
+               removeConn(fd);
+            continue;
+         }
+
+         // A receive interrupted before any data arrived is simply queued again by flushConns
+         conn.setIOEvents(conn.getIOEvents() & ~EPOLLIN);
+         if ((res == -EINTR) || (res == -EAGAIN)) {
+            _dirty.push_back(fd);
+            continue;
+         }
+
+         _watchdog.setActivity(_beat, "input", fd, conn.getStatusStr());
+         conn.handleData(res);
+
+         if (conn.isConnected())
+            _dirty.push_back(fd);
+         else
+            removeConn(fd);
+      }
+
+      flushConns();
+      _watchdog.endIteration(_beat);
+   }
+}
+
+/**********************************************************************************************
+ * acceptConns - Accepts every pending connection on the (nonblocking) server socket and
+ *               registers the ones that pass admitConn with epoll
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::acceptConns() {
+
+   _watchdog.setActivity(_beat, "accept", -1, NULL);
+   while (true) {
+      ProfileScope profile(pp_accept);
+      std::unique_ptr<TCPConn> new_conn(new TCPConn(_hasher, _hashdone, _next_conn_id++));
+      if (!new_conn->accept(_sockfd)) {
+         // EAGAIN means the backlog is drained, anything else we'll see again next event
+         return;
+      }
+
+      if (!admitConn(*new_conn))
+         continue;
+
+      int fd = new_conn->getSocketFD();
+      _epollfd.addFD(fd, EPOLLIN | EPOLLRDHUP);
+      new_conn->setIOEvents(EPOLLIN | EPOLLRDHUP);
+      _connmap[fd] = std::move(new_conn);
+
+      // Sends the welcome and username prompt admitConn queued
+      _dirty.push_back(fd);
+   }
+}
+
+/**********************************************************************************************
+ * setFilter - Attaches the whitelist's compiled BPF filter to the listening socket, so the
+ *             kernel drops SYNs from sources it doesn't allow before they are ever accepted.
+ *             Called from the server's housekeeping thread whenever the whitelist reloads.
+ *
+ *    Params:  prog - the program, or NULL to remove the filter
+ *
+ *    Returns: false if the kernel rejected the program (the filter is removed)
+ **********************************************************************************************/
+
+bool TCPReactor::setFilter(const std::vector<struct sock_filter> *prog) {
+   if ((prog != NULL) && _sockfd.attachFilter(*prog)) {
+      _filtered = true;
+      return true;
+   }
+
+   _sockfd.detachFilter();
+   _filtered = false;
+   return (prog == NULL);
+}
+
+/**********************************************************************************************
+ * admitConn - Checks a newly accepted connection against the whitelist. Rejected connections
+ *             are told why and disconnected, accepted ones are welcomed and asked for a username
+ *
+ *    Returns: true if the connection was admitted, false if it was rejected
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+bool TCPReactor::admitConn(TCPConn &new_conn) {
+      
+   DIAG_DEBUG("***New Connection on socket " << new_conn.getSocketFD() << "***");
+
+   // Accepted sockets inherit the listener's filter, which would drop this peer's packets if
+   // a reload stopped allowing it. Whether to keep a connection is only decided here.
+   if (_filtered)
+      new_conn.detachFilter();
+
+   // Get their IP Address string to use in logging
+   std::string ipaddr_str;
+   new_conn.getIPAddrStr(ipaddr_str);
+   
+   DIAG_TRACE("***Checking IP Address " << ipaddr_str << " against whitelist now.***");
+   if(_whitelist.isAllowed(new_conn.getIPAddr())){
+      DIAG_TRACE("***IP Address was contained in the white list.***");
+      Metrics::count(mc_conns_accepted);
+      if (Journal::isEnabled()) {
+         Journal::record(je_connect, jo_ok, new_conn.getIPAddr(), "");
+      } else {
+         std::string event ("IP Address: ");
+         event.append(ipaddr_str);
+         event.append(" connected to the server.");
+         _server.logEvent(event.c_str());
+      }
+   } else {
+      DIAG_INFO("***IP Address " << ipaddr_str << " was not contained in the white list.***");
+      Metrics::count(mc_conns_rejected);
+      new_conn.sendText("Your IP Address was not contained in the whitelist.\n");
+      new_conn.sendText("You're now being disconnected from the server.\n");
+      new_conn.disconnect();
+      if (Journal::isEnabled()) {
+         Journal::record(je_connect, jo_denied, new_conn.getIPAddr(), "");
+      } else {
+         std::string event ("IP Address: ");
+         event.append(ipaddr_str);
+         event.append(" failed to connect to the server because it wasn't on the whitelist.");
+         _server.logEvent(event.c_str());
+      }
+      return false; 
+   }
+
+   new_conn.sendText("Welcome to the CSCE 689 Server!\n");
+
+   new_conn.startAuthentication();
+   return true;
+}
+
+/**********************************************************************************************
+ * handleEvent - Dispatches a readiness event to the TCPConn that owns the FD and cleans the
+ *               connection up if it was closed by either side
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::handleEvent(epoll_event &ev) {
+   auto cptr = _connmap.find(ev.data.fd);
+   if (cptr == _connmap.end())
+      return;
+
+   TCPConn &conn = *cptr->second;
+   _watchdog.setActivity(_beat, "input", ev.data.fd, conn.getStatusStr());
+
+   // Hangups and errors are reported regardless of the event mask we asked for. EPOLLOUT just
+   // means queued output can go now, which flushConns takes care of.
+   if ((ev.events & (EPOLLHUP | EPOLLERR)) || 
+       ((ev.events & EPOLLRDHUP) && !(ev.events & EPOLLIN)))
+      conn.disconnect();
+   else if (conn.isConnected() && (ev.events & EPOLLIN))
+      conn.handleConnection();
+
+   if (!conn.isConnected())
+      removeConn(ev.data.fd);
+   else
+      _dirty.push_back(ev.data.fd);
+}
+
+/**********************************************************************************************
+ * handleHashResults - Hands finished hash jobs back to their connections. Results for
+ *                     connections that closed while the job ran are dropped.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::handleHashResults() {
+   std::vector<std::unique_ptr<HashJob>> jobs;
+   _hashdone.popAll(jobs);
+
+   for (auto &job : jobs) {
+      auto cptr = _connmap.find(job->fd);
+      if ((cptr == _connmap.end()) || (cptr->second->getConnID() != job->conn_id))
+         continue;
+
+      _watchdog.setActivity(_beat, "hashdone", job->fd, cptr->second->getStatusStr());
+      cptr->second->finishHash(*job);
+
+      if (!cptr->second->isConnected())
+         removeConn(job->fd);
+      else
+         _dirty.push_back(job->fd);
+   }
+}
+
+/**********************************************************************************************
+ * flushConns - Sends the output queued by every connection handled this iteration, so the
+ *              replies to a batch of input go out in one write, and updates what the loop waits
+ *              on for each of them. A connection with output the socket couldn't take waits for
+ *              it to be writable, and one that is over its output high-water mark stops being
+ *              read until the client catches up. With io_uring the write is queued as a send
+ *              by waitUring rather than made here.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPReactor::flushConns() {
+   for (int fd : _dirty) {
+      auto cptr = _connmap.find(fd);
+      if (cptr == _connmap.end())
+         continue;
+
+      // With io_uring the output is sent asynchronously, queued by waitUring
+      TCPConn &conn = *cptr->second;
+      bool connected = (_backend == uring_backend) ? conn.isConnected() : conn.flushOutput();
+      if (!connected) {
+         removeConn(fd);
+         continue;
+      }
+
+      if (conn.isThrottled())
+         Metrics::count(mc_throttled);
+
+      if (_backend == uring_backend) {
+         waitUring(fd, conn);
+         continue;
+      }
+
+      uint32_t events = conn.isThrottled() ? 0 : (EPOLLIN | EPOLLRDHUP);
+      if (conn.hasOutput())
+         events |= EPOLLOUT;
+
+      if (events != conn.getIOEvents()) {
+         _epollfd.modFD(fd, events);
+         conn.setIOEvents(events);
+      }
+   }
+   _dirty.clear();
+}
+
+/**********************************************************************************************
+ * waitUring - Queues whatever a connection needs and doesn't already have outstanding on the
+ *             io_uring: a receive unless its output is over the high-water mark, and a writev
+ *             of its queued output (the kernel waits for room in the send buffer). The
+ *             connection's IOEvents track which of the two are outstanding, EPOLLOUT standing
+ *             for the send.
+ *
+ *    Throws: socket_error if the submission queue is full and can't be flushed
+ **********************************************************************************************/
+
+void TCPReactor::waitUring(int fd, TCPConn &conn) {
+   uint32_t events = conn.getIOEvents();
+
+   if (!conn.isThrottled() && !(events & EPOLLIN)) {
+      size_t space;
+      char *recvbuf = conn.getRecvBuf(space);
+      _uringfd->prepRecv(fd, recvbuf, space, uringTag(uring_recv, fd, conn.getConnID()));
+      events |= EPOLLIN;
+   }
+
+   int iovcnt;
+   const struct iovec *iov;
+   if (!(events & EPOLLOUT) && ((iov = conn.startSend(iovcnt)) != NULL)) {
+      _uringfd->prepWritev(fd, iov, iovcnt, uringTag(uring_send, fd, conn.getConnID()));
+      events |= EPOLLOUT;
+   }
+
+   conn.setIOEvents(events);
+}
+
+/**********************************************************************************************
+ * reapClosing - Checks if a completion is for a removed connection (or is the result of
+ *               cancelling one of its operations). Once all of a removed connection's
+ *               operations have completed, nothing refers to it and it is freed.
+ *
+ *    Returns: true if the completion was dealt with here, false if it's for the loop to handle
+ **********************************************************************************************/
+
+bool TCPReactor::reapClosing(uint64_t user_data) {
+   uring_op op = uringOp(user_data);
+   if (op == uring_cancel)
+      return true;
+   if ((op != uring_recv) && (op != uring_send))
+      return false;
+
+   auto cptr = _closing.find(uringConn(user_data));
+   if (cptr == _closing.end())
+      return false;
+
+   TCPConn &conn = *cptr->second;
+   conn.setIOEvents(conn.getIOEvents() & ~((op == uring_recv) ? EPOLLIN : EPOLLOUT));
+
+   if (conn.getIOEvents() == 0)
+      _closing.erase(cptr);
+   return true;
+}
+
+/**********************************************************************************************
+ * removeConn - Logs the disconnect of a connection and removes it from the connection map.
+ *              Closing the socket already took it out of the epoll interest list. With
+ *              io_uring, its outstanding operations are cancelled and it waits in _closing
+ *              until they complete.
+ *
+ **********************************************************************************************/
+
+void TCPReactor::removeConn(int fd) {
+   auto cptr = _connmap.find(fd);
+   if (cptr == _connmap.end())
+      return;
+
+   _watchdog.setActivity(_beat, "disconnect", fd, cptr->second->getStatusStr());
+   if (Journal::isEnabled()) {
+      Journal::record(je_disconnect, jo_ok, cptr->second->getIPAddr(), cptr->second->getUsernameStr());
+   } else {
+      std::string event ("IP Address: ");
+      std::string ipaddr_str;
+      cptr->second->getIPAddrStr(ipaddr_str);
+      event.append(ipaddr_str);
+      event.append(" ; User: ");
+      event.append(cptr->second->getUsernameStr());
+      event.append("; Disconnected.");
+      _server.logEvent(event.c_str());
+   }
+
+   // The io_uring holds the socket open and may still use the connection's buffers until its
+   // outstanding operations complete, so they are cancelled and the connection is kept
+   if ((_backend == uring_backend) && (cptr->second->getIOEvents() != 0)) {
+      TCPConn &conn = *cptr->second;
+      uint64_t conn_id = conn.getConnID();
+      if (conn.getIOEvents() & EPOLLIN)
+         _uringfd->prepCancel(uringTag(uring_recv, fd, conn_id), uringTag(uring_cancel, fd, conn_id));
+      if (conn.getIOEvents() & EPOLLOUT)
+         _uringfd->prepCancel(uringTag(uring_send, fd, conn_id), uringTag(uring_cancel, fd, conn_id));
+      _closing[uringConn(uringTag(uring_recv, fd, conn_id))] = std::move(cptr->second);
+   }
+
+   _connmap.erase(cptr);
+   DIAG_DEBUG("Connection disconnected.");
+}
+
+
+/**********************************************************************************************
+ * stop - Asks the reactor's loop to return, waking it through the hash completion eventfd it
+ *        always waits on. Safe to call from any thread.
+ *
+ **********************************************************************************************/
+
+void TCPReactor::stop() {
+   _online = false;
+   _hashdone.wake();
+}
+
+/**********************************************************************************************
+ * shutdown - Closes every connection and this reactor's socket, epoll and io_uring FDs. Called
+ *            once the reactor's loop has stopped.
+ *
+ **********************************************************************************************/
+
+void TCPReactor::shutdown() {
+   while (!_connmap.empty()) {
+      int fd = _connmap.begin()->first;
+      _connmap.begin()->second->disconnect();
+      removeConn(fd);
+   }
+
+   // Wait out the cancelled operations before the buffers they point into are freed
+   if (_uringfd) {
+      uint64_t user_data;
+      int res;
+      while (!_closing.empty()) {
+         _uringfd->submitAndWait(1);
+         while (_uringfd->getCompletion(user_data, res))
+            reapClosing(user_data);
+      }
+   }
+
+   _uringfd.reset();
+   _epollfd.closeFD();
+   _sockfd.closeFD();
+}
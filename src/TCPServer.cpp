@@ -11,8 +11,30 @@
 #include <memory>
 #include <sstream>
 #include <ctime>
+#include <sys/resource.h>
+#include <thread>
+#include <csignal>
+#include <chrono>
 #include "TCPServer.h"
 #include "strfuncts.h"
+#include "Logger.h"
+#include "Journal.h"
+#include "Metrics.h"
+#include "Profiler.h"
+
+// Set by the SIGHUP handler, the housekeeping thread reloads the whitelist when it sees it
+static volatile sig_atomic_t reload_requested = 0;
+
+static void handleSighup(int) {
+   reload_requested = 1;
+}
+
+// Set by the SIGTERM/SIGINT handler, the housekeeping thread stops the server when it sees it
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handleSigterm(int) {
+   stop_requested = 1;
+}
 
 TCPServer::TCPServer(){ 
    logEvent("Server started.");
@@ -24,162 +46,330 @@ TCPServer::~TCPServer() {
 }
 
 /**********************************************************************************************
- * bindSvr - Creates a network socket and sets it nonblocking so we can loop through looking for
- *           data. Then binds it to the ip address and port
+ * bindSvr - Starts exporting metrics and the password hashing pool, and creates a reactor for
+ *           each thread, each of which creates a nonblocking network socket bound to the ip
+ *           address and port
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 
-   struct sockaddr_in servaddr;
-
    // _server_log.writeLog("Server started.");
 
-   // Set the socket to nonblocking
-   _sockfd.setNonBlocking();
+   // Started before anything that records, so every thread gets its own exported slot
+   std::string metrics_results;
+   Metrics::start(port, metrics_results);
+   std::cout << metrics_results << "\n";
+   logEvent(metrics_results.c_str());
+
+   unsigned int hash_workers = _hash_workers;
+   if (hash_workers == 0)
+      hash_workers = std::thread::hardware_concurrency();
+   _hasher.reset(new HashPool(pwdfilename, hash_workers, _hash_mem_budget, _hash_queue_len,
+                              _hash_deadline_ms));
+   std::cout << "Hashing with " << _hasher->getNumWorkers() << " worker(s).\n";
+
+   _reactors.clear();
+   for (unsigned int i = 0; i < _num_threads; i++) {
+      _reactors.emplace_back(new TCPReactor(*this, *_hasher, _whitelist, _watchdog, _backend));
+      _reactors.back()->bindReactor(ip_addr, port);
+   }
+
+   reloadWhitelist(true);
+
+   // Without the journal, events just go to the text log as before
+   if (_journal) {
+      std::string results;
+      if (!Journal::start(results))
+         results.append(" Logging events as text instead.");
+      std::cout << results << "\n";
+      logEvent(results.c_str());
+   }
 
-   // Load the socket information to prep for binding
-   _sockfd.bindFD(ip_addr, port);
- 
 }
 
 /**********************************************************************************************
- * listenSvr - Performs a loop to look for connections and create TCPConn objects to handle
- *             them. Also loops through the list of connections and handles data received and
- *             sending of data. 
+ * setThreads - Sets how many reactor threads the server runs. Must be called before bindSvr.
+ *
+ *    Params:  num_threads - number of reactors, each with its own listening socket, epoll loop
+ *                           and connections
+ *             pin_cpus - if true, reactor i is pinned to CPU i (mod the number of CPUs)
  *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
-void TCPServer::listenSvr() {
+void TCPServer::setThreads(unsigned int num_threads, bool pin_cpus) {
+   _num_threads = (num_threads > 0) ? num_threads : 1;
+   _pin_cpus = pin_cpus;
+}
 
-   bool online = true;
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
-   int num_read = 0;
-
-   // Start the server socket listening
-   _sockfd.listenFD(5);
-
-    
-   while (online) {
-      struct sockaddr_in cliaddr;
-      socklen_t len = sizeof(cliaddr);
-
-      if (_sockfd.hasData()) {
-         TCPConn *new_conn = new TCPConn();
-         if (!new_conn->accept(_sockfd)) {
-            // _server_log.strerrLog("Data received on socket but failed to accept.");
-            continue;
-         }
-         
-         std::cout << "***New Connection on socket " << new_conn->getSocketFD()  << "***\n";
-
-         _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
-
-         // Get their IP Address string to use in logging
-         std::string ipaddr_str;
-         new_conn->getIPAddrStr(ipaddr_str);
-         
-         std::cout << "***Checking IP Address " << ipaddr_str << " against whitelist now.***\n";
-         if(new_conn->checkIPAddr(ipaddr_str)){
-            std::cout << "***IP Address was contained in the white list.***\n";
-            std::string event ("IP Address: ");
-            event.append(ipaddr_str);
-            event.append(" connected to the server.");
-            logEvent(event.c_str());
-         } else {
-            std::cout << "***IP Address was not contained in the white list.***\n";
-            new_conn->sendText("Your IP Address was not contained in the whitelist.\n");
-            new_conn->sendText("You're now being disconnected from the server.\n");
-            new_conn->disconnect();
-            std::string event ("IP Address: ");
-            event.append(ipaddr_str);
-            event.append(" failed to connect to the server because it wasn't on the whitelist.");
-            logEvent(event.c_str());
-            continue; 
-            
-         }
+/**********************************************************************************************
+ * setIOBackend - Selects epoll or io_uring for the reactors. Must be called before bindSvr.
+ *                Reactors fall back to epoll on their own if io_uring turns out unavailable.
+ *
+ **********************************************************************************************/
 
-         new_conn->sendText("Welcome to the CSCE 689 Server!\n");
+void TCPServer::setIOBackend(io_backend_type backend) {
+   _backend = backend;
+}
 
-         // Change this later
-         new_conn->startAuthentication();
-      }
+/**********************************************************************************************
+ * setHashWorkers - Sets the number of password hashing threads. Must be called before bindSvr.
+ *
+ *    Params:  num_workers - thread count, 0 for one per CPU
+ *
+ **********************************************************************************************/
 
-      // Loop through our connections, handling them
-      std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
-      while (tptr != _connlist.end())
-      {
-         // If the user lost connection
-         if (!(*tptr)->isConnected()) {
-            std::string event ("IP Address: ");
-            std::string ipaddr_str;
-            (*tptr)->getIPAddrStr(ipaddr_str);
-            event.append(ipaddr_str);
-            event.append(" ; User: ");
-            event.append((*tptr)->getUsernameStr());
-            event.append("; Disconnected.");
-            logEvent(event.c_str());
-
-            // Remove them from the connect list
-            tptr = _connlist.erase(tptr);
-            std::cout << "Connection disconnected.\n";
-            continue;
-         }
+void TCPServer::setHashWorkers(unsigned int num_workers) {
+   _hash_workers = num_workers;
+}
+
+/**********************************************************************************************
+ * setHashLimits - Sets the admission control for password hashing. Must be called before
+ *                 bindSvr.
+ *
+ *    Params:  mem_budget - bytes of Argon2 memory allowed in total (caps the workers, 0 for no cap)
+ *             queue_len - logins/changes allowed to wait for a worker before new ones are shed
+ *             deadline_ms - how long one may wait before it's dropped with a "busy" reply
+ *
+ **********************************************************************************************/
+
+void TCPServer::setHashLimits(size_t mem_budget, unsigned int queue_len, unsigned int deadline_ms) {
+   _hash_mem_budget = mem_budget;
+   _hash_queue_len = queue_len;
+   _hash_deadline_ms = deadline_ms;
+}
 
-         // Process any user inputs
-         (*tptr)->handleConnection();
+/**********************************************************************************************
+ * setKernelFilter - Also enforces the whitelist in the kernel with a BPF filter on each
+ *                   listening socket. The userspace check still runs on every accepted
+ *                   connection, and covers everything when the list is too big to compile.
+ *                   Must be called before bindSvr.
+ *
+ **********************************************************************************************/
+
+void TCPServer::setKernelFilter(bool kernel_filter) {
+   _kernel_filter = kernel_filter;
+}
 
-         // Increment our iterator
-         tptr++;
+/**********************************************************************************************
+ * setJournal - Records connection and login events as binary journal records (queried with
+ *              logq) instead of text lines in the log. Must be called before bindSvr.
+ *
+ **********************************************************************************************/
+
+void TCPServer::setJournal(bool journal) {
+   _journal = journal;
+}
+
+/**********************************************************************************************
+ * setWatchdog - Sets how long one reactor loop iteration may run before the watchdog logs it
+ *               as slow. Must be called before listenSvr.
+ *
+ *    Params:  threshold_ms - the threshold, 0 to turn the watchdog off
+ *             backtraces - also capture where a stalled reactor thread is
+ *
+ **********************************************************************************************/
+
+void TCPServer::setWatchdog(unsigned int threshold_ms, bool backtraces) {
+   _watchdog.setThreshold(threshold_ms, backtraces);
+}
+
+/**********************************************************************************************
+ * runHousekeeping - Runs on its own thread until _online is cleared. Each second it reloads the
+ *                   whitelist if SIGHUP was received or the file changed, and every
+ *                   stats_interval seconds it logs the hash pool statistics. On SIGTERM or
+ *                   SIGINT it stops every reactor, so listenSvr returns.
+ *
+ **********************************************************************************************/
+
+void TCPServer::runHousekeeping() {
+   uint64_t last_submitted = 0;
+   unsigned int secs = 0;
+
+   while (_online) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+
+      // Stopping the reactors makes listenSvr return, and the caller then shuts the server down
+      if (stop_requested) {
+         logEvent("Server stopped by signal.");
+         for (auto &reactor : _reactors)
+            reactor->stop();
+         return;
       }
 
-      // So we're not chewing up CPU cycles unnecessarily
-      nanosleep(&sleeptime, NULL);
-   } 
+      bool force = reload_requested;
+      reload_requested = 0;
+      reloadWhitelist(force);
+
+      if (++secs < stats_interval)
+         continue;
+      secs = 0;
+      logHashStats(last_submitted);
+   }
+}
+
+/**********************************************************************************************
+ * reloadWhitelist - Recompiles the whitelist (and its kernel filter, if enabled) and logs the
+ *                   results
+ *
+ *    Params:  force - reload even if the file looks unchanged (startup and SIGHUP)
+ *
+ **********************************************************************************************/
+
+void TCPServer::reloadWhitelist(bool force) {
+   std::string results;
+   if (force)
+      _whitelist.reload(results);
+   else if (!_whitelist.reloadIfChanged(results))
+      return;
+
+   std::cout << results << "\n";
+   logEvent(results.c_str());
+
+   if (!_kernel_filter)
+      return;
+
+   std::vector<struct sock_filter> prog;
+   std::stringstream event;
+   bool attached = _whitelist.compileFilter(prog);
+   for (auto &reactor : _reactors)
+      attached = reactor->setFilter(attached ? &prog : NULL) && attached;
+
+   if (attached)
+      event << "Kernel whitelist filter attached (" << prog.size() << " BPF instructions).";
+   else
+      event << "Whitelist could not be compiled to a kernel filter (" << prog.size()
+            << " BPF instructions), checking in userspace only.";
+   std::cout << event.str() << "\n";
+   logEvent(event.str().c_str());
+}
 
+/**********************************************************************************************
+ * logHashStats - Writes the hash pool's queue depth and wait times to the log if there was
+ *                any hashing since the last report
+ *
+ *    Params:  last_submitted - jobs submitted as of the last report, updated here
+ *
+ **********************************************************************************************/
 
-   
+void TCPServer::logHashStats(uint64_t &last_submitted) {
+   HashPoolStats stats;
+   _hasher->getStats(stats);
+   if (stats.submitted == last_submitted)
+      return;
+   last_submitted = stats.submitted;
+
+   uint64_t started = stats.completed + stats.expired;
+   std::stringstream event;
+   event << "Hash pool: queue_depth=" << stats.queue_depth
+         << " max_queue_depth=" << stats.max_queue_depth
+         << " submitted=" << stats.submitted << " completed=" << stats.completed
+         << " shed=" << stats.shed << " expired=" << stats.expired
+         << " avg_wait_us=" << (started ? stats.wait_us_total / started : 0)
+         << " max_wait_us=" << stats.wait_us_max;
+   logEvent(event.str().c_str());
 }
 
+/**********************************************************************************************
+ * listenSvr - Runs one reactor loop per thread. The calling thread runs the first reactor and
+ *             the rest get their own threads. Returns once SIGTERM or SIGINT has stopped them
+ *             all, ready for shutdown.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::listenSvr() {
+
+   // Every session holds an FD, so allow as many as the hard limit permits
+   struct rlimit fdlimit;
+   if ((getrlimit(RLIMIT_NOFILE, &fdlimit) == 0) && (fdlimit.rlim_cur < fdlimit.rlim_max)) {
+      fdlimit.rlim_cur = fdlimit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &fdlimit);
+   }
+
+   // Clients can hang up before a reply (like a hash result) is written. That should show up as
+   // a failed write on that connection, not a SIGPIPE that kills the server.
+   signal(SIGPIPE, SIG_IGN);
+
+   // kill -HUP reloads the whitelist
+   struct sigaction hup_action;
+   bzero(&hup_action, sizeof(hup_action));
+   hup_action.sa_handler = handleSighup;
+   sigemptyset(&hup_action.sa_mask);
+   hup_action.sa_flags = SA_RESTART;
+   sigaction(SIGHUP, &hup_action, NULL);
+
+   // kill (or ^C) stops the reactors so the server shuts down cleanly
+   struct sigaction term_action;
+   bzero(&term_action, sizeof(term_action));
+   term_action.sa_handler = handleSigterm;
+   sigemptyset(&term_action.sa_mask);
+   term_action.sa_flags = SA_RESTART;
+   sigaction(SIGTERM, &term_action, NULL);
+   sigaction(SIGINT, &term_action, NULL);
+
+   _watchdog.start();
+
+   long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   std::vector<std::thread> threads;
+   for (unsigned int i = 1; i < _reactors.size(); i++) {
+      int cpu = _pin_cpus ? (int) (i % num_cpus) : -1;
+      TCPReactor *reactor = _reactors[i].get();
+
+      // Exceptions can't cross threads, so a failed reactor takes the process down like the
+      // first reactor would by throwing out of listenSvr
+      threads.emplace_back([reactor, cpu]() {
+         try {
+            reactor->runLoop(cpu);
+         } catch (std::runtime_error &e) {
+            std::cerr << "Reactor thread failed: " << e.what() << std::endl;
+            exit(-1);
+         }
+      });
+   }
+
+   _online = true;
+   std::thread housekeeping_thread(&TCPServer::runHousekeeping, this);
+
+   _reactors[0]->runLoop(_pin_cpus ? 0 : -1);
+
+   _online = false;
+   housekeeping_thread.join();
+   for (auto &t : threads)
+      t.join();
+}
 
 /**********************************************************************************************
- * shutdown - Cleanly closes the socket FD.
+ * shutdown - Cleanly closes every reactor's connections, socket and epoll FDs, lets the hash
+ *            workers finish, then seals the journal and trims the log (journal first, since its
+ *            writer may still log) and prints the profile if --profile is on. Called once
+ *            listenSvr has returned.
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 void TCPServer::shutdown() {
 
-   _sockfd.closeFD();
+   for (auto &reactor : _reactors)
+      reactor->shutdown();
+   _hasher.reset();
+
+   Journal::stop();
+   Logger::getLogger().stop();
+   if (Profiler::isEnabled())
+      Profiler::report(std::cout);
 }
 
 /**
- * logEvent - takes a string and writes it to the log file, after a date/time
+ * logEvent - takes a string and queues it for the shared Logger, which writes it to the log
+ *            file after a date/time without blocking this thread
  * 
  *    params - event string to write to the file
  * 
  */
 void TCPServer::logEvent(const char* event){
-   // Open the file with the append option
-   FileFD logFile("server.log");
-   if (!logFile.openFile(FileFD::appendfd))
-      perror ("Could not open server.log\n");
-   
-   // Get the current time and write it to the buffer
-   time_t now = time(0);
-   char* localTime = ctime(&now);
-   std::string local(localTime);
-   clrNewlines(local);
-   logFile.writeFD(local);
-   logFile.writeFD(" : "); // Just to make the line more readable
-
-   // Now write the event sting and a newline. 
-   logFile.writeFD(event);
-   logFile.writeFD("\n");
+   Logger::getLogger().log(event);
 }
 
 
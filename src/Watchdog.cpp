@@ -0,0 +1,184 @@
+#include <signal.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <chrono>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include "Watchdog.h"
+#include "Logger.h"
+#include "Diag.h"
+
+// Each reactor thread's beat, for the backtrace signal handler
+static thread_local ReactorBeat *local_beat = NULL;
+
+/*******************************************************************************************
+ * takeBacktrace - Signal handler, run on a stalled reactor's thread, that records where the
+ *                 thread is. backtrace() was called once at start so it doesn't need to load
+ *                 anything here.
+ *
+ *******************************************************************************************/
+
+static void takeBacktrace(int) {
+   ReactorBeat *beat = local_beat;
+   if (beat == NULL)
+      return;
+
+   int saved_errno = errno;
+   beat->num_frames = backtrace(beat->frames, slow_max_frames);
+   beat->frames_seq = beat->iter_seq.load(std::memory_order_relaxed) + 1;
+   errno = saved_errno;
+}
+
+Watchdog::Watchdog() {
+
+}
+
+Watchdog::~Watchdog() {
+   _stop = true;
+   if (_watcher.joinable())
+      _watcher.join();
+}
+
+/*******************************************************************************************
+ * setThreshold - Sets how long a reactor iteration may take before it is reported. Must be
+ *                called before start.
+ *
+ *    Params:  threshold_ms - the threshold, 0 to turn the watchdog off
+ *             backtraces - also capture a backtrace of stalled reactor threads
+ *******************************************************************************************/
+
+void Watchdog::setThreshold(unsigned int threshold_ms, bool backtraces) {
+   _threshold_ns = (uint64_t) threshold_ms * 1000000;
+   _backtraces = backtraces;
+}
+
+/*******************************************************************************************
+ * start - Starts the watchdog thread, and installs the backtrace signal handler if needed
+ *
+ *******************************************************************************************/
+
+void Watchdog::start() {
+   if (_threshold_ns == 0)
+      return;
+
+   if (_backtraces) {
+      void *frames[1];
+      backtrace(frames, 1);
+
+      struct sigaction bt_action;
+      bzero(&bt_action, sizeof(bt_action));
+      bt_action.sa_handler = takeBacktrace;
+      sigemptyset(&bt_action.sa_mask);
+      bt_action.sa_flags = SA_RESTART;
+      sigaction(SIGRTMIN, &bt_action, NULL);
+   }
+
+   _watcher = std::thread(&Watchdog::runWatch, this);
+}
+
+/*******************************************************************************************
+ * addReactor - Registers the calling reactor thread's beat with the watchdog
+ *
+ *******************************************************************************************/
+
+void Watchdog::addReactor(ReactorBeat &beat) {
+   beat.thread = pthread_self();
+   local_beat = &beat;
+
+   std::lock_guard<std::mutex> guard(_lock);
+   beat.reactor = _beats.size();
+   _beats.push_back(&beat);
+}
+
+/*******************************************************************************************
+ * runWatch - Checks every reactor four times per threshold. The first time it sees an
+ *            iteration past the threshold, it notes what is running (the reactor may already
+ *            have moved on to another handler by the time it ends) and asks for a backtrace.
+ *
+ *******************************************************************************************/
+
+void Watchdog::runWatch() {
+   uint64_t period_ns = std::max(_threshold_ns / 4, (uint64_t) 1000000);
+
+   while (!_stop) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(period_ns));
+      uint64_t now = getNow();
+
+      std::lock_guard<std::mutex> guard(_lock);
+      for (ReactorBeat *beat : _beats) {
+         uint64_t seq = beat->iter_seq.load(std::memory_order_acquire);
+         uint64_t start = beat->iter_start.load(std::memory_order_relaxed);
+         if ((start == 0) || (now < start) || (now - start < _threshold_ns) ||
+             (beat->stall_seq.load(std::memory_order_relaxed) == seq + 1))
+            continue;
+
+         const char *handler = beat->handler.load(std::memory_order_relaxed);
+         const char *status = beat->status.load(std::memory_order_relaxed);
+         int fd = beat->fd.load(std::memory_order_relaxed);
+         beat->stall_handler.store(handler, std::memory_order_relaxed);
+         beat->stall_status.store(status, std::memory_order_relaxed);
+         beat->stall_fd.store(fd, std::memory_order_relaxed);
+         beat->stall_seq.store(seq + 1, std::memory_order_release);
+
+         if (_backtraces)
+            pthread_kill(beat->thread, SIGRTMIN);
+
+         DIAG_WARN("Reactor " << beat->reactor << " stalled for " << (now - start) / 1000000
+                   << "ms so far in " << ((handler != NULL) ? handler : "loop")
+                   << " (fd " << fd << ((status != NULL) ? ", " : "")
+                   << ((status != NULL) ? status : "") << ")");
+      }
+   }
+}
+
+/*******************************************************************************************
+ * reportSlow - Called on the reactor's thread when an iteration ran past the threshold.
+ *              Uses what the watchdog saw during the stall if it caught it, otherwise the
+ *              handler that ran last, and adds the event to the log and the slow ring.
+ *
+ *******************************************************************************************/
+
+void Watchdog::reportSlow(ReactorBeat &beat, uint64_t duration) {
+   uint64_t seq = beat.iter_seq.load(std::memory_order_relaxed);
+
+   const char *handler, *status;
+   int fd;
+   if (beat.stall_seq.load(std::memory_order_acquire) == seq + 1) {
+      handler = beat.stall_handler.load(std::memory_order_relaxed);
+      status = beat.stall_status.load(std::memory_order_relaxed);
+      fd = beat.stall_fd.load(std::memory_order_relaxed);
+   } else {
+      handler = beat.handler.load(std::memory_order_relaxed);
+      status = beat.status.load(std::memory_order_relaxed);
+      fd = beat.fd.load(std::memory_order_relaxed);
+   }
+
+   // Skip the signal handler and the kernel's signal trampoline
+   char **symbols = NULL;
+   int num_frames = 0;
+   if (_backtraces && (beat.frames_seq == seq + 1) && (beat.num_frames > 2)) {
+      num_frames = beat.num_frames - 2;
+      symbols = backtrace_symbols(beat.frames + 2, num_frames);
+      if (symbols == NULL)
+         num_frames = 0;
+   }
+
+   struct timespec wall;
+   clock_gettime(CLOCK_REALTIME, &wall);
+   int64_t when_us = (int64_t) wall.tv_sec * 1000000 + wall.tv_nsec / 1000 - duration / 1000;
+   Metrics::recordSlow(beat.reactor, when_us, duration, fd, handler, status, symbols, num_frames);
+   free(symbols);
+
+   std::stringstream event;
+   event << "Slow reactor iteration: reactor " << beat.reactor << " took " << std::fixed
+         << std::setprecision(1) << duration / 1e6 << "ms in "
+         << ((handler != NULL) ? handler : "loop");
+   if (fd != -1)
+      event << " (fd " << fd << ((status != NULL) ? ", " : "") << ((status != NULL) ? status : "")
+            << ")";
+   event << ".";
+   Logger::getLogger().log(event.str().c_str());
+}
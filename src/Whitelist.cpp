@@ -0,0 +1,278 @@
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include "Whitelist.h"
+
+/*******************************************************************************************
+ * WhitelistTrie (constructor) - Builds the trie. Prefixes are inserted shortest first, so a
+ *                               longer prefix always overwrites the range of shorter ones it
+ *                               falls inside, and child tables start out filled with the
+ *                               verdict of the entry they hang from.
+ *
+ *    Params:  prefixes - the list to compile (sorted in place). For the same prefix listed
+ *                        more than once, the last one wins.
+ *******************************************************************************************/
+
+WhitelistTrie::WhitelistTrie(std::vector<Prefix> &prefixes) {
+   std::stable_sort(prefixes.begin(), prefixes.end(),
+                    [](const Prefix &a, const Prefix &b) { return a.len < b.len; });
+
+   newTable(wl_none);
+
+   for (const Prefix &prefix : prefixes) {
+      uint32_t table = 0;
+      unsigned int start = 0;   // first address bit covered by this level
+
+      for (unsigned int stride : whitelist_strides) {
+         unsigned int shift = 32 - start - stride;
+         uint32_t idx = (prefix.addr >> shift) & ((1u << stride) - 1);
+
+         if (prefix.len <= start + stride) {
+            // The prefix ends at this level, so it covers a run of this table's entries. Any
+            // child tables in the run were made by longer prefixes, which aren't inserted yet.
+            uint32_t count = 1u << (start + stride - prefix.len);
+            idx &= ~(count - 1);
+            for (uint32_t i = idx; i < idx + count; i++)
+               _entries[table + i] = prefix.verdict;
+            break;
+         }
+
+         uint32_t entry = _entries[table + idx];
+         if ((entry >> 2) == 0) {
+            uint32_t child = newTable(entry & 3);
+            _entries[table + idx] = child << 2;
+            entry = child << 2;
+         }
+         table = entry >> 2;
+         start += stride;
+      }
+   }
+}
+
+/*******************************************************************************************
+ * newTable - Adds a table for the next level, every entry set to fill's verdict
+ *
+ *    Returns: offset of the new table in _entries
+ *******************************************************************************************/
+
+uint32_t WhitelistTrie::newTable(uint32_t fill) {
+   // Root and child tables only differ in size, the root is the first stride
+   unsigned int stride = _entries.empty() ? whitelist_strides[0] : whitelist_strides[1];
+   uint32_t offset = _entries.size();
+   _entries.resize(offset + (1u << stride), fill);
+   return offset;
+}
+
+/*******************************************************************************************
+ * lookup - Walks down the tables until an entry has no child, which holds the verdict of
+ *          the longest prefix matching addr
+ *
+ *******************************************************************************************/
+
+whitelist_verdict WhitelistTrie::lookup(uint32_t addr) const {
+   const uint32_t *entries = _entries.data();
+   uint32_t table = 0;
+   unsigned int shift = 32;
+
+   for (unsigned int stride : whitelist_strides) {
+      shift -= stride;
+      uint32_t entry = entries[table + ((addr >> shift) & ((1u << stride) - 1))];
+      if ((entry >> 2) == 0)
+         return (whitelist_verdict) (entry & 3);
+      table = entry >> 2;
+   }
+   return wl_none;
+}
+
+Whitelist::Whitelist(const char *filename):_filename(filename) {
+   std::vector<WhitelistTrie::Prefix> empty;
+   _trie = std::make_shared<const WhitelistTrie>(empty);
+}
+
+/*******************************************************************************************
+ * isAllowed - Checks an address against the current trie
+ *
+ *    Params:  addr - IPv4 address in network byte order
+ *
+ *    Returns: true if the longest matching prefix allows it
+ *******************************************************************************************/
+
+bool Whitelist::isAllowed(unsigned long addr) {
+   std::shared_ptr<const WhitelistTrie> trie = std::atomic_load(&_trie);
+   return trie->lookup(ntohl((uint32_t) addr)) == wl_allow;
+}
+
+/*******************************************************************************************
+ * parseLine - Parses one whitelist line into a prefix
+ *
+ *    Params:  line - the line, with any comment and surrounding whitespace removed here
+ *             prefix - filled in from the line
+ *
+ *    Returns: true if the line held a valid prefix, false if it was blank or invalid (line is
+ *             left empty for blank lines)
+ *******************************************************************************************/
+
+bool Whitelist::parseLine(std::string &line, WhitelistTrie::Prefix &prefix) {
+   size_t comment = line.find('#');
+   if (comment != std::string::npos)
+      line.erase(comment);
+
+   size_t first = line.find_first_not_of(" \t\r");
+   if (first == std::string::npos) {
+      line.clear();
+      return false;
+   }
+   line = line.substr(first, line.find_last_not_of(" \t\r") - first + 1);
+
+   std::string addr_str(line);
+   prefix.verdict = wl_allow;
+   if (addr_str[0] == '!') {
+      prefix.verdict = wl_deny;
+      addr_str.erase(0, 1);
+   }
+
+   prefix.len = 32;
+   size_t slash = addr_str.find('/');
+   if (slash != std::string::npos) {
+      char *end;
+      long len = strtol(addr_str.c_str() + slash + 1, &end, 10);
+      if ((*end != '\0') || (end == addr_str.c_str() + slash + 1) || (len < 0) || (len > 32))
+         return false;
+      prefix.len = len;
+      addr_str.erase(slash);
+   }
+
+   struct in_addr addr;
+   if (inet_pton(AF_INET, addr_str.c_str(), &addr) != 1)
+      return false;
+
+   uint32_t mask = (prefix.len == 0) ? 0 : (0xFFFFFFFFu << (32 - prefix.len));
+   prefix.addr = ntohl(addr.s_addr) & mask;
+   return true;
+}
+
+/*******************************************************************************************
+ * reload - Reads and compiles the whitelist file and swaps the new trie in. Lines that don't
+ *          parse are skipped and counted.
+ *
+ *    Params:  results - set to a description of what was loaded, or why it failed
+ *
+ *    Returns: true if the new list is in use, false if the file couldn't be read
+ *******************************************************************************************/
+
+bool Whitelist::reload(std::string &results) {
+   std::lock_guard<std::mutex> guard(_reload_lock);
+
+   struct stat file_stat;
+   std::ifstream inputFile(_filename.c_str());
+   if (!inputFile || (stat(_filename.c_str(), &file_stat) != 0)) {
+      results = "Could not open whitelist file " + _filename + ", keeping the current list.";
+      return false;
+   }
+
+   std::vector<WhitelistTrie::Prefix> prefixes;
+   WhitelistTrie::Prefix prefix;
+   std::string line;
+   unsigned int bad_lines = 0;
+   while (std::getline(inputFile, line)) {
+      if (parseLine(line, prefix))
+         prefixes.push_back(prefix);
+      else if (!line.empty())
+         bad_lines++;
+   }
+
+   size_t num_prefixes = prefixes.size();
+   _prefixes = prefixes;
+   std::shared_ptr<const WhitelistTrie> trie = std::make_shared<const WhitelistTrie>(prefixes);
+   std::atomic_store(&_trie, trie);
+
+   _file_ino = file_stat.st_ino;
+   _file_mtim = file_stat.st_mtim;
+   _file_size = file_stat.st_size;
+
+   std::stringstream msg;
+   msg << "Whitelist loaded: " << num_prefixes << " prefixes, " << bad_lines
+       << " invalid lines skipped, " << trie->getMemSize() / 1024 << " KiB.";
+   results = msg.str();
+   return true;
+}
+
+/*******************************************************************************************
+ * reloadIfChanged - Reloads if the file's inode, size or mtime differ from the last load
+ *
+ *    Returns: true if the file changed and was reloaded
+ *******************************************************************************************/
+
+bool Whitelist::reloadIfChanged(std::string &results) {
+   struct stat file_stat;
+   if (stat(_filename.c_str(), &file_stat) != 0)
+      return false;
+
+   {
+      std::lock_guard<std::mutex> guard(_reload_lock);
+      if ((file_stat.st_ino == _file_ino) && (file_stat.st_size == _file_size) &&
+          (file_stat.st_mtim.tv_sec == _file_mtim.tv_sec) &&
+          (file_stat.st_mtim.tv_nsec == _file_mtim.tv_nsec))
+         return false;
+   }
+
+   return reload(results);
+}
+
+/*******************************************************************************************
+ * compileFilter - Builds a classic BPF program from the current prefixes. It checks the
+ *                 packet's IPv4 source address against the prefixes longest first, so the
+ *                 first match is the longest one, and drops the packet if that denies it or
+ *                 nothing matches. Each prefix length loads and masks the address once, then
+ *                 compares it to every prefix of that length in blocks of bpf_block_size,
+ *                 each block followed by its own return instructions.
+ *
+ *    Params:  prog - set to the program
+ *
+ *    Returns: false if the program would be longer than the kernel allows (BPF_MAXINSNS)
+ *******************************************************************************************/
+
+bool Whitelist::compileFilter(std::vector<struct sock_filter> &prog) {
+   std::lock_guard<std::mutex> guard(_reload_lock);
+
+   // Longest prefixes first, the last listing of a prefix wins
+   typedef std::pair<unsigned int, uint32_t> len_addr;
+   std::map<len_addr, whitelist_verdict, std::greater<len_addr>> ordered;
+   for (const WhitelistTrie::Prefix &prefix : _prefixes)
+      ordered[std::make_pair(prefix.len, prefix.addr)] = prefix.verdict;
+
+   prog.clear();
+   auto pfx = ordered.begin();
+   while (pfx != ordered.end()) {
+      unsigned int len = pfx->first.first;
+      uint32_t mask = (len == 0) ? 0 : (0xFFFFFFFFu << (32 - len));
+
+      // A = source address & mask
+      prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_NET_OFF + 12)));
+      if (mask != 0xFFFFFFFFu)
+         prog.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask));
+
+      while ((pfx != ordered.end()) && (pfx->first.first == len)) {
+         std::vector<std::pair<uint32_t, whitelist_verdict>> block;
+         for (; (pfx != ordered.end()) && (pfx->first.first == len) &&
+                (block.size() < bpf_block_size); pfx++)
+            block.push_back(std::make_pair(pfx->first.second, pfx->second));
+
+         // Each compare jumps past the rest of the block and the skip to the allow or deny return
+         for (size_t i = 0; i < block.size(); i++) {
+            uint8_t to_returns = block.size() - i;
+            uint8_t jt = to_returns + ((block[i].second == wl_allow) ? 0 : 1);
+            prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, block[i].first, jt, 0));
+         }
+         prog.push_back(BPF_JUMP(BPF_JMP | BPF_JA, 2, 0, 0));
+         prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF));
+         prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+      }
+   }
+   prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+   return prog.size() <= BPF_MAXINSNS;
+}
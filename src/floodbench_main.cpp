@@ -0,0 +1,214 @@
+/****************************************************************************************
+ * floodbench - measures how much CPU tcpserver spends on a connection flood from a source
+ *              address its whitelist denies. Run it against a server with and without -f
+ *              (kernel BPF filtering) to compare. Connections are opened nonblocking from the
+ *              given source address, and any that haven't completed within the timeout
+ *              (because the kernel dropped the SYN) are abandoned and replaced.
+ *
+ ****************************************************************************************/
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " -P <server_pid> [-a <ip_addr>] [-p <portnum>] [-b <src_addr>] [-d <secs>]\n";
+   std::cout << "      [-c <concurrency>] [-t <timeout_ms>]\n";
+   std::cout << "   P: pid of the tcpserver, to read its CPU time from /proc\n";
+   std::cout << "   a: the IP address of the server (default 127.0.0.1)\n";
+   std::cout << "   p: the port of the server (default 9999)\n";
+   std::cout << "   b: source address to flood from, one the whitelist denies (default 127.0.0.2)\n";
+   std::cout << "   d: seconds to flood for (default 5)\n";
+   std::cout << "   c: connections in flight at once (default 64)\n";
+   std::cout << "   t: milliseconds before an unanswered connection is abandoned (default 100)\n";
+}
+
+/*****************************************************************************************
+ * getCPUTime - reads a process' user plus system CPU time from /proc/<pid>/stat
+ *
+ *    Returns: CPU time in milliseconds, or -1 if the process can't be read
+ *****************************************************************************************/
+
+long getCPUTime(pid_t pid) {
+   std::stringstream path;
+   path << "/proc/" << pid << "/stat";
+   std::ifstream statfile(path.str().c_str());
+   std::string stat;
+   if (!std::getline(statfile, stat))
+      return -1;
+
+   // Fields after the ")" that ends the command name, utime and stime are fields 14 and 15
+   std::stringstream fields(stat.substr(stat.rfind(')') + 2));
+   std::string field;
+   unsigned long utime = 0, stime = 0;
+   for (int i = 3; i <= 15 && (fields >> field); i++) {
+      if (i == 14)
+         utime = strtoul(field.c_str(), NULL, 10);
+      else if (i == 15)
+         stime = strtoul(field.c_str(), NULL, 10);
+   }
+   return (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+struct FloodConn {
+   int fd;
+   std::chrono::steady_clock::time_point started;
+};
+
+int main(int argc, char *argv[]) {
+   std::string ip_addr("127.0.0.1"), src_addr("127.0.0.2");
+   unsigned short port = 9999;
+   pid_t server_pid = 0;
+   int duration = 5, concurrency = 64, timeout_ms = 100;
+
+   int c = 0;
+   long portval;
+   while ((c = getopt(argc, argv, "P:a:p:b:d:c:t:")) != -1) {
+      switch (c) {
+      case 'P':
+         server_pid = strtol(optarg, NULL, 10);
+         break;
+
+      case 'a':
+         ip_addr = optarg;
+         break;
+
+      case 'p':
+	      portval = strtol(optarg, NULL, 10);
+	      if ((portval < 1) || (portval > 65535)) {
+            std::cout << "Invalid port. Value must be between 1 and 65535\n";
+            exit(0);
+	      }
+	      port = (unsigned short) portval;
+	      break;
+
+      case 'b':
+         src_addr = optarg;
+         break;
+
+      case 'd':
+         duration = strtol(optarg, NULL, 10);
+         break;
+
+      case 'c':
+         concurrency = strtol(optarg, NULL, 10);
+         break;
+
+      case 't':
+         timeout_ms = strtol(optarg, NULL, 10);
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   sockaddr_in server_addr, bind_addr;
+   bzero(&server_addr, sizeof(server_addr));
+   bzero(&bind_addr, sizeof(bind_addr));
+   server_addr.sin_family = bind_addr.sin_family = AF_INET;
+   server_addr.sin_port = htons(port);
+   if ((server_pid <= 0) || (duration < 1) || (concurrency < 1) || (timeout_ms < 1) ||
+       (inet_pton(AF_INET, ip_addr.c_str(), &server_addr.sin_addr) != 1) ||
+       (inet_pton(AF_INET, src_addr.c_str(), &bind_addr.sin_addr) != 1)) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   struct rlimit fdlimit;
+   if (getrlimit(RLIMIT_NOFILE, &fdlimit) == 0) {
+      fdlimit.rlim_cur = fdlimit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &fdlimit);
+   }
+
+   int epfd = epoll_create1(0);
+   std::vector<FloodConn> conns(concurrency, FloodConn{-1, {}});
+   unsigned long attempts = 0, connected = 0, refused = 0, timed_out = 0;
+
+   long cpu_start = getCPUTime(server_pid);
+   if (cpu_start < 0) {
+      cerr << "Could not read CPU time of pid " << server_pid << endl;
+      return -1;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   auto end = start + std::chrono::seconds(duration);
+   std::vector<epoll_event> events(concurrency);
+   while (std::chrono::steady_clock::now() < end) {
+      auto now = std::chrono::steady_clock::now();
+
+      // Refill empty slots and abandon connections the server never answered
+      for (int i = 0; i < concurrency; i++) {
+         FloodConn &conn = conns[i];
+         if ((conn.fd != -1) && (now - conn.started > std::chrono::milliseconds(timeout_ms))) {
+            close(conn.fd);
+            conn.fd = -1;
+            timed_out++;
+         }
+         if (conn.fd != -1)
+            continue;
+
+         conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+         struct linger reset = {1, 0};   // close with RST so we don't pile up TIME_WAITs
+         setsockopt(conn.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+         if (bind(conn.fd, (sockaddr *) &bind_addr, sizeof(bind_addr)) != 0) {
+            cerr << "Could not bind to source address " << src_addr << endl;
+            return -1;
+         }
+         connect(conn.fd, (sockaddr *) &server_addr, sizeof(server_addr));
+         conn.started = now;
+         attempts++;
+
+         epoll_event ev;
+         ev.events = EPOLLOUT;
+         ev.data.u32 = i;
+         epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+      }
+
+      int num_events = epoll_wait(epfd, events.data(), events.size(), 10);
+      for (int e = 0; e < num_events; e++) {
+         FloodConn &conn = conns[events[e].data.u32];
+         int err = 0;
+         socklen_t errlen = sizeof(err);
+         getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+         if (err == 0)
+            connected++;
+         else
+            refused++;
+         close(conn.fd);
+         conn.fd = -1;
+      }
+   }
+
+   double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   long cpu_end = getCPUTime(server_pid);
+   if (cpu_end < 0) {
+      cerr << "Server pid " << server_pid << " exited during the flood" << endl;
+      return -1;
+   }
+   long cpu_ms = cpu_end - cpu_start;
+   for (FloodConn &conn : conns) {
+      if (conn.fd != -1)
+         close(conn.fd);
+   }
+
+   cout << "attempts=" << attempts << " connected=" << connected << " refused=" << refused
+        << " timed_out=" << timed_out << "\n";
+   cout << "attempts_per_sec=" << attempts / secs << " server_cpu_ms=" << cpu_ms
+        << " server_cpu_pct=" << cpu_ms / (secs * 10) << " server_cpu_us_per_attempt="
+        << (attempts ? cpu_ms * 1000.0 / attempts : 0) << endl;
+   return 0;
+}
@@ -0,0 +1,99 @@
+/****************************************************************************************
+ * hashbench - measures the per-hash cost of PasswdMgr::hashArgon2 with libargon2 allocating
+ *             its own memory versus hashing in a pre-faulted HashArena. Reports latency and,
+ *             where the kernel allows it, page faults and dTLB misses per hash.
+ *
+ ****************************************************************************************/
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <getopt.h>
+#include "PasswdMgr.h"
+#include "HashArena.h"
+#include "PerfCounters.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-n <hashes>]\n";
+   std::cout << "   n: number of hashes to time in each mode (default 50)\n";
+}
+
+/*****************************************************************************************
+ * runMode - hashes num_hashes times on the calling thread and prints the results
+ *****************************************************************************************/
+
+void runMode(const char *mode, int num_hashes, PerfCounters &counters) {
+   PasswdMgr pwm("passwd");
+   std::vector<uint8_t> salt(16, 'a');
+   std::vector<double> lat_us;
+   uint64_t before[pc_num_counters], after[pc_num_counters], total[pc_num_counters] = {0};
+
+   for (int i = 0; i < num_hashes; i++) {
+      std::vector<uint8_t> hash, ret_salt;
+
+      counters.readAll(before);
+      auto start = std::chrono::steady_clock::now();
+      pwm.hashArgon2(hash, ret_salt, "benchmarkpassword", &salt);
+      auto end = std::chrono::steady_clock::now();
+      counters.readAll(after);
+
+      lat_us.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+      for (int c = 0; c < pc_num_counters; c++)
+         total[c] += after[c] - before[c];
+   }
+
+   std::sort(lat_us.begin(), lat_us.end());
+   double sum = 0;
+   for (double l : lat_us)
+      sum += l;
+
+   cout << mode << "\tmean_us=" << sum / lat_us.size() << "\tp50_us=" << lat_us[lat_us.size() / 2]
+        << "\tp99_us=" << lat_us[(lat_us.size() * 99) / 100];
+
+   for (int c = 0; c < pc_num_counters; c++) {
+      perf_counter_type counter = (perf_counter_type) c;
+      cout << "\t" << PerfCounters::getName(counter) << "=";
+      if (counters.isAvailable(counter))
+         cout << total[c] / num_hashes;
+      else
+         cout << "n/a";
+   }
+   cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+   int num_hashes = 50;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "n:")) != -1) {
+      switch (c) {
+      case 'n':
+         num_hashes = strtol(optarg, NULL, 10);
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   if (num_hashes < 1) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   PerfCounters counters;
+
+   runMode("malloc", num_hashes, counters);
+
+   HashArena arena((size_t) argon2_m_cost * 1024);
+   HashArena::setThreadArena(&arena);
+   cout << "(arena on " << (arena.usesHugePages() ? "explicit" : "transparent/normal")
+        << " pages)\n";
+   runMode("arena", num_hashes, counters);
+
+   return 0;
+}
@@ -0,0 +1,228 @@
+/****************************************************************************************
+ * logq - queries tcpserver's binary event journal. Segments are mmapped, those outside the
+ *        time range are skipped using their index headers, address queries on sealed
+ *        segments use their address index, and time ranges are found by binary search,
+ *        so queries don't scan the whole journal. For example, failed logins from
+ *        10.0.0.0/8 in the last hour:
+ *
+ *           logq -e login -o failed -n 10.0.0.0/8 -s 3600
+ *
+ ****************************************************************************************/
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include "Journal.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-d <dir>] [-e <event>] [-o <outcome>] [-n <addr/len>] [-U <user>]\n";
+   std::cout << "      [-s <secs_ago>] [-S <from_epoch>] [-E <to_epoch>] [-c]\n";
+   std::cout << "   d: journal directory (default " << journal_dir << ")\n";
+   std::cout << "   e: event type: connect, login or disconnect\n";
+   std::cout << "   o: outcome: ok, denied, unknown_user, bad_passwd, or failed (anything but ok)\n";
+   std::cout << "   n: only events from this address or CIDR prefix\n";
+   std::cout << "   U: only events for this username\n";
+   std::cout << "   s: only events in the last secs_ago seconds\n";
+   std::cout << "   S/E: only events from/before these times (seconds since the epoch)\n";
+   std::cout << "   c: print only the number of matching events\n";
+}
+
+const char *event_names[] = {"none", "connect", "login", "disconnect"};
+const char *outcome_names[] = {"ok", "denied", "unknown_user", "bad_passwd"};
+
+// What a record has to match
+struct Query {
+   int event = -1;
+   int outcome = -1;
+   bool failed = false;
+   uint32_t addr = 0;
+   uint32_t mask = 0;
+   int64_t user_id = -1;
+   uint64_t from_us = 0;
+   uint64_t to_us = UINT64_MAX;
+};
+
+bool matches(const Query &q, const JournalRecord &rec) {
+   return ((q.event == -1) || (rec.event == q.event)) &&
+          ((q.outcome == -1) || (rec.outcome == q.outcome)) &&
+          (!q.failed || (rec.outcome != jo_ok)) &&
+          ((rec.ipaddr & q.mask) == q.addr) &&
+          ((q.user_id == -1) || (rec.user_id == q.user_id)) &&
+          (rec.time_us >= q.from_us) && (rec.time_us < q.to_us);
+}
+
+int lookupName(const char *name, const char *names[], int count) {
+   for (int i = 0; i < count; i++) {
+      if (strcmp(name, names[i]) == 0)
+         return i;
+   }
+   return -1;
+}
+
+void printRecord(const JournalRecord &rec, const std::vector<std::string> &names) {
+   time_t secs = rec.time_us / 1000000;
+   struct tm local;
+   char stamp[64];
+   localtime_r(&secs, &local);
+   strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", &local);
+
+   struct in_addr addr;
+   char addr_str[INET_ADDRSTRLEN];
+   addr.s_addr = htonl(rec.ipaddr);
+   inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+
+   cout << stamp << " : IP Address: " << addr_str << " ; User: "
+        << ((rec.user_id < names.size()) ? names[rec.user_id] : "?") << "; "
+        << ((rec.event < 4) ? event_names[rec.event] : "?") << " "
+        << ((rec.outcome < 4) ? outcome_names[rec.outcome] : "?") << "\n";
+}
+
+int main(int argc, char *argv[]) {
+   std::string dir(journal_dir);
+   std::string user;
+   bool count_only = false, by_addr = false;
+   Query q;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "d:e:o:n:U:s:S:E:c")) != -1) {
+      switch (c) {
+      case 'd':
+         dir = optarg;
+         break;
+
+      case 'e':
+         if ((q.event = lookupName(optarg, event_names, 4)) < 1) {
+            cerr << "Unknown event type " << optarg << endl;
+            return -1;
+         }
+         break;
+
+      case 'o':
+         if (strcmp(optarg, "failed") == 0)
+            q.failed = true;
+         else if ((q.outcome = lookupName(optarg, outcome_names, 4)) == -1) {
+            cerr << "Unknown outcome " << optarg << endl;
+            return -1;
+         }
+         break;
+
+      case 'n': {
+         std::string prefix(optarg);
+         unsigned long len = 32;
+         size_t slash = prefix.find('/');
+         if (slash != std::string::npos) {
+            len = strtoul(prefix.c_str() + slash + 1, NULL, 10);
+            prefix.erase(slash);
+         }
+         struct in_addr addr;
+         if ((len > 32) || (inet_pton(AF_INET, prefix.c_str(), &addr) != 1)) {
+            cerr << "Invalid address " << optarg << endl;
+            return -1;
+         }
+         q.mask = (len == 0) ? 0 : (0xFFFFFFFFu << (32 - len));
+         q.addr = ntohl(addr.s_addr) & q.mask;
+         by_addr = (len > 0);
+         break;
+      }
+
+      case 'U':
+         user = optarg;
+         break;
+
+      case 's': {
+         uint64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::system_clock::now().time_since_epoch()).count();
+         q.from_us = now_us - strtoull(optarg, NULL, 10) * 1000000;
+         break;
+      }
+
+      case 'S':
+         q.from_us = strtoull(optarg, NULL, 10) * 1000000;
+         break;
+
+      case 'E':
+         q.to_us = strtoull(optarg, NULL, 10) * 1000000;
+         break;
+
+      case 'c':
+         count_only = true;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   std::vector<std::string> names;
+   if (!Journal::loadNames(dir, names)) {
+      cerr << "Could not read the journal's names in " << dir << endl;
+      return -1;
+   }
+   if (!user.empty()) {
+      auto nptr = std::find(names.begin() + 1, names.end(), user);
+      if (nptr == names.end()) {
+         if (count_only)
+            cout << "0\n";
+         return 0;
+      }
+      q.user_id = nptr - names.begin();
+   }
+
+   std::vector<std::string> segments;
+   Journal::listSegments(dir, segments);
+
+   uint64_t matched = 0, examined = 0;
+   unsigned int skipped = 0;
+   for (auto &seg_path : segments) {
+      JournalSegment seg;
+      if (!seg.openSegment(seg_path) || (seg.getCount() == 0))
+         continue;
+
+      const JournalRecord *records = seg.getRecords();
+      if ((records[0].time_us >= q.to_us) || (records[seg.getCount() - 1].time_us < q.from_us)) {
+         skipped++;
+         continue;
+      }
+
+      std::vector<uint64_t> hits;
+      if (by_addr && seg.hasIndex()) {
+         // The address index gives just this prefix's records, put back in time order
+         const JournalIdxEntry *index = seg.getIndex();
+         const JournalIdxEntry *end = index + seg.getCount();
+         const JournalIdxEntry *first = std::lower_bound(index, end, q.addr,
+                  [](const JournalIdxEntry &e, uint32_t a) { return e.ipaddr < a; });
+         for (; (first != end) && ((first->ipaddr & q.mask) == q.addr); first++) {
+            examined++;
+            if (matches(q, records[first->recno]))
+               hits.push_back(first->recno);
+         }
+         std::sort(hits.begin(), hits.end());
+      } else {
+         uint64_t recno = (q.from_us > 0) ? seg.findTime(q.from_us) : 0;
+         for (; (recno < seg.getCount()) && (records[recno].time_us < q.to_us); recno++) {
+            examined++;
+            if (matches(q, records[recno]))
+               hits.push_back(recno);
+         }
+      }
+
+      matched += hits.size();
+      if (!count_only) {
+         for (uint64_t recno : hits)
+            printRecord(records[recno], names);
+      }
+   }
+
+   if (count_only)
+      cout << matched << "\n";
+   cerr << segments.size() << " segments (" << skipped << " skipped by time), " << examined
+        << " records examined, " << matched << " matched\n";
+   return 0;
+}
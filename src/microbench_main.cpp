@@ -0,0 +1,602 @@
+/****************************************************************************************
+ * microbench - times the server's hot functions: FileDesc reads and writes over a
+ *              socketpair, the strfuncts helpers, username lookups in text and binary
+ *              password files of several sizes, whitelist lookups at several sizes, queueing
+ *              a log event, and an Argon2 hash. Each benchmark is run until it has taken long
+ *              enough to time, five times, and the median ns per operation is reported.
+ *
+ *              Results can be written as tab separated "name ns_per_op iterations" lines
+ *              and compared against an earlier results file; any benchmark slower than the
+ *              baseline by more than the threshold makes it exit with status 1. make bench
+ *              runs it this way.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <getopt.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "FileDesc.h"
+#include "LineBuffer.h"
+#include "strfuncts.h"
+#include "PasswdMgr.h"
+#include "PasswdStore.h"
+#include "Whitelist.h"
+#include "Logger.h"
+#include "exceptions.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-o <results>] [-b <baseline>] [-t <pct>] [-f <filter>] [-u <sizes>] [-q] [-k]\n";
+   std::cout << "   o: write the results to this file, tab separated\n";
+   std::cout << "   b: compare against an earlier results file, exit 1 on any regression\n";
+   std::cout << "   t: percent slower than the baseline that counts as a regression (default 10)\n";
+   std::cout << "   f: only run benchmarks whose name contains this\n";
+   std::cout << "   u: comma-separated password file sizes in users (default 1000,100000,1000000)\n";
+   std::cout << "   q: quick run, timing each benchmark for less time (noisier)\n";
+   std::cout << "   k: keep the scratch directory with the generated files\n";
+}
+
+// How many times each benchmark is timed, the median is reported
+const int bench_reps = 5;
+
+struct BenchResult {
+   std::string name;
+   double ns_per_op;
+   uint64_t iters;
+};
+
+// Runs iters operations and returns how many ns they took (excluding any setup it skips)
+typedef std::function<uint64_t(uint64_t iters)> BenchBody;
+
+// Keeps the compiler from optimizing away results nobody reads
+static volatile uint64_t sink;
+
+static uint64_t getNow() {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*****************************************************************************************
+ * Bench - runs and records the benchmarks
+ *****************************************************************************************/
+
+class Bench {
+public:
+   Bench(const std::string &filter, uint64_t rep_ns):_filter(filter), _rep_ns(rep_ns) { };
+
+   bool wants(const std::string &name) {
+      return _filter.empty() || (name.find(_filter) != std::string::npos);
+   };
+
+   void run(const std::string &name, BenchBody body, double time_scale = 1.0);
+
+   std::vector<BenchResult> results;
+
+private:
+   std::string _filter;
+   uint64_t _rep_ns;
+};
+
+/*****************************************************************************************
+ * run - grows the iteration count until one rep takes long enough, then times bench_reps
+ *       reps and records the median
+ *
+ *    Params:  time_scale - multiplies the time per rep, for benchmarks whose setup between
+ *                          timed sections makes a full rep too slow
+ *****************************************************************************************/
+
+void Bench::run(const std::string &name, BenchBody body, double time_scale) {
+   if (!wants(name))
+      return;
+
+   uint64_t target = (uint64_t) (_rep_ns * time_scale);
+   uint64_t iters = 1;
+   uint64_t took = body(iters);
+   while (took < target) {
+      uint64_t grow = (took == 0) ? 100 : std::min((uint64_t) 100, target * 12 / (took * 10) + 1);
+      iters *= std::max((uint64_t) 2, grow);
+      took = body(iters);
+   }
+
+   std::vector<double> per_op;
+   for (int r = 0; r < bench_reps; r++)
+      per_op.push_back((double) body(iters) / iters);
+   std::sort(per_op.begin(), per_op.end());
+
+   BenchResult result{name, per_op[bench_reps / 2], iters};
+   results.push_back(result);
+   cout << left << setw(36) << name << right << fixed << setprecision(1) << setw(14)
+        << result.ns_per_op << " ns/op" << endl;
+}
+
+/*****************************************************************************************
+ * benchFileDesc - reads and writes of a 64 byte line over a socketpair. Each operation also
+ *                 does the plain read or write on the other end that keeps the pair moving.
+ *****************************************************************************************/
+
+void benchFileDesc(Bench &bench) {
+   int fds[2];
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+      throw socket_error("socketpair failed.");
+   SocketFD a, b;
+   a.attachFD(fds[0]);
+   b.attachFD(fds[1]);
+
+   std::string line(63, 'x');
+   line += '\n';
+   char drain[4096];
+
+   bench.run("fd/writeFD_64", [&](uint64_t iters) {
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         a.writeFD(line);
+         sink += read(b.getFD(), drain, sizeof(drain));
+      }
+      return getNow() - start;
+   });
+
+   std::string buf;
+   bench.run("fd/readFD_64", [&](uint64_t iters) {
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         sink += write(a.getFD(), line.data(), line.size());
+         b.readFD(buf);
+      }
+      return getNow() - start;
+   });
+
+   bench.run("fd/readStr_64", [&](uint64_t iters) {
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         sink += write(a.getFD(), line.data(), line.size());
+         b.readStr(buf);
+      }
+      return getNow() - start;
+   });
+
+   bench.run("fd/LineBuffer_64", [&](uint64_t iters) {
+      LineBuffer lines;
+      std::string_view view;
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         sink += write(a.getFD(), line.data(), line.size());
+         lines.fill(b);
+         lines.getLine(view);
+      }
+      return getNow() - start;
+   });
+}
+
+/*****************************************************************************************
+ * benchStrfuncts - the helpers run on every line of input
+ *****************************************************************************************/
+
+void benchStrfuncts(Bench &bench) {
+   const std::string input("Hello There Menu Choice\r\n");
+   const std::string pair("username:password1234");
+
+   bench.run("str/clrNewlines", [&](uint64_t iters) {
+      std::string s;
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         s = input;
+         clrNewlines(s);
+         sink += s.size();
+      }
+      return getNow() - start;
+   });
+
+   bench.run("str/split", [&](uint64_t iters) {
+      std::string s, left, right;
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         s = pair;
+         split(s, left, right, ':');
+         sink += left.size() + right.size();
+      }
+      return getNow() - start;
+   });
+
+   bench.run("str/lower", [&](uint64_t iters) {
+      std::string s;
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++) {
+         s = input;
+         lower(s);
+         sink += s[0];
+      }
+      return getNow() - start;
+   });
+}
+
+/*****************************************************************************************
+ * makeUsers - num_users entries named user0000000... with fixed printable hashes and salts
+ *****************************************************************************************/
+
+void makeUsers(unsigned long num_users, std::vector<std::pair<std::string, PasswdEntry>> &users) {
+   users.clear();
+   users.reserve(num_users);
+   char name[32];
+   for (unsigned long u = 0; u < num_users; u++) {
+      snprintf(name, sizeof(name), "user%07lu", u);
+      PasswdEntry entry;
+      for (int i = 0; i < hashlen; i++)
+         entry.hash[i] = 'a' + (u + i) % 26;
+      for (int i = 0; i < saltlen; i++)
+         entry.salt[i] = 'A' + (u + i) % 26;
+      entry.offset = 0;
+      users.push_back(std::make_pair(std::string(name), entry));
+   }
+}
+
+/*****************************************************************************************
+ * writeTextPasswd - writes users in the text password file format (name line, then the
+ *                   hash and salt line)
+ *****************************************************************************************/
+
+void writeTextPasswd(const std::string &filename,
+                     const std::vector<std::pair<std::string, PasswdEntry>> &users) {
+   FILE *out = fopen(filename.c_str(), "w");
+   if (out == NULL)
+      throw pwfile_error("Could not write " + filename);
+
+   for (auto &user : users) {
+      fprintf(out, "%s\n", user.first.c_str());
+      fwrite(user.second.hash, 1, hashlen, out);
+      fwrite(user.second.salt, 1, saltlen, out);
+      fputc('\n', out);
+   }
+   fclose(out);
+}
+
+/*****************************************************************************************
+ * benchPasswd - PasswdMgr::checkUser hits and misses in text and binary store password
+ *               files of each size. The first lookup, which loads the index or maps the
+ *               store, is not timed.
+ *****************************************************************************************/
+
+void benchPasswd(Bench &bench, const std::vector<unsigned long> &sizes) {
+   std::vector<std::pair<std::string, PasswdEntry>> users;
+
+   for (unsigned long size : sizes) {
+      std::string label = (size % 1000000 == 0) ? std::to_string(size / 1000000) + "M" :
+                          (size % 1000 == 0) ? std::to_string(size / 1000) + "k" :
+                          std::to_string(size);
+      std::string text_file = "passwd." + label;
+      std::string store_file = "passwd." + label + ".store";
+
+      bool want_text = bench.wants("passwd/text_" + label);
+      bool want_store = bench.wants("passwd/store_" + label);
+      if (!want_text && !want_store)
+         continue;
+
+      makeUsers(size, users);
+      if (want_text)
+         writeTextPasswd(text_file, users);
+      if (want_store)
+         PasswdStore::create(store_file, users, size * 2);
+
+      // Look users up in a scattered order, so the cache sees what a real login mix would
+      std::vector<std::string> hits;
+      for (unsigned long i = 0; i < 4096; i++)
+         hits.push_back(users[(i * 2654435761UL) % size].first);
+      users.clear();
+
+      for (int f = 0; f < 2; f++) {
+         if ((f == 0) ? !want_text : !want_store)
+            continue;
+         std::string filename = (f == 0) ? text_file : store_file;
+         std::string prefix = std::string("passwd/") + ((f == 0) ? "text_" : "store_") + label;
+         PasswdMgr pwm(filename.c_str());
+         sink += pwm.checkUser(hits[0].c_str());
+
+         bench.run(prefix + "/checkUser_hit", [&](uint64_t iters) {
+            uint64_t start = getNow();
+            for (uint64_t i = 0; i < iters; i++)
+               sink += pwm.checkUser(hits[i & 4095].c_str());
+            return getNow() - start;
+         });
+
+         bench.run(prefix + "/checkUser_miss", [&](uint64_t iters) {
+            uint64_t start = getNow();
+            for (uint64_t i = 0; i < iters; i++)
+               sink += pwm.checkUser("nosuchuser");
+            return getNow() - start;
+         });
+      }
+   }
+}
+
+/*****************************************************************************************
+ * benchWhitelist - Whitelist::isAllowed against whitelists of random prefixes of each size,
+ *                  for a mix of addresses inside and outside them
+ *****************************************************************************************/
+
+void benchWhitelist(Bench &bench) {
+   const unsigned long sizes[] = {10, 1000, 100000};
+
+   for (unsigned long size : sizes) {
+      std::string label = (size % 1000 == 0) ? std::to_string(size / 1000) + "k" :
+                          std::to_string(size);
+      std::string name = "whitelist/isAllowed_" + label;
+      if (!bench.wants(name))
+         continue;
+
+      std::string filename = "whitelist." + label;
+      std::ofstream out(filename);
+      std::vector<unsigned long> addrs;
+      uint32_t rng = 2463534242U;
+      for (unsigned long p = 0; p < size; p++) {
+         rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+         int len = 16 + rng % 17;
+         uint32_t addr = rng & (len == 32 ? 0xffffffffU : ~(0xffffffffU >> len));
+         struct in_addr in;
+         in.s_addr = htonl(addr);
+         out << inet_ntoa(in) << "/" << len << "\n";
+         if (addrs.size() < 2048)
+            addrs.push_back(htonl(addr));
+      }
+      out.close();
+      while (addrs.size() < 4096) {
+         rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+         addrs.push_back(rng);
+      }
+
+      Whitelist whitelist(filename.c_str());
+      std::string results;
+      whitelist.reload(results);
+
+      bench.run(name, [&](uint64_t iters) {
+         uint64_t start = getNow();
+         for (uint64_t i = 0; i < iters; i++)
+            sink += whitelist.isAllowed(addrs[i & 4095]);
+         return getNow() - start;
+      });
+   }
+}
+
+/*****************************************************************************************
+ * benchLog - queueing one event with Logger::log. Events are logged in batches that fit the
+ *            ring, waiting (untimed) for the flusher between them, so drops aren't timed.
+ *****************************************************************************************/
+
+void benchLog(Bench &bench) {
+   if (!bench.wants("log/logEvent"))
+      return;
+
+   const char event[] = "Login successful for user user0000042 from 127.0.0.1 on socket 17.";
+   const uint64_t batch = log_ring_slots / 2;
+
+   bench.run("log/logEvent", [&](uint64_t iters) {
+      uint64_t took = 0;
+      for (uint64_t done = 0; done < iters; done += batch) {
+         uint64_t count = std::min(batch, iters - done);
+         uint64_t start = getNow();
+         for (uint64_t i = 0; i < count; i++)
+            Logger::getLogger().log(event, sizeof(event) - 1);
+         took += getNow() - start;
+         std::this_thread::sleep_for(std::chrono::milliseconds(log_flush_ms * 2));
+      }
+      return took;
+   }, 0.1);
+}
+
+/*****************************************************************************************
+ * benchArgon2 - one hashArgon2 with the server's cost parameters
+ *****************************************************************************************/
+
+void benchArgon2(Bench &bench) {
+   PasswdMgr pwm("passwd.1k");
+   std::vector<uint8_t> salt(saltlen, 'a');
+
+   bench.run("argon2/hashArgon2", [&](uint64_t iters) {
+      std::vector<uint8_t> hash, ret_salt;
+      uint64_t start = getNow();
+      for (uint64_t i = 0; i < iters; i++)
+         pwm.hashArgon2(hash, ret_salt, "benchmarkpassword", &salt);
+      return getNow() - start;
+   });
+}
+
+/*****************************************************************************************
+ * loadResults - reads a results file into name -> ns per op
+ *
+ *    Returns: false if it could not be read
+ *****************************************************************************************/
+
+bool loadResults(const char *filename, std::map<std::string, double> &results) {
+   std::ifstream in(filename);
+   if (!in)
+      return false;
+
+   std::string line;
+   while (std::getline(in, line)) {
+      if (line.empty() || (line[0] == '#'))
+         continue;
+      std::stringstream fields(line);
+      std::string name;
+      double ns_per_op;
+      if (fields >> name >> ns_per_op)
+         results[name] = ns_per_op;
+   }
+   return true;
+}
+
+bool writeResults(const char *filename, const std::vector<BenchResult> &results) {
+   std::ofstream out(filename);
+   if (!out)
+      return false;
+
+   out << "# name\tns_per_op\titerations\n";
+   for (const BenchResult &r : results)
+      out << r.name << "\t" << fixed << setprecision(2) << r.ns_per_op << "\t" << r.iters << "\n";
+   return out.good();
+}
+
+/*****************************************************************************************
+ * compareResults - prints each result against the baseline
+ *
+ *    Returns: the number of regressions beyond threshold percent
+ *****************************************************************************************/
+
+int compareResults(const std::vector<BenchResult> &results,
+                   const std::map<std::string, double> &baseline, double threshold) {
+   int regressions = 0;
+
+   cout << "\n" << left << setw(36) << "vs baseline" << right << setw(14) << "baseline"
+        << setw(14) << "now" << setw(10) << "change" << "\n";
+   for (const BenchResult &r : results) {
+      auto base = baseline.find(r.name);
+      if ((base == baseline.end()) || (base->second <= 0)) {
+         cout << left << setw(36) << r.name << right << setw(14) << "-" << setw(14)
+              << r.ns_per_op << "\n";
+         continue;
+      }
+
+      double change = (r.ns_per_op / base->second - 1.0) * 100.0;
+      bool regressed = (change > threshold);
+      if (regressed)
+         regressions++;
+      cout << left << setw(36) << r.name << right << fixed << setprecision(1) << setw(14)
+           << base->second << setw(14) << r.ns_per_op << setw(9) << showpos << change << "%"
+           << noshowpos << (regressed ? "  REGRESSION" : "") << "\n";
+   }
+   return regressions;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+   return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+   std::string results_file, baseline_file, filter;
+   std::string sizes_str("1000,100000,1000000");
+   double threshold = 10.0;
+   bool quick = false;
+   bool keep = false;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "o:b:t:f:u:qk")) != -1) {
+      switch (c) {
+      case 'o':
+         results_file = optarg;
+         break;
+
+      case 'b':
+         baseline_file = optarg;
+         break;
+
+      case 't':
+         threshold = strtod(optarg, NULL);
+         break;
+
+      case 'f':
+         filter = optarg;
+         break;
+
+      case 'u':
+         sizes_str = optarg;
+         break;
+
+      case 'q':
+         quick = true;
+         break;
+
+      case 'k':
+         keep = true;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   std::vector<unsigned long> sizes;
+   std::stringstream sizestream(sizes_str);
+   std::string size;
+   while (std::getline(sizestream, size, ','))
+      if (strtoul(size.c_str(), NULL, 10) > 0)
+         sizes.push_back(strtoul(size.c_str(), NULL, 10));
+
+   std::map<std::string, double> baseline;
+   if (!baseline_file.empty() && !loadResults(baseline_file.c_str(), baseline)) {
+      cerr << "Could not read baseline " << baseline_file << ".\n";
+      return -1;
+   }
+
+   // Resolve output paths before moving into the scratch directory
+   char cwd[4096];
+   if (getcwd(cwd, sizeof(cwd)) == NULL) {
+      perror("getcwd");
+      return -1;
+   }
+   if (!results_file.empty() && (results_file[0] != '/'))
+      results_file = std::string(cwd) + "/" + results_file;
+
+   // The password files, whitelists and log all go in a scratch directory
+   char scratch[] = "/tmp/microbench.XXXXXX";
+   if ((mkdtemp(scratch) == NULL) || (chdir(scratch) != 0)) {
+      perror("scratch directory");
+      return -1;
+   }
+
+   Bench bench(filter, quick ? 20000000 : 200000000);
+   try {
+      benchFileDesc(bench);
+      benchStrfuncts(bench);
+      benchPasswd(bench, sizes);
+      benchWhitelist(bench);
+      benchLog(bench);
+      benchArgon2(bench);
+   } catch (std::runtime_error &e) {
+      cerr << "Benchmark failed: " << e.what() << endl;
+      return -1;
+   }
+   Logger::getLogger().stop();
+
+   if (chdir(cwd) == 0) {
+      if (keep)
+         cout << "Scratch files kept in " << scratch << "\n";
+      else
+         nftw(scratch, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+   }
+
+   if (!results_file.empty()) {
+      if (!writeResults(results_file.c_str(), bench.results)) {
+         cerr << "Could not write results to " << results_file << ".\n";
+         return -1;
+      }
+      cout << "Results written to " << results_file << "\n";
+   }
+
+   if (!baseline_file.empty()) {
+      int regressions = compareResults(bench.results, baseline, threshold);
+      if (regressions > 0) {
+         cout << regressions << " benchmark(s) regressed more than " << threshold << "%.\n";
+         return 1;
+      }
+      cout << "No regressions over " << threshold << "%.\n";
+   }
+
+   return 0;
+}
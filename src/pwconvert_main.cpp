@@ -0,0 +1,87 @@
+/****************************************************************************************
+ * pwconvert - converts a text password file into the binary, memory-mapped PasswdStore
+ *             format, or rebuilds an existing store with a larger capacity. The output is
+ *             renamed into place, so it can be run on the live file (a server that was
+ *             using the text format needs a restart to pick up the store).
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <vector>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "PasswdIndex.h"
+#include "PasswdStore.h"
+#include "exceptions.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-c <capacity>] <input_file> <output_file>\n";
+   std::cout << "   c: total users the store can hold before it must be rebuilt\n";
+   std::cout << "      (default twice the current users, at least 1024)\n";
+   std::cout << "   input_file may be a text passwd file or an existing store, and may be\n";
+   std::cout << "   the same as output_file\n";
+}
+
+int main(int argc, char *argv[]) {
+   unsigned long long capacity = 0;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "c:")) != -1) {
+      switch (c) {
+      case 'c':
+         capacity = strtoull(optarg, NULL, 10);
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   if (argc - optind != 2) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   std::string in_file(argv[optind]), out_file(argv[optind + 1]);
+
+   // Servers lock the input while they change it, so holding the lock until the new store is
+   // renamed into place means no change lands in the old file after its users were read
+   int lock_fd = open(in_file.c_str(), O_RDONLY | O_CLOEXEC);
+   if ((lock_fd != -1) && (flock(lock_fd, LOCK_EX) != 0)) {
+      cerr << "Could not lock " << in_file << endl;
+      return -1;
+   }
+
+   try {
+      std::vector<std::pair<std::string, PasswdEntry>> users;
+      PasswdStore *store = PasswdStore::getStore(in_file);
+      if (store != NULL)
+         store->getAll(users);
+      else
+         PasswdIndex::getIndex(in_file).getAll(users);
+
+      if (capacity == 0)
+         capacity = std::max((size_t) 1024, users.size() * 2);
+      if (capacity < users.size()) {
+         cerr << "Capacity is less than the " << users.size() << " users in " << in_file << endl;
+         return -1;
+      }
+
+      PasswdStore::create(out_file, users, capacity);
+      cout << "Wrote " << users.size() << " users to " << out_file << " (capacity "
+           << capacity << ")\n";
+   } catch (pwfile_error &e) {
+      cerr << "Conversion failed: " << e.what() << endl;
+      return -1;
+   }
+
+   if (lock_fd != -1)
+      close(lock_fd);
+   return 0;
+}
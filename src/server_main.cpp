@@ -11,13 +11,30 @@
 #include <getopt.h>
 #include "TCPServer.h"
 #include "exceptions.h"
+#include "Profiler.h"
 
 using namespace std; 
 
 void displayHelp(const char *execname) {
-   std::cout << execname << " [-p <portnum>] [-a <ip_addr>]\n";
+   std::cout << execname << " [-p <portnum>] [-a <ip_addr>] [-t <threads>] [-c] [-u] [-k <workers>]\n";
+   std::cout << "      [-m <MiB>] [-q <queue_len>] [-d <deadline_ms>] [-f] [-j] [-l <ms>] [-B]\n";
+   std::cout << "      [--profile]\n";
    std::cout << "   p: the port to bind the server to\n";
    std::cout << "   a: the IP address to bind the server\n";
+   std::cout << "   t: number of reactor threads, each with its own listening socket (default 1)\n";
+   std::cout << "   c: pin each reactor thread to its own CPU\n";
+   std::cout << "   u: use the io_uring I/O backend (falls back to epoll if unavailable)\n";
+   std::cout << "   k: number of password hashing threads (default one per CPU)\n";
+   std::cout << "   m: memory budget for password hashing in MiB. It only caps the number of hashing\n";
+   std::cout << "      threads, at one per 64 MiB (default no limit)\n";
+   std::cout << "   q: logins allowed to wait for a hashing thread before new ones are shed (default 256)\n";
+   std::cout << "   d: milliseconds a login may wait for a hashing thread (default 5000)\n";
+   std::cout << "   f: also enforce the whitelist in the kernel with a BPF socket filter\n";
+   std::cout << "   j: journal connections and logins in binary to journal/ (query with logq)\n";
+   std::cout << "   l: log reactor loop iterations slower than this many ms, 0 to disable (default 50)\n";
+   std::cout << "   B: capture a backtrace of stalled reactor threads (see tcpstat -s)\n";
+   std::cout << "   profile: count cycles, instructions, cache misses and context switches in each\n";
+   std::cout << "            session phase, and print them by phase on shutdown (SIGINT/SIGTERM)\n";
 
 }
 
@@ -30,11 +47,24 @@ int main(int argc, char *argv[]) {
 
    unsigned short port = default_port;
    std::string ip_addr(default_IP);
+   long num_threads = 1;
+   bool pin_cpus = false;
+   io_backend_type backend = epoll_backend;
+   long hash_workers = 0;
+   long hash_mem_mb = 0;
+   long hash_queue_len = 256;
+   long hash_deadline_ms = 5000;
+   bool kernel_filter = false;
+   bool journal = false;
+   long slow_ms = watchdog_default_ms;
+   bool backtraces = false;
+   bool profile = false;
 
    // Get the command line arguments and set params appropriately
    int c = 0;
    long portval;
-   while ((c = getopt(argc, argv, "p:a:smw")) != -1) {
+   const struct option long_options[] = {{"profile", no_argument, NULL, 'P'}, {NULL, 0, NULL, 0}};
+   while ((c = getopt_long(argc, argv, "p:a:t:cuk:m:q:d:fjl:B", long_options, NULL)) != -1) {
       switch (c) {
   
       // Set the max number to count up to	    
@@ -53,6 +83,81 @@ int main(int argc, char *argv[]) {
          ip_addr = optarg; 
          break;
 
+      // Number of reactor threads
+      case 't':
+         num_threads = strtol(optarg, NULL, 10);
+         if (num_threads < 1) {
+            std::cout << "Invalid thread count. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case 'c':
+         pin_cpus = true;
+         break;
+
+      case 'u':
+         backend = uring_backend;
+         break;
+
+      // Number of password hashing threads
+      case 'k':
+         hash_workers = strtol(optarg, NULL, 10);
+         if (hash_workers < 1) {
+            std::cout << "Invalid hash worker count. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      // Hashing admission control
+      case 'm':
+         hash_mem_mb = strtol(optarg, NULL, 10);
+         if (hash_mem_mb < 1) {
+            std::cout << "Invalid memory budget. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case 'q':
+         hash_queue_len = strtol(optarg, NULL, 10);
+         if (hash_queue_len < 0) {
+            std::cout << "Invalid queue length. Value must be at least 0\n";
+            exit(0);
+         }
+         break;
+
+      case 'd':
+         hash_deadline_ms = strtol(optarg, NULL, 10);
+         if (hash_deadline_ms < 1) {
+            std::cout << "Invalid deadline. Value must be at least 1\n";
+            exit(0);
+         }
+         break;
+
+      case 'f':
+         kernel_filter = true;
+         break;
+
+      case 'j':
+         journal = true;
+         break;
+
+      case 'l':
+         slow_ms = strtol(optarg, NULL, 10);
+         if (slow_ms < 0) {
+            std::cout << "Invalid slow iteration threshold. Value must be at least 0\n";
+            exit(0);
+         }
+         break;
+
+      case 'B':
+         backtraces = true;
+         break;
+
+      case 'P':
+         profile = true;
+         break;
+
       case '?':
 	      displayHelp(argv[0]);
 	      break;
@@ -65,8 +170,20 @@ int main(int argc, char *argv[]) {
 
    }
 
+   // Before the server starts any threads
+   if (profile)
+      Profiler::enable();
+
    // Try to set up the server for listening
    TCPServer server;
+   server.setThreads((unsigned int) num_threads, pin_cpus);
+   server.setIOBackend(backend);
+   server.setHashWorkers((unsigned int) hash_workers);
+   server.setHashLimits((size_t) hash_mem_mb * 1024 * 1024, (unsigned int) hash_queue_len,
+                        (unsigned int) hash_deadline_ms);
+   server.setKernelFilter(kernel_filter);
+   server.setJournal(journal);
+   server.setWatchdog((unsigned int) slow_ms, backtraces);
    try {
       cout << "Binding server to " << ip_addr << " port " << port << endl;
       server.bindSvr(ip_addr.c_str(), port);
@@ -75,6 +192,9 @@ int main(int argc, char *argv[]) {
    {
       cerr << "Server initialization failed: " << e.what() << endl;
       return -1;
+   } catch (socket_error &e) {
+      cerr << "Server initialization failed: " << e.what() << endl;
+      return -1;
    }	   
 
    cout << "Server established.\n";
@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <termios.h>
+#include <cstring>
+#include <strings.h>
 #include "strfuncts.h"
 
 /*******************************************************************************************
@@ -38,6 +40,17 @@ void lower(std::string &str) {
          [](unsigned char c){ return std::tolower(c); });
 }
 
+/*******************************************************************************************
+ * matchLower - compares str against an all-lowercase word without copying or lowering str
+ *
+ *    Returns: true if str is word in any case
+ *******************************************************************************************/
+
+bool matchLower(std::string_view str, const char *word) {
+   size_t len = strlen(word);
+   return (str.size() == len) && (strncasecmp(str.data(), word, len) == 0);
+}
+
 /*******************************************************************************************
  * hideInput - turns on/off the fd's local echo (normally fd=stdin)
  *
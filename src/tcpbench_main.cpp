@@ -0,0 +1,761 @@
+/****************************************************************************************
+ * tcpbench - load generator for capacity planning tcpserver. One thread drives thousands of
+ *            concurrent sessions from an epoll loop: each connects, logs in with credentials
+ *            from a file, then sends a weighted mix of hello, menu, 1-5 and passwd commands.
+ *            Sessions either send their next command as soon as the last reply arrives (closed
+ *            loop, with optional think time) or follow a fixed schedule that adds up to a total
+ *            rate regardless of how fast the server answers (open loop).
+ *
+ *            Latency is measured from when each command was due, not when it was actually
+ *            sent, so time spent waiting behind a slow reply (open loop) or a busy generator
+ *            is counted rather than omitted (coordinated omission). Only open loop keeps
+ *            offering load while the server stalls, so use -r for capacity numbers.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <cstring>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "FileDesc.h"
+#include "Metrics.h"
+#include "exceptions.h"
+
+using namespace std;
+
+const char default_mix[] = "hello:40,menu:10,1:10,2:10,3:10,4:10,5:10";
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-a <ip_addr>] [-p <portnum>] (-f <credfile> | -u <username> -w <password>)\n";
+   std::cout << "      [-c <sessions>] [-i <idle>] [-m <mix>] [-r <rate>] [-t <think_ms>] [-d <secs>]\n";
+   std::cout << "   a: the IP address of the server (default 127.0.0.1)\n";
+   std::cout << "   p: the port of the server (default 9999)\n";
+   std::cout << "   f: file of existing accounts, one \"username password\" per line, used in turn\n";
+   std::cout << "   u/w: credentials of one existing account for every session\n";
+   std::cout << "   c: number of sessions that log in and send commands (default 100)\n";
+   std::cout << "   i: extra sessions left idle at the Username prompt (default 0)\n";
+   std::cout << "   m: command mix as name:weight pairs (default " << default_mix << ")\n";
+   std::cout << "      passwd sets the account's password to the same one, so it stays valid\n";
+   std::cout << "   r: open loop, total commands per second across all sessions (default 0, closed loop)\n";
+   std::cout << "   t: closed loop think time between a reply and the next command in ms (default 0)\n";
+   std::cout << "   d: seconds to send commands for, once every session has logged in (default 10)\n";
+}
+
+const char menu_end[] = "Exit : disconnect.\n************************************\n";
+
+// How long to wait before resending a password the server was too busy to check
+const uint64_t retry_ns = 10000000;
+
+// How long to wait for replies to commands still in flight when the run ends
+const uint64_t drain_ns = 5000000000ULL;
+
+// Commands sent this long after they were due count as late
+const uint64_t late_ns = 1000000;
+
+enum bench_phase { bp_connect, bp_login, bp_hello, bp_menu, bp_1, bp_2, bp_3, bp_4, bp_5, bp_passwd,
+                   bp_num_phases };
+
+const char *phase_names[bp_num_phases] = {"connect", "login", "hello", "menu", "1", "2", "3", "4",
+                                          "5", "passwd"};
+
+// Each command and the text the server's reply to it ends with
+struct BenchCommand {
+   const char *name;
+   bench_phase phase;
+   const char *reply_end;
+};
+
+const BenchCommand commands[] = {
+   {"hello", bp_hello, "Hello back!\n"},
+   {"menu", bp_menu, menu_end},
+   {"1", bp_1, "Simula67 Programming language.\n"},
+   {"2", bp_2, "without showing any error message.\n"},
+   {"3", bp_3, "at T bell laboratories.\n"},
+   {"4", bp_4, "Algol 68 programming language.\n"},
+   {"5", bp_5, "for a C++ program to run.\n"},
+   {"passwd", bp_passwd, "New Password: \n"},
+};
+const unsigned int num_commands = sizeof(commands) / sizeof(commands[0]);
+
+enum session_state { ss_connecting, ss_prompt, ss_username, ss_password, ss_retry, ss_ready,
+                     ss_waiting, ss_command, ss_newpass, ss_confirmpass, ss_idle, ss_failed };
+
+enum fail_reason { fr_connect, fr_unknown_user, fr_bad_password, fr_closed, fr_write,
+                   fr_num_reasons };
+
+const char *fail_names[fr_num_reasons] = {"connect failed", "unknown user", "wrong password",
+                                          "closed by server", "write failed"};
+
+struct Credential {
+   std::string user;
+   std::string passwd;
+};
+
+struct Session {
+   SocketFD sock;
+   session_state state = ss_connecting;
+   const Credential *cred = NULL;
+   const BenchCommand *cmd = NULL;
+   std::string inbuf;
+   uint64_t start_ns = 0;        // when the phase being timed began (or was due)
+   uint64_t next_due = 0;        // when the next command is due
+};
+
+struct PhaseStats {
+   std::vector<uint64_t> counts;
+   uint64_t total = 0;
+   uint64_t max = 0;
+
+   PhaseStats():counts(metrics_hist_buckets, 0) { };
+
+   void record(uint64_t ns) {
+      counts[Metrics::getBucket(ns)]++;
+      total++;
+      if (ns > max)
+         max = ns;
+   };
+};
+
+static uint64_t getNow() {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static bool endsWith(const std::string &buf, const char *text) {
+   size_t len = strlen(text);
+   return (buf.size() >= len) && (buf.compare(buf.size() - len, len, text) == 0);
+}
+
+/*****************************************************************************************
+ * LoadGen - the sessions, their schedule and the results
+ *****************************************************************************************/
+
+class LoadGen {
+public:
+   LoadGen(const std::string &ip_addr, unsigned short port, const std::vector<Credential> &creds,
+           const std::vector<unsigned int> &mix, int num_sessions, int num_idle, double rate,
+           double think_ms, double secs);
+
+   void run();
+   void report();
+
+private:
+   void startSession(int index, session_state state);
+   void handleEvent(int index, uint32_t events);
+   void handleReply(int index);
+   void finishCommand(Session &s);
+   void scheduleNext(int index);
+   void sendCommand(Session &s);
+   void sendLine(Session &s, const std::string &line);
+   void failSession(Session &s, fail_reason reason);
+   void startRunning();
+   void runTimers();
+   uint64_t pickCommand();
+
+   std::string _ip_addr;
+   unsigned short _port;
+   const std::vector<Credential> &_creds;
+   std::vector<unsigned int> _mix_total;     // running totals of the mix weights
+   int _num_sessions;
+   int _num_idle;
+   double _rate;
+   uint64_t _think_ns;
+   uint64_t _interval_ns = 0;                // open loop, between one session's commands
+   uint64_t _duration_ns;
+
+   std::vector<std::unique_ptr<Session>> _sessions;
+   std::vector<int> _fd_index;
+   EpollFD _epollfd;
+   TimerFD _timer;
+   uint64_t _timer_at = 0;
+
+   // Sessions waiting for a command to come due or to retry their password
+   typedef std::pair<uint64_t, int> TimerEntry;
+   std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> _timers;
+
+   bool _running = false;
+   bool _stopping = false;
+   uint64_t _start_ns = 0;
+   uint64_t _t0 = 0;
+   uint64_t _t_end = 0;
+   uint64_t _rng;
+
+   int _logged_in = 0;
+   int _settled = 0;                         // logged in or failed
+   int _outstanding = 0;                     // commands sent and not yet answered
+   uint64_t _completed = 0;                  // commands answered before the run ended
+   uint64_t _late = 0;
+   uint64_t _login_retries = 0;
+   uint64_t _passwd_busy = 0;
+   uint64_t _failures[fr_num_reasons] = {0};
+   PhaseStats _stats[bp_num_phases];
+};
+
+LoadGen::LoadGen(const std::string &ip_addr, unsigned short port,
+                 const std::vector<Credential> &creds, const std::vector<unsigned int> &mix,
+                 int num_sessions, int num_idle, double rate, double think_ms, double secs):
+                 _ip_addr(ip_addr), _port(port), _creds(creds), _num_sessions(num_sessions),
+                 _num_idle(num_idle), _rate(rate), _epollfd(1024) {
+   unsigned int total = 0;
+   for (unsigned int weight : mix) {
+      total += weight;
+      _mix_total.push_back(total);
+   }
+
+   _think_ns = (uint64_t) (think_ms * 1e6);
+   _duration_ns = (uint64_t) (secs * 1e9);
+   if (_rate > 0)
+      _interval_ns = (uint64_t) (num_sessions * 1e9 / _rate);
+   _rng = getNow() | 1;
+}
+
+/*****************************************************************************************
+ * run - connects every session, waits for them all to log in (or fail), then sends
+ *       commands for the duration and waits for the last replies
+ *
+ *    Throws: socket_error if the event loop fails
+ *****************************************************************************************/
+
+void LoadGen::run() {
+   _epollfd.addFD(_timer.getFD(), EPOLLIN);
+   _start_ns = getNow();
+
+   for (int i = 0; i < _num_sessions + _num_idle; i++) {
+      _sessions.emplace_back(new Session());
+      startSession(i, (i < _num_sessions) ? ss_connecting : ss_idle);
+   }
+
+   std::vector<epoll_event> events;
+   while (true) {
+      if (!_running && (_settled == _num_sessions))
+         startRunning();
+
+      uint64_t now = getNow();
+      if (_running && !_stopping && (now - _t0 >= _duration_ns)) {
+         _stopping = true;
+         _t_end = now;
+      }
+      if (_stopping && ((_outstanding == 0) || (now - _t_end >= drain_ns)))
+         break;
+      if (_running && (_logged_in == 0))
+         break;
+
+      // Wake for the next timer, or to end the run or the drain
+      uint64_t wake = _timers.empty() ? UINT64_MAX : _timers.top().first;
+      if (_running)
+         wake = std::min(wake, _stopping ? _t_end + drain_ns : _t0 + _duration_ns);
+      if (wake != _timer_at) {
+         if (wake == UINT64_MAX)
+            _timer.disarm();
+         else
+            _timer.armAt(wake);
+         _timer_at = wake;
+      }
+
+      _epollfd.waitFD(events);
+      for (epoll_event &ev : events) {
+         if (ev.data.fd == _timer.getFD()) {
+            _timer.drain();
+            _timer_at = 0;
+            continue;
+         }
+         if ((ev.data.fd < (int) _fd_index.size()) && (_fd_index[ev.data.fd] != -1))
+            handleEvent(_fd_index[ev.data.fd], ev.events);
+      }
+      runTimers();
+   }
+
+   for (auto &s : _sessions)
+      s->sock.closeFD();
+}
+
+/*****************************************************************************************
+ * startSession - starts a nonblocking connect for a session, or an idle connection
+ *****************************************************************************************/
+
+void LoadGen::startSession(int index, session_state state) {
+   Session &s = *_sessions[index];
+   s.cred = &_creds[index % _creds.size()];
+   s.state = state;
+   s.start_ns = getNow();
+
+   if (!s.sock.connectTo(_ip_addr.c_str(), _port, true)) {
+      failSession(s, fr_connect);
+      return;
+   }
+
+   int fd = s.sock.getFD();
+   if (fd >= (int) _fd_index.size())
+      _fd_index.resize(fd + 1024, -1);
+   _fd_index[fd] = index;
+   _epollfd.addFD(fd, (state == ss_idle) ? (EPOLLIN | EPOLLRDHUP) : (EPOLLOUT | EPOLLIN | EPOLLRDHUP));
+}
+
+/*****************************************************************************************
+ * handleEvent - finishes a connect, or reads whatever the server sent and acts on it
+ *****************************************************************************************/
+
+void LoadGen::handleEvent(int index, uint32_t events) {
+   Session &s = *_sessions[index];
+
+   if (s.state == ss_connecting) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if ((getsockopt(s.sock.getFD(), SOL_SOCKET, SO_ERROR, &err, &len) == -1) || (err != 0)) {
+         failSession(s, fr_connect);
+         return;
+      }
+      _epollfd.modFD(s.sock.getFD(), EPOLLIN | EPOLLRDHUP);
+      s.state = ss_prompt;
+   }
+
+   if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+      return;
+
+   char readbuf[4096];
+   while (true) {
+      ssize_t amt = read(s.sock.getFD(), readbuf, sizeof(readbuf));
+      if (amt > 0) {
+         if (s.state != ss_idle)
+            s.inbuf.append(readbuf, amt);
+         continue;
+      }
+      if ((amt == -1) && (errno == EINTR))
+         continue;
+      if ((amt == 0) || (errno != EAGAIN)) {
+         failSession(s, fr_closed);
+         return;
+      }
+      break;
+   }
+
+   handleReply(index);
+}
+
+/*****************************************************************************************
+ * handleReply - moves a session along once the reply it is waiting for is complete
+ *****************************************************************************************/
+
+void LoadGen::handleReply(int index) {
+   Session &s = *_sessions[index];
+   uint64_t now = getNow();
+
+   switch (s.state) {
+   case ss_prompt:
+      if (endsWith(s.inbuf, "Username: ")) {
+         _stats[bp_connect].record(now - s.start_ns);
+         s.start_ns = now;
+         s.state = ss_username;
+         sendLine(s, s.cred->user);
+      }
+      break;
+
+   case ss_username:
+      if (endsWith(s.inbuf, "Password: ")) {
+         s.state = ss_password;
+         sendLine(s, s.cred->passwd);
+      } else if (endsWith(s.inbuf, "my_adduser program.\n"))
+         failSession(s, fr_unknown_user);
+      break;
+
+   case ss_password:
+      if (endsWith(s.inbuf, menu_end)) {
+         _stats[bp_login].record(now - s.start_ns);
+         _logged_in++;
+         _settled++;
+         s.state = ss_ready;
+         s.next_due = now;
+         if (_running)
+            scheduleNext(index);
+      } else if (endsWith(s.inbuf, "Password: ")) {
+         if (s.inbuf.find("busy") == std::string::npos) {
+            failSession(s, fr_bad_password);
+            break;
+         }
+         _login_retries++;
+         s.state = ss_retry;
+         _timers.push(TimerEntry(now + retry_ns, index));
+      }
+      break;
+
+   case ss_command:
+      if (!endsWith(s.inbuf, s.cmd->reply_end))
+         break;
+      if (s.cmd->phase != bp_passwd) {
+         finishCommand(s);
+         scheduleNext(index);
+         break;
+      }
+      s.state = ss_newpass;
+      sendLine(s, s.cred->passwd);
+      break;
+
+   case ss_newpass:
+      if (endsWith(s.inbuf, "Enter the password again: \n")) {
+         s.state = ss_confirmpass;
+         sendLine(s, s.cred->passwd);
+      }
+      break;
+
+   case ss_confirmpass:
+      if (endsWith(s.inbuf, "Please retry.\n"))
+         _passwd_busy++;
+      else if (!endsWith(s.inbuf, "new menu choice. \n"))
+         break;
+      finishCommand(s);
+      scheduleNext(index);
+      break;
+
+   default:
+      break;
+   }
+}
+
+/*****************************************************************************************
+ * finishCommand - records a command's latency from when it was due
+ *****************************************************************************************/
+
+void LoadGen::finishCommand(Session &s) {
+   uint64_t now = getNow();
+   _stats[s.cmd->phase].record(now - s.start_ns);
+   if (!_stopping)
+      _completed++;
+   _outstanding--;
+   s.state = ss_ready;
+
+   if (_rate <= 0)
+      s.next_due = now + _think_ns;
+}
+
+/*****************************************************************************************
+ * scheduleNext - sends a ready session's next command now if it is due, else sets a timer
+ *****************************************************************************************/
+
+void LoadGen::scheduleNext(int index) {
+   Session &s = *_sessions[index];
+   if (_stopping || (s.state != ss_ready))
+      return;
+
+   if (s.next_due <= getNow()) {
+      sendCommand(s);
+      return;
+   }
+   s.state = ss_waiting;
+   _timers.push(TimerEntry(s.next_due, index));
+}
+
+void LoadGen::sendCommand(Session &s) {
+   s.cmd = &commands[pickCommand()];
+   s.start_ns = s.next_due;
+   if (_rate > 0)
+      s.next_due += _interval_ns;
+   if (getNow() - s.start_ns > late_ns)
+      _late++;
+
+   s.state = ss_command;
+   _outstanding++;
+   sendLine(s, s.cmd->name);
+}
+
+void LoadGen::sendLine(Session &s, const std::string &line) {
+   s.inbuf.clear();
+   std::string out = line + "\n";
+   if (s.sock.writeFD(out) != (ssize_t) out.size())
+      failSession(s, fr_write);
+}
+
+/*****************************************************************************************
+ * failSession - gives up on a session, counting why
+ *****************************************************************************************/
+
+void LoadGen::failSession(Session &s, fail_reason reason) {
+   if (s.state == ss_failed)
+      return;
+
+   if ((s.state == ss_command) || (s.state == ss_newpass) || (s.state == ss_confirmpass))
+      _outstanding--;
+   if ((s.state >= ss_ready) && (s.state <= ss_confirmpass))
+      _logged_in--;
+   else if (s.state != ss_idle)
+      _settled++;
+   _failures[reason]++;
+
+   int fd = s.sock.getFD();
+   if ((fd != -1) && (fd < (int) _fd_index.size()))
+      _fd_index[fd] = -1;
+   s.sock.closeFD();
+   s.state = ss_failed;
+}
+
+/*****************************************************************************************
+ * startRunning - starts the timed run once every session has logged in or failed. Open
+ *                loop sessions are staggered evenly across one interval.
+ *****************************************************************************************/
+
+void LoadGen::startRunning() {
+   _running = true;
+   _t0 = getNow();
+
+   int n = 0;
+   for (int i = 0; i < _num_sessions; i++) {
+      Session &s = *_sessions[i];
+      if (s.state != ss_ready)
+         continue;
+      s.next_due = (_rate > 0) ? _t0 + (uint64_t) (n++ * 1e9 / _rate) : _t0;
+      scheduleNext(i);
+   }
+}
+
+/*****************************************************************************************
+ * runTimers - sends the commands that have come due and retries busy logins
+ *****************************************************************************************/
+
+void LoadGen::runTimers() {
+   uint64_t now = getNow();
+   while (!_timers.empty() && (_timers.top().first <= now)) {
+      int index = _timers.top().second;
+      _timers.pop();
+
+      Session &s = *_sessions[index];
+      if (s.state == ss_retry) {
+         s.state = ss_password;
+         sendLine(s, s.cred->passwd);
+      } else if ((s.state == ss_waiting) && !_stopping) {
+         s.state = ss_ready;
+         sendCommand(s);
+      }
+   }
+}
+
+uint64_t LoadGen::pickCommand() {
+   // xorshift64*
+   _rng ^= _rng >> 12;
+   _rng ^= _rng << 25;
+   _rng ^= _rng >> 27;
+   uint64_t pick = ((_rng * 2685821657736338717ULL) >> 32) % _mix_total.back();
+
+   unsigned int c = 0;
+   while (pick >= _mix_total[c])
+      c++;
+   return c;
+}
+
+/*****************************************************************************************
+ * report - prints the run's totals and the latency percentiles of each phase
+ *****************************************************************************************/
+
+void LoadGen::report() {
+   double secs = (_t_end > _t0) ? (_t_end - _t0) / 1e9 : 0.0;
+
+   cout << _num_sessions << " sessions (+" << _num_idle << " idle), ";
+   if (_rate > 0)
+      cout << "open loop at " << _rate << " commands/s";
+   else
+      cout << "closed loop, " << _think_ns / 1e6 << "ms think time";
+   cout << ", " << fixed << setprecision(1) << secs << "s\n";
+
+   cout << "logged in " << _logged_in << ", login retries (server busy) " << _login_retries
+        << ", passwd busy " << _passwd_busy << "\n";
+   for (int r = 0; r < fr_num_reasons; r++) {
+      if (_failures[r] != 0)
+         cout << "failed: " << fail_names[r] << " " << _failures[r] << "\n";
+   }
+
+   cout << "commands " << _completed << " (" << setprecision(1)
+        << ((secs > 0) ? _completed / secs : 0.0) << "/s), sent over "
+        << late_ns / 1000000 << "ms late " << _late << "\n";
+
+   cout << left << setw(10) << "phase" << right << setw(10) << "count" << setw(10) << "rate/s"
+        << setw(11) << "p50_us" << setw(11) << "p90_us" << setw(11) << "p99_us" << setw(11)
+        << "p999_us" << setw(11) << "max_us" << "\n";
+   for (int p = 0; p < bp_num_phases; p++) {
+      const PhaseStats &st = _stats[p];
+      if (st.total == 0)
+         continue;
+
+      cout << left << setw(10) << phase_names[p] << right << setw(10) << st.total << setw(10);
+      if ((p == bp_connect) || (p == bp_login) || (secs == 0))
+         cout << "-";
+      else
+         cout << setprecision(1) << st.total / secs;
+      cout << setprecision(1)
+           << setw(11) << Metrics::getPercentile(st.counts.data(), 50.0) / 1000.0
+           << setw(11) << Metrics::getPercentile(st.counts.data(), 90.0) / 1000.0
+           << setw(11) << Metrics::getPercentile(st.counts.data(), 99.0) / 1000.0
+           << setw(11) << Metrics::getPercentile(st.counts.data(), 99.9) / 1000.0
+           << setw(11) << st.max / 1000.0 << "\n";
+   }
+   cout << flush;
+}
+
+/*****************************************************************************************
+ * loadCredentials - reads "username password" lines, skipping blank and # lines
+ *
+ *    Returns: false if the file could not be read
+ *****************************************************************************************/
+
+bool loadCredentials(const char *filename, std::vector<Credential> &creds) {
+   std::ifstream in(filename);
+   if (!in)
+      return false;
+
+   std::string line;
+   while (std::getline(in, line)) {
+      std::stringstream fields(line);
+      Credential cred;
+      if (!(fields >> cred.user) || (cred.user[0] == '#') || !(fields >> cred.passwd))
+         continue;
+      creds.push_back(cred);
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * parseMix - turns "name:weight,..." into a weight for each of commands[]
+ *
+ *    Returns: false if a name is unknown or every weight is 0
+ *****************************************************************************************/
+
+bool parseMix(const std::string &spec, std::vector<unsigned int> &mix) {
+   mix.assign(num_commands, 0);
+
+   std::stringstream specstream(spec);
+   std::string item;
+   unsigned int total = 0;
+   while (std::getline(specstream, item, ',')) {
+      size_t colon = item.find(':');
+      std::string name = item.substr(0, colon);
+      long weight = (colon == std::string::npos) ? 1 : strtol(item.c_str() + colon + 1, NULL, 10);
+
+      unsigned int c = 0;
+      while ((c < num_commands) && (name != commands[c].name))
+         c++;
+      if ((c == num_commands) || (weight < 0))
+         return false;
+      mix[c] = weight;
+      total += weight;
+   }
+   return (total > 0);
+}
+
+int main(int argc, char *argv[]) {
+
+   std::string ip_addr("127.0.0.1");
+   unsigned short port = 9999;
+   std::string user, passwd, credfile;
+   std::string mixspec(default_mix);
+   long num_sessions = 100;
+   long num_idle = 0;
+   double rate = 0;
+   double think_ms = 0;
+   double secs = 10;
+
+   int c = 0;
+   long portval;
+   while ((c = getopt(argc, argv, "a:p:f:u:w:c:i:m:r:t:d:")) != -1) {
+      switch (c) {
+      case 'a':
+         ip_addr = optarg;
+         break;
+
+      case 'p':
+	      portval = strtol(optarg, NULL, 10);
+	      if ((portval < 1) || (portval > 65535)) {
+            std::cout << "Invalid port. Value must be between 1 and 65535\n";
+            exit(0);
+	      }
+	      port = (unsigned short) portval;
+	      break;
+
+      case 'f':
+         credfile = optarg;
+         break;
+
+      case 'u':
+         user = optarg;
+         break;
+
+      case 'w':
+         passwd = optarg;
+         break;
+
+      case 'c':
+         num_sessions = strtol(optarg, NULL, 10);
+         break;
+
+      case 'i':
+         num_idle = strtol(optarg, NULL, 10);
+         break;
+
+      case 'm':
+         mixspec = optarg;
+         break;
+
+      case 'r':
+         rate = strtod(optarg, NULL);
+         break;
+
+      case 't':
+         think_ms = strtod(optarg, NULL);
+         break;
+
+      case 'd':
+         secs = strtod(optarg, NULL);
+         break;
+
+      default:
+	      displayHelp(argv[0]);
+	      exit(0);
+      }
+   }
+
+   std::vector<Credential> creds;
+   if (!credfile.empty() && !loadCredentials(credfile.c_str(), creds)) {
+      cerr << "Could not read credentials file " << credfile << ".\n";
+      return -1;
+   }
+   if (!user.empty())
+      creds.push_back(Credential{user, passwd});
+
+   std::vector<unsigned int> mix;
+   if (creds.empty() || (num_sessions < 1) || (num_idle < 0) || (rate < 0) || (think_ms < 0) ||
+       (secs <= 0)) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+   if (!parseMix(mixspec, mix)) {
+      cerr << "Invalid command mix: " << mixspec << "\n";
+      return -1;
+   }
+
+   // Each session is an FD on our side too
+   struct rlimit fdlimit;
+   if (getrlimit(RLIMIT_NOFILE, &fdlimit) == 0) {
+      fdlimit.rlim_cur = fdlimit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &fdlimit);
+   }
+
+   try {
+      LoadGen gen(ip_addr, port, creds, mix, num_sessions, num_idle, rate, think_ms, secs);
+      gen.run();
+      gen.report();
+   } catch (std::runtime_error &e) {
+      cerr << "Benchmark failed: " << e.what() << endl;
+      return -1;
+   }
+
+   return 0;
+}
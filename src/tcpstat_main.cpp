@@ -0,0 +1,337 @@
+/****************************************************************************************
+ * tcpstat - prints live statistics for a running tcpserver: connection, byte and command
+ *           rates, sessions in each login state, the log queue, and latency percentiles for
+ *           Argon2 verifies, hash queue waits and each menu command. Everything is read from
+ *           the server's shared memory metrics segment, so the server does no work for it.
+ *           With -s it instead lists the most recent slow reactor iterations the server's
+ *           watchdog caught.
+ *
+ ****************************************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+using namespace std;
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [-p <portnum>] [-i <secs>] [-n <count>] [-c] [-s]\n";
+   std::cout << "   p: port of the server to watch (default 9999)\n";
+   std::cout << "   i: seconds between reports (default 1)\n";
+   std::cout << "   n: number of reports, 0 to run until interrupted (default 0)\n";
+   std::cout << "   c: report latency percentiles since the server started instead of per interval\n";
+   std::cout << "   s: list the most recent slow reactor iterations and exit\n";
+}
+
+// Every slot summed together
+struct Snapshot {
+   uint64_t counters[mc_num_counters];
+   int64_t gauges[mg_num_gauges];
+   std::vector<uint64_t> hists;
+};
+
+/*****************************************************************************************
+ * MetricsMap - A read-only mapping of a server's metrics segment
+ *****************************************************************************************/
+
+struct MetricsMap {
+   const MetricsHeader *header = NULL;
+   size_t size = 0;
+   ino_t inode = 0;
+
+   ~MetricsMap() { unmap(); };
+
+   void unmap() {
+      if (header != NULL)
+         munmap((void *) header, size);
+      header = NULL;
+   };
+};
+
+/*****************************************************************************************
+ * mapMetrics - maps the segment for port, unless map already has the current one (a
+ *              restarted server makes a new segment under the same name)
+ *
+ *    Returns: true if map holds a valid segment
+ *****************************************************************************************/
+
+bool mapMetrics(unsigned short port, MetricsMap &map) {
+   int fd = shm_open(Metrics::getShmName(port).c_str(), O_RDONLY | O_CLOEXEC, 0);
+   if (fd == -1)
+      return false;
+
+   struct stat st;
+   if ((fstat(fd, &st) == -1) || ((map.header != NULL) && (st.st_ino == map.inode))) {
+      close(fd);
+      return (map.header != NULL);
+   }
+
+   map.unmap();
+   size_t size = Metrics::getShmSize();
+   if ((size_t) st.st_size < size) {
+      close(fd);
+      return false;
+   }
+
+   void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (addr == MAP_FAILED)
+      return false;
+
+   const MetricsHeader *header = (const MetricsHeader *) addr;
+   if ((memcmp(header->magic, metrics_magic, sizeof(metrics_magic)) != 0) ||
+       (header->slot_size != sizeof(MetricsSlot)) || (header->max_slots != metrics_max_slots)) {
+      munmap(addr, size);
+      return false;
+   }
+
+   map.header = header;
+   map.size = size;
+   map.inode = st.st_ino;
+   return true;
+}
+
+void takeSnapshot(const MetricsHeader *header, Snapshot &snap) {
+   bzero(snap.counters, sizeof(snap.counters));
+   bzero(snap.gauges, sizeof(snap.gauges));
+   snap.hists.assign((size_t) mh_num_hists * metrics_hist_buckets, 0);
+
+   uint32_t num_slots = header->num_slots.load(std::memory_order_acquire);
+   const MetricsSlot *slots = Metrics::getSlots(header);
+   for (uint32_t s = 0; (s < num_slots) && (s < metrics_max_slots); s++) {
+      const MetricsSlot &slot = slots[s];
+      for (int c = 0; c < mc_num_counters; c++)
+         snap.counters[c] += slot.counters[c].load(std::memory_order_relaxed);
+      for (int g = 0; g < mg_num_gauges; g++)
+         snap.gauges[g] += slot.gauges[g].load(std::memory_order_relaxed);
+      for (int h = 0; h < mh_num_hists; h++) {
+         for (unsigned int b = 0; b < metrics_hist_buckets; b++)
+            snap.hists[h * metrics_hist_buckets + b] += slot.hists[h][b].load(std::memory_order_relaxed);
+      }
+   }
+}
+
+/*****************************************************************************************
+ * showRate - prints a per-second rate with a k/M suffix
+ *****************************************************************************************/
+
+void showRate(const char *label, uint64_t delta, double secs) {
+   double rate = delta / secs;
+   cout << " " << label << " ";
+   if (rate >= 1e6)
+      cout << fixed << setprecision(1) << rate / 1e6 << "M";
+   else if (rate >= 1e4)
+      cout << fixed << setprecision(1) << rate / 1e3 << "k";
+   else
+      cout << fixed << setprecision(0) << rate;
+}
+
+void report(const MetricsHeader *header, const Snapshot &prev, const Snapshot &cur, double secs,
+            bool cumulative) {
+   time_t now = time(NULL);
+   char stamp[32];
+   strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+   bool running = (kill(header->pid, 0) == 0) || (errno == EPERM);
+
+   cout << "--- " << stamp << "  pid " << header->pid << (running ? "" : " (not running)")
+        << "  up " << (now - header->started) << "s\n";
+
+   cout << "per sec:";
+   showRate("accepted", cur.counters[mc_conns_accepted] - prev.counters[mc_conns_accepted], secs);
+   showRate("rejected", cur.counters[mc_conns_rejected] - prev.counters[mc_conns_rejected], secs);
+   showRate("commands", cur.counters[mc_commands] - prev.counters[mc_commands], secs);
+   showRate("bytes_in", cur.counters[mc_bytes_in] - prev.counters[mc_bytes_in], secs);
+   showRate("bytes_out", cur.counters[mc_bytes_out] - prev.counters[mc_bytes_out], secs);
+   showRate("writes", cur.counters[mc_writes] - prev.counters[mc_writes], secs);
+   showRate("throttled", cur.counters[mc_throttled] - prev.counters[mc_throttled], secs);
+   cout << "\n";
+
+   cout << "sessions:";
+   for (int g = mg_sess_username; g <= mg_sess_confirmpwd; g++)
+      cout << " " << (Metrics::getName((metric_gauge) g) + 5) << " " << cur.gauges[g];
+   cout << "\nlog: queue " << cur.gauges[mg_log_queue_depth] << " dropped "
+        << cur.gauges[mg_log_dropped] << "\n";
+
+   cout << left << setw(16) << "latency (us)" << right << setw(10) << "count" << setw(12) << "p50"
+        << setw(12) << "p99" << setw(12) << "p999" << "\n";
+   for (int h = 0; h < mh_num_hists; h++) {
+      const uint64_t *counts = &cur.hists[h * metrics_hist_buckets];
+      std::vector<uint64_t> delta;
+      if (!cumulative) {
+         delta.resize(metrics_hist_buckets);
+         for (unsigned int b = 0; b < metrics_hist_buckets; b++)
+            delta[b] = counts[b] - prev.hists[h * metrics_hist_buckets + b];
+         counts = delta.data();
+      }
+
+      uint64_t total = 0;
+      for (unsigned int b = 0; b < metrics_hist_buckets; b++)
+         total += counts[b];
+      if (total == 0)
+         continue;
+
+      cout << left << setw(16) << Metrics::getName((metric_hist) h) << right << setw(10) << total
+           << fixed << setprecision(1)
+           << setw(12) << Metrics::getPercentile(counts, 50.0) / 1000.0
+           << setw(12) << Metrics::getPercentile(counts, 99.0) / 1000.0
+           << setw(12) << Metrics::getPercentile(counts, 99.9) / 1000.0 << "\n";
+   }
+   cout << flush;
+}
+
+/*****************************************************************************************
+ * showSlow - lists the slow event ring, oldest first. Events the server overwrote while
+ *            they were being copied are skipped.
+ *****************************************************************************************/
+
+void showSlow(const MetricsHeader *header) {
+   const SlowRing *ring = Metrics::getSlowRing(header);
+
+   std::vector<SlowEvent *> events;
+   for (unsigned int i = 0; i < slow_ring_events; i++) {
+      const SlowEvent &src = ring->events[i];
+      uint64_t seq = src.seq.load(std::memory_order_acquire);
+      if (seq == 0)
+         continue;
+
+      SlowEvent *copy = new SlowEvent;
+      memcpy((void *) copy, (const void *) &src, sizeof(SlowEvent));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (src.seq.load(std::memory_order_relaxed) != seq) {
+         delete copy;
+         continue;
+      }
+      copy->seq.store(seq, std::memory_order_relaxed);
+      events.push_back(copy);
+   }
+
+   std::sort(events.begin(), events.end(), [](const SlowEvent *a, const SlowEvent *b) {
+      return a->seq.load(std::memory_order_relaxed) < b->seq.load(std::memory_order_relaxed);
+   });
+
+   if (events.empty())
+      cout << "No slow reactor iterations recorded.\n";
+
+   for (SlowEvent *ev : events) {
+      time_t secs = ev->when_us / 1000000;
+      char stamp[32];
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+
+      ev->handler[sizeof(ev->handler) - 1] = '\0';
+      ev->status[sizeof(ev->status) - 1] = '\0';
+      cout << stamp << "." << setfill('0') << setw(3) << (ev->when_us / 1000) % 1000
+           << setfill(' ') << "  reactor " << ev->reactor << "  " << fixed << setprecision(1)
+           << ev->duration_ns / 1e6 << "ms  " << ev->handler;
+      if (ev->fd != -1)
+         cout << "  fd " << ev->fd;
+      if (ev->status[0] != '\0')
+         cout << "  " << ev->status;
+      cout << "\n";
+
+      for (uint32_t f = 0; (f < ev->num_frames) && (f < slow_max_frames); f++) {
+         ev->frames[f][slow_frame_len - 1] = '\0';
+         cout << "      " << ev->frames[f] << "\n";
+      }
+      delete ev;
+   }
+   cout << flush;
+}
+
+int main(int argc, char *argv[]) {
+   unsigned short port = 9999;
+   double interval = 1.0;
+   long count = 0;
+   bool cumulative = false;
+   bool slow = false;
+
+   int c = 0;
+   long portval;
+   while ((c = getopt(argc, argv, "p:i:n:cs")) != -1) {
+      switch (c) {
+      case 'p':
+         portval = strtol(optarg, NULL, 10);
+         if ((portval < 1) || (portval > 65535)) {
+            std::cout << "Invalid port. Value must be between 1 and 65535\n";
+            exit(0);
+         }
+         port = (unsigned short) portval;
+         break;
+
+      case 'i':
+         interval = strtod(optarg, NULL);
+         break;
+
+      case 'n':
+         count = strtol(optarg, NULL, 10);
+         break;
+
+      case 'c':
+         cumulative = true;
+         break;
+
+      case 's':
+         slow = true;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   if (interval <= 0) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   MetricsMap map;
+   if (!mapMetrics(port, map)) {
+      cerr << "No metrics found for a server on port " << port << " ("
+           << Metrics::getShmName(port) << ").\n";
+      return -1;
+   }
+
+   if (slow) {
+      showSlow(map.header);
+      return 0;
+   }
+
+   Snapshot prev, cur;
+   takeSnapshot(map.header, prev);
+   auto last = std::chrono::steady_clock::now();
+
+   for (long i = 0; (count == 0) || (i < count); i++) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+
+      // A restarted server has a new segment, start over from its counts
+      ino_t inode = map.inode;
+      if (!mapMetrics(port, map)) {
+         cerr << "Metrics segment for port " << port << " went away.\n";
+         return -1;
+      }
+      if (map.inode != inode)
+         takeSnapshot(map.header, prev);
+
+      takeSnapshot(map.header, cur);
+      auto now = std::chrono::steady_clock::now();
+      report(map.header, prev, cur, std::chrono::duration<double>(now - last).count(), cumulative);
+
+      prev = cur;
+      last = now;
+   }
+
+   return 0;
+}